@@ -1,6 +1,6 @@
 /**
- 这是一个 LISP 语言的简单解释器，没有实现
- GC（垃圾回收）
+ 这是一个 LISP 语言的简单解释器，内存由一个
+ 复制式 GC（垃圾回收）管理
  LISP 是一个非常古老的高级编程语言，因为出现时间
  早，在 AI 领域还有一点点应用，写这个解释器的原因
  只是想了解一下一个解释器是怎么写的。
@@ -10,15 +10,28 @@
  */
 
 // 解释器需要引用的头文件
+#ifdef __linux__
+#define _GNU_SOURCE     // pthread_getattr_np
+#endif
 #include <assert.h>     // 诊断
 #include <ctype.h>      // 提供字符测试函数
+#include <dlfcn.h>      // dlopen，装载编译成 C 的库
+#include <errno.h>
+#include <fcntl.h>      // open
 #include <inttypes.h>   // 提供了各种位宽的整数类型输入输出时的转换标志宏
+#include <limits.h>     // INT_MAX
 #include <stdarg.h>     // 可变参数表，可以遍历未知数目和类型的函数参数表的功能
 #include <stdbool.h>    // 四个布尔型的预定义宏
 #include <stddef.h>     // 定义常见类型与宏，比如 size_t, wchar_t...
 #include <stdio.h>
 #include <stdlib.h>     // 实用函数头文件，比如 malloc...
+#include <pthread.h>    // 解释器运行在一个自己分配了栈的线程里
+#include <setjmp.h>     // 出错时跳回最近的错误处理点
 #include <string.h>     // 处理字符串的头文件
+#include <sys/mman.h>   // mmap，用来为 GC 的两个半区申请内存，以及把源文件映射到内存
+#include <sys/stat.h>
+#include <unistd.h>     // read, close
+#include "minilisp.h"   // 嵌入接口
 
 /**
  30 行至 111 行定义了 Lisp 解释器用到的几个变量的数据结构
@@ -40,6 +53,19 @@ enum {
     TMACRO,
     TSPECIAL,
     TENV,
+    TSTRING,
+    TVECTOR,
+    TTABLE,     // 散列表
+    
+    // 下面两个类型只出现在经过词法分析的函数体里
+    TLVAR,      // 局部变量引用，记录了 (深度, 槽号)
+    TLAMBDA,    // 函数原型：分析好的 lambda，求值时再和当前环境绑定成函数
+    TCALL,      // 函数应用格式，和 TCELL 结构相同，但宏已经展开过了
+    TPREF,      // 应用格式头部的原始函数：car 是标志，cdr 是分析时它的值
+    TCODE,      // 虚拟机的字节码，只在使用 --vm 时出现
+    
+    // 下面这个类型只在 GC 内部使用，表示对象已经被复制到了新的半区
+    TMOVED,
 };
 
 // TSPECIAL 类型下的 子类型
@@ -48,6 +74,8 @@ enum {
     TDOT,
     TCPAREN,
     TTRUE,
+    TUNBOUND,   // 局部变量的槽在 define 执行之前的值
+    TTAILCALL,  // apply 和原始函数的返回值，表示还有一个尾部位置的表达式要求值，见 tail_eval
 };
 
 // 定义初始函数
@@ -56,683 +84,8169 @@ typedef struct Obj *Primitive(struct Obj *env, struct Obj *args);
 // 定义 Obj 对象
 typedef struct Obj {
     // Obj 对象的前 32 位表示 Obj 的类型，任何操作 Obj 的代码在操作 Obj
-    // 前都必须先检查它的类型，然后再去访问接下来的成员变量。
+    // 前都必须先检查它的类型（用 type_of，而不是直接读这个成员，因为
+    // 整数和特殊常量并没有对应的 Obj 结构体，见下面的“带标签的指针”），
+    // 然后再去访问接下来的成员变量。
     int type;
     
+    // 对象占用的总字节数（包括头部），GC 扫描新半区时靠它找到下一个对象
+    int size;
+    
     // Obj 中包含的值
     union {
-        // Int
-        int value;
-        
         // Cell
         struct {
             struct Obj *car;    // 指向 Cell 对象的第一个变量
             struct Obj *cdr;    // 指向 Cell 对象的第二个变量
         };
         
-        // Symbol
-        char name[1];
+        // Symbol，名字的字节紧跟在哈希值后面，查表时比较哈希和名字
+        // 只需要访问同一块内存。全局变量的值直接放在标志里，没有全局
+        // 绑定时是 Unbound
+        struct {
+            struct Obj *value;
+            uint32_t hash;      // 名字的哈希值，创建时算好，重新散列时不用再算
+            char name[1];
+        };
+        
+        // String，目前只用来表示文件名
+        struct {
+            size_t len;
+            char str[1];        // 末尾总是有一个 '\0'，可以直接当作 C 字符串使用
+        };
+        
+        // Vector，元素紧跟在长度后面
+        struct {
+            int nelems;
+            struct Obj *elems[1];
+        };
+        
+        // 散列表。buckets 是一个向量，每个桶是 ((key . value) ...) 形式的链；
+        // 扩容时旧的桶放在 old_buckets 里，每次修改搬几个，搬完之后为 Nil
+        struct {
+            struct Obj *buckets;
+            struct Obj *old_buckets;
+            int nentries;
+            int nmigrated;          // old_buckets 里前面这么多个桶已经搬完了
+        };
         
         // Primitive
-        Primitive *fn;
+        struct {
+            Primitive *fn;
+            int prim_id;            // 原始函数的编号，统计调用次数时使用
+        };
         
-        // Function or Macro（宏）
+        // Function or Macro（宏），TLAMBDA 也使用这个结构，只是没有 env
         struct {
             struct Obj *params;     // 函数的参数
-            struct Obj *body;       // 函数的函数体
+            struct Obj *body;       // 函数的函数体（已经过词法分析）
             struct Obj *env;        // 函数的环境
+            struct Obj *locals;     // 帧里每个槽对应的标志：先是参数，然后是函数体里 define 的变量
+            struct Obj *source;     // 分析前的 (<params> expr ...)，只有展开过宏的函数才保留
+            int nparams;            // 参数的个数
+            int nlocals;            // 帧的大小，也就是 locals 的长度
+            unsigned epoch;         // 展开宏时的 macro_epoch，见 refresh_function
+            bool stack_frame;       // 调用时帧可以放在帧栈上，见“帧栈”
+            struct Obj *code;       // 编译好的字节码，虚拟机第一次调用函数时才编译
         };
         
-        // 对于特殊类型 Obj，还会有副类型
-        int subtype;
+        // 字节码，指令紧跟在常量后面
+        struct {
+            int nops;               // 指令占用的字数
+            int nconsts;
+            unsigned cepoch;        // 编译时的 macro_epoch，不相等时要重新编译
+            unsigned calls;         // 被调用的次数，使用 --jit 时到了 JIT_THRESHOLD 就编译成机器码
+            void *native;           // 机器码，没有时为 NULL，见“即时编译”
+            struct Obj *consts[1];  // 指令里引用的堆上对象，GC 时会被更新
+        };
         
-        // 环境框架，存放了从标志到值的 map
+        // 环境框架。函数调用时创建的帧把变量放在连续的槽里，经过词法分析的
+        // 代码按 (深度, 槽号) 直接访问；全局环境没有槽，全局变量的值放在标志里。
         struct {
-            struct Obj *vars;
+            struct Obj *vars;       // 从标志到值的 map（关联列表），存放运行时动态加入的绑定
             struct Obj *up;
+            struct Obj *names;      // 每个槽对应的标志，按名字查找变量时使用
+            int nslots;
+            struct Obj *slots[1];
+        };
+        
+        // 局部变量引用
+        struct {
+            struct Obj *sym;
+            int depth;              // 要沿 up 向外走几层
+            int slot;
         };
         
-        // 指向前的指针？这里不知道这个 moved 是干什么用的
+        // 转发指针：GC 把对象复制到新半区后，旧对象的类型改为 TMOVED，
+        // 这里记录新对象的地址
         void *moved;
     };
 } Obj;
 
-// Lisp 语言中的几个常量
-static Obj *Nil;            // 相当于 NULL
-static Obj *Dot;            // 相当于 "."
-static Obj *Cparen;         // 相当于括号
-static Obj *True;
-
-// 这个列表包括了所有标志，传统上这种数据结构叫做 "obarray",
-//但这实际上是个列表而不是数组。
-static Obj *Symbols;
-
-// 错误，__attribute((noreturn)) 会提示编译器该函数不会返回值，
-//编译器会将无法执行的代码自动移除实现优化
-static void error(char *fmt, ...) __attribute((noreturn));
-
 /**
- 构造方法
- 120 - 184 行
- @author Charry Lee
- @date 2022-01-11
+ 带标签的指针
+ 堆上的对象至少按 8 字节对齐，所以真正的对象指针最低 3 位总是 0。
+ 我们利用这几位直接在指针里编码最常用的值，这些值不占用堆内存，
+ 判断类型时也不需要访问内存：
+ 
+    ...xxxxxxx1  整数（fixnum），值存放在高 63 位
+    ...xxxxx010  特殊常量，子类型存放在第 3 位以上
+    ...xxxxx000  指向堆上 Obj 结构体的普通指针
  */
+#define TAG_MASK     7
+#define TAG_FIXNUM   1
+#define TAG_SPECIAL  2
 
-// 分配函数，为 Obj 对象根据对象类型分配内存空间
-static Obj *alloc(int type, size_t size) {
-    // 添加类型标志位的 size，这个 value 其实是一个 class 指示器
-    // 这里的作用就是将 type 的内存空间加出来了，因为 Obj 中 type
-    // 之后就是一个 union 变量，实际上对于不同类型的 Obj，只有一种
-    // 变量会被赋值。这里的 union 默认会按最长的成员变量的内存长度为
-    // 每个成员分配内存，从而达到对齐的目的。这里的 value 换成 name
-    // 也是可以的。
-    size += offsetof(Obj, value);       // 在 64 bits 机器上是 8.
-    
-    // 为 Obj 对象分配内存空间
-    Obj *obj = malloc(size);
-    obj->type = type;
-    return obj;
-}
+#define MAKE_SPECIAL(subtype) ((Obj *)(((uintptr_t)(subtype) << 3) | TAG_SPECIAL))
 
-// 各种对象的生成函数
-static Obj *make_int(int value) {
-    Obj *r = alloc(TINT, sizeof(int));
-    r->value = value;
-    return r;
+// Lisp 语言中的几个常量
+#define Nil     MAKE_SPECIAL(TNIL)      // 相当于 NULL
+#define Dot     MAKE_SPECIAL(TDOT)      // 相当于 "."
+#define Cparen  MAKE_SPECIAL(TCPAREN)   // 相当于括号
+#define True    MAKE_SPECIAL(TTRUE)
+#define Unbound MAKE_SPECIAL(TUNBOUND)
+#define TailCall MAKE_SPECIAL(TTAILCALL)
+
+static inline bool is_fixnum(Obj *obj) {
+    return (uintptr_t)obj & TAG_FIXNUM;
 }
 
-static Obj *make_symbol(char *name) {
-    Obj *sym = alloc(TSYMBOL, strlen(name) + 1);
-    strcpy(sym->name, name);
-    return sym;
+// 是否是指向堆上 Obj 结构体的指针
+static inline bool is_pointer(Obj *obj) {
+    return ((uintptr_t)obj & TAG_MASK) == 0;
 }
 
-// 现在还不知道这个 Primitive 有什么用
-static Obj *make_primitive(Primitive *fn) {
-    Obj *r = alloc(TPRIMITIVE, sizeof(Primitive *));
-    r->fn = fn;
-    return r;
+static inline int type_of(Obj *obj) {
+    if (is_fixnum(obj)) {
+        return TINT;
+    }
+    if (!is_pointer(obj)) {
+        return TSPECIAL;
+    }
+    return obj->type;
 }
 
-static Obj *make_function(int type, Obj *params, Obj *body, Obj *env) {
-    assert(type == TFUNCTION || type == TMACRO);
-    Obj *r = alloc(type, sizeof(Obj *) * 3);
-    r->params = params;
-    r->body = body;
-    r->env = env;
-    return r;
+/**
+ CDR 编码
+ 普通单元有 car 和 cdr 两个成员。一次建好的列表（见 make_list）除了最后一个
+ 单元都是紧凑单元：只有头部和 car，cdr 就是紧跟在它后面的那个单元，每个元素
+ 少用一个指针的空间。两种单元的类型都是 TCELL（或者 TCALL），靠 size 区分，
+ 所以读 cdr 一律要用 cdr_of。紧凑单元的 cdr 不能修改，需要修改 cdr 的代码
+ （追加元素、原地反转等）只作用于 cons 建的单元和列表的最后一个单元；GC 复制
+ 时列表被从中间断开的话，断开处的单元会复制成普通单元（见 forward）。
+ */
+
+#define CELL_SIZE (offsetof(Obj, car) + sizeof(Obj *) * 2)
+#define COMPACT_CELL_SIZE (offsetof(Obj, car) + sizeof(Obj *))
+
+static inline bool is_compact(Obj *cell) {
+    return cell->size == COMPACT_CELL_SIZE;
 }
 
-static Obj *make_special(int subtype) {
-    Obj *r = malloc(sizeof(void*) * 2);
-    r->type = TSPECIAL;
-    r->subtype = subtype;
-    return r;
+static inline Obj *cdr_of(Obj *cell) {
+    return is_compact(cell) ? (Obj *)((char *)cell + COMPACT_CELL_SIZE) : cell->cdr;
 }
 
-static Obj *make_env(Obj *vars, Obj *up) {
-    Obj *r = alloc(TENV, sizeof(Obj *) * 2);
-    r->vars = vars;
-    r->up = up;
-    return r;
+// fixnum 能表示的范围
+#define FIXNUM_MAX (INT64_MAX >> 1)
+#define FIXNUM_MIN (INT64_MIN >> 1)
+
+static inline Obj *make_int(int64_t value) {
+    return (Obj *)(((uintptr_t)value << 1) | TAG_FIXNUM);
 }
 
-static Obj *cons(Obj *car, Obj *cdr) {
-    Obj *cell = alloc(TCELL, sizeof(Obj *) * 2);
-    cell->car = car;
-    cell->cdr = cdr;
-    return cell;
+static inline int64_t int_value(Obj *obj) {
+    return (intptr_t)obj >> 1;
 }
 
-// acon 是复合类型，返回的是 ((x . y) . a)
-static Obj *acon(Obj *x, Obj *y, Obj *a) {
-    return cons(cons(x, y), a);
+static inline int special_subtype(Obj *obj) {
+    return (int)((uintptr_t)obj >> 3);
 }
 
 /**
- 语法分析器
- 这部分是一个简易的向下递归的语法分析程序。
- 在阅读这部分之前，有必要简单的了解一下 LISP 的语法。
- @author Charry Lee
- @date 2022-01-12
+ 输出
+ 打印不再每个记号调用一次 printf，而是先写进一块缓冲区。标准输出的缓冲区
+ 在写满、等待终端或管道的输入、报告错误和退出之前才一次写出去。错误报告
+ 这类长度有限的输出直接写进调用者的数组，写满之后就停下来。
  */
+#define OUT_BUFSIZE (64 * 1024)
 
-// 读取
-static Obj *read(void);
+typedef struct Out {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;         // 缓冲区满了写到这里；为 -1 时 buf 是调用者的数组，写不下的部分被丢弃
+    bool full;      // 调用者的数组已经写满
+} Out;
 
-// 将错误信息输出到 stderr 流
-static void error(char *fmt, ...) {
-    va_list ap;                     // 定义一个可变参数表指针 ap（args_pointer）
-    va_start(ap, fmt);              // 从 fmt 的第一个参数开始，初始化 ap
-    vfprintf(stderr, fmt, ap);      // 将 ap 按照 fmt 的格式输入到 stderr 流
-    fprintf(stderr, "\n");          // 添加一个换行符
-    va_end(ap);                     // 使用完 ap 指针以后必须用 va_end 结束 ap 指针
-    exit(1);                        // 发生错误，异常退出（返回 1）
+// 写到 fd 的输出，缓冲区第一次写入时才申请
+static void out_open(Out *o, int fd) {
+    *o = (Out){ .fd = fd };
 }
 
-static int peek(void) {
-    int c = getchar();
-    ungetc(c, stdin);       // 将字符 c 退回到 stdin 中
-    return c;
+// 写到长度为 size 的数组 buf 里，结果总是以 '\0' 结尾
+static void out_open_buffer(Out *o, char *buf, size_t size) {
+    *o = (Out){ .buf = buf, .cap = size ? size - 1 : 0, .fd = -1 };
+    if (size) {
+        buf[0] = '\0';
+    }
 }
 
-/**
- 直到输入新行前一直跳过解释。
- 根据操作系统的实现不同，换行可能为 '\r', "\r\n" or "\n"
- */
-static void skip_line(void) {
-    for (;;) {
-        int c = getchar();
-        if (EOF == c || '\n' == c) {
-            return;
+static void write_fd(int fd, const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(fd, s, n);
+        if (k < 0 && errno == EINTR) {
+            continue;
         }
-        if ('r' == c) {
-            if ('\n' == peek()) {
-                getchar();
-            }
+        if (k <= 0) {
             return;
         }
+        s += k;
+        n -= k;
     }
 }
 
-// 读取列表，要注意此时列表的 '(' 已经被读取到
-static Obj *read_list(void) {
-    // 读取第二个 Obj，并对其中几种错误进行规避。
-    Obj *obj = read();
-    if (!obj) {                             // 未封闭的括号
-        error("Unclosed parenthesis");
-    }
-    if (obj == Dot) {                       // 只有一个点
-        error("Stray Dot");
-    }
-    if (obj == Cparen) {                    // () == Nil
-        return Nil;
+static void out_flush(Out *o) {
+    if (o->fd >= 0 && o->len > 0) {
+        write_fd(o->fd, o->buf, o->len);
+        o->len = 0;
     }
-    
-    // 上面的几种判断错误或判空流程过去后，开始正式的读取列表
-    Obj *head, *tail;
-    head = tail = cons(obj, Nil);     // 初始化为 (head, tail)
-    for (;;) {
-        Obj *obj = read();
-        if (!obj) {
-            error("Unclosed parenthesis");
-        }
-        if (Cparen == obj) {
-            return head;
-        }
-        if (Dot == obj) {
-            tail->cdr = read();
-            if (read() != Cparen) {
-                error("Closed parenthesis excepted after dot");
+}
+
+static void out_write(Out *o, const char *s, size_t n) {
+    if (o->cap - o->len < n) {
+        if (o->fd < 0) {
+            n = o->cap - o->len;
+            o->full = true;
+            if (n == 0) {
+                return;
+            }
+        } else {
+            out_flush(o);
+            if (!o->buf && (o->buf = malloc(OUT_BUFSIZE))) {
+                o->cap = OUT_BUFSIZE;
+            }
+            // 比整个缓冲区还大（或者申请不到缓冲区）就直接写出去
+            if (o->cap < n) {
+                write_fd(o->fd, s, n);
+                return;
             }
-            return head;
         }
-        tail->cdr = cons(obj, Nil);
-        tail = tail->cdr;
     }
-    return Nil;     // 理论上来说应该这一部分永远也不会执行，但是不这么写 Xcode 会报错
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+    if (o->fd < 0) {
+        o->buf[o->len] = '\0';
+    }
 }
 
-// 如果存在同名的标志，则返回已经存在的那个，否则创建一个新的标志。
-static Obj *intern(char *name) {
-    for (Obj *p = Symbols; p != Nil; p = p->cdr) {
-        if (0 == strcmp(name, p->car->name)) {
-            return p->car;
+static inline void out_str(Out *o, const char *s) {
+    out_write(o, s, strlen(s));
+}
+
+static inline void out_char(Out *o, char c) {
+    if (o->len < o->cap) {
+        o->buf[o->len++] = c;
+        if (o->fd < 0) {
+            o->buf[o->len] = '\0';
         }
+    } else {
+        out_write(o, &c, 1);
     }
-    Obj *sym = make_symbol(name);
-    Symbols = cons(sym, Symbols);
-    return sym;
 }
 
-// 读取巨集 '(...)。读取一个表达式然后返回 (quote <expr>)
-static Obj *read_quote(void) {
-    Obj *sym = intern("quote");
-    return cons(sym, cons(read(), Nil));
+// 十进制整数，比 snprintf 快得多，打印很长的数字列表时主要的开销就在这里
+static void out_int(Out *o, int64_t value) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    uint64_t u = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (value < 0) {
+        *--p = '-';
+    }
+    out_write(o, p, buf + sizeof(buf) - p);
 }
 
-static int read_number(int val) {
-    while (isdigit(peek())) {
-        val = val * 10 + (getchar() - '0');
+static void out_close(Out *o) {
+    out_flush(o);
+    if (o->fd >= 0) {
+        free(o->buf);
     }
-    return val;
+    o->buf = NULL;
+    o->len = o->cap = 0;
 }
 
-#define SYMBOL_MAX_LEN 200      // 定义标志最大长度为 200
+/**
+ 解释器上下文
+ 一个解释器的全部状态都放在 Context 里：堆、GC 根、符号表、全局环境、
+ 读取器、错误处理点和虚拟机的栈。每个线程用 ctx 指向它正在使用的上下文，
+ 嵌入接口（见文件末尾）进入解释器时设置它，所以一个进程里可以同时运行
+ 多个解释器，只要同一个上下文不同时被两个线程使用。
+ --heap、--vm 和 --max-depth 这些选项也属于上下文，嵌入时用 MiniLispOptions
+ 设置；字符分类表和指令地址表是整个进程共享的，在第一个上下文创建之后就不再
+ 改变。
+ */
+typedef struct Context {
+    // 创建时决定的选项，见 minilisp_new_with
+    size_t heap_size;           // 每个半区的字节数（--heap）
+    int max_depth;              // 求值的最大嵌套深度（--max-depth）
+    bool use_vm;                // --vm：函数体编译成字节码在虚拟机里执行
+    bool use_jit;               // --jit：虚拟机把经常调用的函数编译成机器码
+    
+    // 内存管理，见下面的“内存管理”
+    char *heap_start;           // 当前半区，新对象在这里分配
+    char *heap_ptr;             // 下一个空闲位置
+    char *heap_limit;           // 当前半区的末尾
+    // 分配不能越过这里。紧凑单元在 GC 时可能被复制成普通单元（见 forward），
+    // 多用 CELL_SIZE - COMPACT_CELL_SIZE 个字节，每个紧凑单元都在半区末尾预留
+    // 这么多，保证新半区总能放下复制过来的对象
+    char *alloc_limit;
+    char *heap_other;           // 另一个半区，GC 时对象被复制到这里
+    char *from_start;           // GC 期间旧半区的范围
+    char *from_end;
+    Obj ***roots;               // 登记为 GC 根的局部变量的指针
+    size_t nroots;
+    size_t roots_cap;
+    char *frames_start;         // 帧栈，见“帧栈”
+    char *frames_ptr;
+    char *frames_limit;
+    bool evacuating;            // 正在为搬走的帧运行 GC
+    
+    // 所有标志都登记在这个哈希表里，传统上这种数据结构叫做 "obarray"。
+    // 采用开放寻址（线性探测），容量总是 2 的幂，空槽为 NULL。
+    Obj **symtab;
+    size_t symtab_cap;
+    size_t symtab_count;
+    char *symbol_arena;         // 最近申请的一块标志区域，开头保存着上一块的地址
+    char *symbol_arena_ptr;
+    char *symbol_arena_limit;
+    char *image_symbols;        // 从映像映射进来的标志，见“映像”
+    size_t image_symbols_len;
+    Obj **globals;              // 有全局值的标志。标志不在 GC 堆里，它们的值要作为根
+    size_t nglobals;
+    size_t globals_cap;
+    
+    const char **prim_names;    // 所有原始函数的名字，按编号排列
+    int nprims;
+    int prims_cap;
+    
+    Obj *env;                   // 全局环境
+    // 分析时需要认出的几个特殊格式
+    Obj *Sym_quote;
+    Obj *Sym_lambda;
+    Obj *Sym_define;
+    Obj *Sym_defun;
+    Obj *Sym_defmacro;
+    Obj *Sym_macroexpand;
+    // 函数体里的宏在词法分析时就已经展开了，每当一个宏被重新定义，这个计数
+    // 就加一，展开过宏的函数在下次调用时会发现自己过期了，重新分析一遍。
+    unsigned macro_epoch;
+    
+    int eval_depth;             // 求值嵌套的层数
+    char *stack_limit;          // 栈增长到这个地址以下就报错
+    // 正在求值的最内层函数应用。记录的是 eval 里登记为根的变量 obj 的地址，
+    // GC 移动了对象也不用另外更新。出错时报告这个表达式
+    Obj **current_form;
+    // tail_eval 交给 eval 的表达式和环境。返回 TailCall 之后 eval 立刻取走
+    // 它们，中间不会分配内存，所以不用登记为 GC 的根
+    Obj *tail_env;
+    Obj *tail_expr;
+    
+    // 虚拟机的值栈和活动记录栈，都不在 GC 堆里，GC 时作为根
+    Obj **vm_stack;
+    Obj **vm_stack_end;
+    size_t vm_sp;               // 执行可能分配内存的操作之前同步
+    struct Activation *vm_frames;
+    size_t vm_nframes;
+    size_t vm_frames_cap;
+    char *jit_start;            // 机器码，见“即时编译”。第一次编译时申请
+    char *jit_ptr;              // 下一个没用过的页，之前的页都已经不可写
+    bool jit_disabled;          // 申请不到内存，或者用完了
+    
+    Out out;                    // 标准输出的缓冲区
+    struct Reader *reader;      // 当前正在读取的输入
+    struct Parser *parsers;     // 见“增量解析”
+    struct Handler *handler;    // 最近的错误处理点，没有时出错直接退出
+    char error_message[512];    // 最近一次错误的信息，不带位置，catch 把它交给 Lisp 代码
+    char error_report[1024];    // 完整的错误报告：位置、信息和出错的表达式
+    bool had_error;             // 顶层报告过错误，进程退出时返回 1
+    bool exiting;               // 嵌入时 (exit) 正在跳回调用解释器的函数，catch 不拦截
+    
+    struct Context *parent;     // pmap 的工作线程使用的上下文指向父解释器，见“并行求值”
+    
+#ifdef MINILISP_STATS
+    // 见下面的“统计”
+    uint64_t stat_allocs;
+    uint64_t stat_alloc_bytes;
+    uint64_t stat_gcs;
+    uint64_t stat_type_allocs[TMOVED];  // 按类型分的对象个数和字节数
+    uint64_t stat_type_bytes[TMOVED];
+    uint64_t stat_evals;                // eval 被调用的次数
+    uint64_t stat_applies;              // 调用 Lisp 函数的次数（包括虚拟机里的调用）
+    uint64_t stat_finds;                // 按名字查找变量的次数
+    uint64_t stat_find_steps;           // 查找时比较过的名字个数
+    uint64_t stat_expansions;           // 宏展开的次数
+    uint64_t stat_stack_frames;         // 放在帧栈上的帧
+    uint64_t stat_evacuations;          // 被闭包引用、搬到堆上的帧
+    uint64_t stat_jit_functions;        // 编译成机器码的字节码
+    uint64_t *stat_prim_calls;          // 按原始函数编号分的调用次数
+#endif
+} Context;
+
+static __thread Context *ctx;   // 当前线程正在使用的上下文
+
+// 错误，__attribute((noreturn)) 会提示编译器该函数不会返回值，
+//编译器会将无法执行的代码自动移除实现优化
+static void error(char *fmt, ...) __attribute((noreturn));
+
+/**
+ 内存管理
+ 堆被分成大小相同的两个半区，对象总是在当前半区里用一个指针向后
+ "推"的方式分配（bump allocation），分配只需要一次比较和一次加法。
+ 当前半区用完时运行 Cheney 的复制式 GC：把从根可达的对象复制到另一个
+ 半区，然后交换两个半区。没有被复制的对象就是垃圾，整个旧半区一次性
+ 被丢弃，所以回收的代价只和存活对象的数量有关。
+ */
+
+#define DEFAULT_HEAP_SIZE (16 * 1024 * 1024)   // 每个半区默认 16MB，可以用 --heap 修改
+
+// 设置环境变量 MINILISP_DEBUG_GC 后每次分配都会运行 GC，并且把旧半区设为
+// 不可访问，这样漏登记的根会立刻以段错误的形式暴露出来。
+static bool always_gc = false;
+
+/**
+ 统计
+ 用 -DMINILISP_STATS 编译时记录分配的对象个数、字节数和 GC 的次数，运行时
+ 加 --stats 会在退出时把它们打印到标准错误。没有定义时 STAT 展开为空，不会
+ 拖慢正常的构建。
+ */
+#ifdef MINILISP_STATS
+#define STAT(stmt) stmt
+#else
+#define STAT(stmt)
+#endif
+
+static void gc(void);
+static void vm_gc_roots(void);
+static void parser_gc_roots(void);
 
-static Obj *read_symbol(char c) {
-    char buf[SYMBOL_MAX_LEN + 1];
-    int len = 1;
-    buf[0] = c;
-    while (isalnum(peek()) || '-' == peek()) {
-        if (SYMBOL_MAX_LEN <= len) {
-            error("Symbol name too long");
+/**
+ GC 根
+ C 函数里的局部变量如果在一次可能分配内存的调用之后还要继续使用，就必须
+ 登记为根：GC 会把对象移动到新地址，只有登记过的变量才会被一并更新。
+ 用法是在函数开头写 GC_FRAME，然后对每个需要保护的变量写 GC_ROOT(x)，
+ 函数返回时（无论从哪个 return）登记会被自动撤销。
+ */
+static void gc_push_root(Obj **var) {
+    if (ctx->nroots == ctx->roots_cap) {
+        ctx->roots_cap = ctx->roots_cap ? ctx->roots_cap * 2 : 1024;
+        ctx->roots = realloc(ctx->roots, sizeof(Obj **) * ctx->roots_cap);
+        if (!ctx->roots) {
+            error("Out of memory for GC roots");
         }
-        buf[len++] = getchar();
     }
-    buf[len] = '\0';
-    return intern(buf);
+    ctx->roots[ctx->nroots++] = var;
 }
 
-// read 函数的具体实现就，这个应该是一个很重要的函数。
-static Obj *read(void) {
-    for (; ; ) {
-        int c = getchar();
-        if (' ' == c || '\n' == c || '\r' == c || '\t' == c) {
-            continue;
-        }
-        if (EOF == c) {
-            return NULL;
-        }
-        if (';' == c) {
-            skip_line();
-            continue;
-        }
-        if ('(' == c) {
-            return read_list();
-        }
-        if (')' == c) {
-            return Cparen;
+static void gc_pop_roots(size_t *saved) {
+    ctx->nroots = *saved;
+}
+
+#define GC_FRAME size_t gc_frame_ __attribute((cleanup(gc_pop_roots))) = ctx->nroots
+#define GC_ROOT(var) gc_push_root(&(var))
+
+// hint 是希望得到的地址，只是一个建议，被占用时系统会另选一个
+static void *alloc_space(void *hint, size_t size) {
+    void *p = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        error("Cannot allocate %zu bytes of heap", size);
+    }
+    return p;
+}
+
+static void init_heap(void *hint) {
+    ctx->heap_start = ctx->heap_ptr = alloc_space(hint, ctx->heap_size);
+    ctx->heap_limit = ctx->alloc_limit = ctx->heap_start + ctx->heap_size;
+    ctx->heap_other = alloc_space(NULL, ctx->heap_size);
+    if (always_gc) {
+        mprotect(ctx->heap_other, ctx->heap_size, PROT_NONE);
+    }
+    // 帧栈和半区一样大，用到的部分才真正占用内存
+    ctx->frames_start = mmap(NULL, ctx->heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ctx->frames_start == MAP_FAILED) {
+        error("Cannot allocate %zu bytes of frame stack", ctx->heap_size);
+    }
+    ctx->frames_ptr = ctx->frames_start;
+    ctx->frames_limit = ctx->frames_start + ctx->heap_size;
+}
+
+// 保证当前半区至少还有 size 个字节，不够时先运行 GC。快速路径：当前半区还
+// 放得下时什么也不做，分配只需要推进指针
+static inline void reserve(size_t size) {
+    if (always_gc || (size_t)(ctx->alloc_limit - ctx->heap_ptr) < size) {
+        gc();
+        if ((size_t)(ctx->alloc_limit - ctx->heap_ptr) < size) {
+            error("Memory exhausted");
         }
-        if ('.' == c) {
-            return Dot;
+    }
+}
+
+// 分配函数，为 Obj 对象根据对象类型分配内存空间
+static inline Obj *alloc(int type, size_t size) {
+    // 添加类型标志位的 size，这个 value 其实是一个 class 指示器
+    // 这里的作用就是将 type 的内存空间加出来了，因为 Obj 中 type
+    // 之后就是一个 union 变量，实际上对于不同类型的 Obj，只有一种
+    // 变量会被赋值。这里的 union 默认会按最长的成员变量的内存长度为
+    // 每个成员分配内存，从而达到对齐的目的。这里的 car 换成 fn
+    // 也是可以的（整数现在编码在指针里，已经没有 value 成员了）。
+    size += offsetof(Obj, car);         // 在 64 bits 机器上是 8.
+    
+    // 向上取整到指针大小的倍数，让下一个对象仍然是对齐的；同时保证
+    // 对象至少能放下 GC 用的转发指针
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (size < sizeof(Obj *) * 2) {
+        size = sizeof(Obj *) * 2;
+    }
+    
+    reserve(size);
+    Obj *obj = (Obj *)ctx->heap_ptr;
+    ctx->heap_ptr += size;
+    obj->type = type;
+    obj->size = (int)size;
+    STAT(ctx->stat_allocs++; ctx->stat_alloc_bytes += size);
+    STAT(ctx->stat_type_allocs[type]++; ctx->stat_type_bytes[type] += size);
+    return obj;
+}
+
+/**
+ 复制式 GC
+ */
+
+// 把旧半区里的一个对象复制到新半区，在旧对象里留下转发指针
+static inline Obj *copy_object(Obj *obj) {
+    Obj *copy = (Obj *)ctx->heap_ptr;
+    memcpy(copy, obj, obj->size);
+    ctx->heap_ptr += obj->size;
+    obj->type = TMOVED;
+    obj->moved = copy;
+    return copy;
+}
+
+// 把旧半区里的对象复制到新半区并返回新地址；立即数和不在旧半区里的
+// 对象原样返回。
+static Obj *forward(Obj *obj) {
+    if (!is_pointer(obj) || (char *)obj < ctx->from_start || ctx->from_end <= (char *)obj) {
+        // 从帧栈搬到堆上的帧，引用改成指向堆上的那一份，见 evacuate_frame
+        if (ctx->evacuating && is_pointer(obj) && ctx->frames_start <= (char *)obj
+            && (char *)obj < ctx->frames_ptr && obj->type == TMOVED) {
+            return forward(obj->moved);
         }
-        if (isdigit(c)) {
-            return make_int(read_number(c - '0'));
+        return obj;
+    }
+    if (obj->type == TMOVED) {
+        return obj->moved;
+    }
+    if (obj->type != TCELL && obj->type != TCALL) {
+        return copy_object(obj);
+    }
+    // 列表的骨架顺着 cdr 一次复制完，复制之后单元仍然紧挨着排列，遍历列表
+    // 时依次访问相邻的内存。各个单元的 car 留给扫描时再复制
+    Obj *copy = NULL;
+    for (Obj *prev = NULL; ; ) {
+        Obj *next = cdr_of(obj);
+        Obj *cell;
+        if (is_compact(obj) && next->type == TMOVED) {
+            // 有别的引用指向列表中间，后半段已经先复制走了，这个单元复制成
+            // 普通单元，用 cdr 接上后半段
+            cell = (Obj *)ctx->heap_ptr;
+            ctx->heap_ptr += CELL_SIZE;
+            cell->type = obj->type;
+            cell->size = CELL_SIZE;
+            cell->car = obj->car;
+            cell->cdr = next->moved;
+            obj->type = TMOVED;
+            obj->moved = cell;
+        } else {
+            cell = copy_object(obj);
+            if (is_compact(cell)) {
+                ctx->alloc_limit -= CELL_SIZE - COMPACT_CELL_SIZE;
+            }
         }
-        if ('-' == c) {
-            return make_int(-read_number(c - '0'));
+        if (prev && !is_compact(prev)) {
+            prev->cdr = cell;
         }
-        if (isalpha(c) || strchr("+=!@#$%^&*", c)) {
-            return read_symbol(c);
+        copy = copy ? copy : cell;
+        prev = cell;
+        // 紧凑单元的 cdr 必须紧跟着复制；普通单元的 cdr 是还没复制的单元时
+        // 也接着复制
+        if (!is_compact(cell) && (!is_pointer(next) || (char *)next < ctx->from_start
+                                  || ctx->from_end <= (char *)next || next->type != TCELL)) {
+            return copy;
         }
-        error("Don't know how to handle %c", c);
+        obj = next;
     }
 }
 
-// 将给定的 Obj 打印到控制台
-static void print(Obj *obj) {
+// 对 obj 里的每个对象引用调用 fn，用返回值替换原来的引用。GC、保存和装载
+// 映像都靠它找到对象里的引用，增加新的类型时只需要在这里登记。总是内联，
+// GC 里对 fn 的调用会被展开成直接调用
+static inline __attribute((always_inline)) void scan_object(Obj *obj, Obj *(*fn)(void *, Obj *), void *data) {
     switch (obj->type) {
-        case TINT:
-            printf("%d", obj->value);
+        case TPRIMITIVE:
+        case TSTRING:
             break;
         case TCELL:
-            printf("(");
-            for (; ; ) {
-                print(obj->car);
-                if (Nil == obj->cdr) {
-                    break;
-                }
-                if (TCELL != obj->cdr->type) {
-                    printf(" . ");
-                    print(obj->cdr);
-                    break;
-                }
-                obj = obj->cdr;
+        case TCALL:
+            // 紧凑单元的 cdr 是紧跟着的单元，没有要替换的引用
+            obj->car = fn(data, obj->car);
+            if (!is_compact(obj)) {
+                obj->cdr = fn(data, obj->cdr);
             }
-            printf(")");
             break;
-        case TSYMBOL:
-            printf("%s", obj->name);
-            break;
-        case TPRIMITIVE:
-            printf("<primitive>");
+        case TPREF:
+            obj->car = fn(data, obj->car);
+            obj->cdr = fn(data, obj->cdr);
             break;
         case TFUNCTION:
-            printf("<function>");
-            break;
         case TMACRO:
-            printf("<marcro>");
+        case TLAMBDA:
+            obj->params = fn(data, obj->params);
+            obj->body = fn(data, obj->body);
+            obj->env = fn(data, obj->env);
+            obj->locals = fn(data, obj->locals);
+            obj->source = fn(data, obj->source);
+            obj->code = fn(data, obj->code);
             break;
-        case TSPECIAL:
-            if (Nil == obj) {
-                printf("()");
-            } else if (True == obj) {
-                printf("t");
-            } else {
-                error("Bug: print: Unknown subtype: %d", obj->subtype);
-                return;
+        case TCODE:
+            for (int i = 0; i < obj->nconsts; i++) {
+                obj->consts[i] = fn(data, obj->consts[i]);
+            }
+            break;
+        case TENV:
+            obj->vars = fn(data, obj->vars);
+            obj->up = fn(data, obj->up);
+            obj->names = fn(data, obj->names);
+            for (int i = 0; i < obj->nslots; i++) {
+                obj->slots[i] = fn(data, obj->slots[i]);
+            }
+            break;
+        case TVECTOR:
+            for (int i = 0; i < obj->nelems; i++) {
+                obj->elems[i] = fn(data, obj->elems[i]);
             }
-            
+            break;
+        case TTABLE:
+            obj->buckets = fn(data, obj->buckets);
+            obj->old_buckets = fn(data, obj->old_buckets);
+            break;
+        case TLVAR:
+            obj->sym = fn(data, obj->sym);
+            break;
         default:
-            error("Bug: print: Unknown tag type: %d", obj->type);
+            error("Bug: Unknown tag type: %d", obj->type);
     }
 }
 
-//取得列表的长度
-static int list_length(Obj *list) {
-    int len = 0;
-    for (; ; ) {
-        if (Nil == list) {
-            return len;
-        }
-        if (TCELL != list->type) {
-            error("length: cannot handle dotted list");
+static Obj *gc_forward(void *data, Obj *obj) {
+    (void)data;
+    return forward(obj);
+}
+
+// 从 scan 开始扫描当前半区，把每个对象引用的对象也复制过来。heap_ptr 会在
+// 扫描过程中继续后移，当 scan 追上 heap_ptr 时所有可达对象都已复制完毕。
+static void gc_scan(char *scan) {
+    for (; scan < ctx->heap_ptr; scan += ((Obj *)scan)->size) {
+        scan_object((Obj *)scan, gc_forward, NULL);
+    }
+}
+
+static void gc(void) {
+    STAT(ctx->stat_gcs++);
+    // 交换两个半区，之后的复制都发生在新的当前半区里
+    ctx->from_start = ctx->heap_start;
+    ctx->from_end = ctx->heap_limit;
+    ctx->heap_start = ctx->heap_ptr = ctx->heap_other;
+    ctx->heap_limit = ctx->alloc_limit = ctx->heap_start + ctx->heap_size;
+    ctx->heap_other = ctx->from_start;
+    if (always_gc) {
+        mprotect(ctx->heap_start, ctx->heap_size, PROT_READ | PROT_WRITE);
+    }
+    
+    // 先复制根直接引用的对象
+    for (size_t i = 0; i < ctx->nroots; i++) {
+        *ctx->roots[i] = forward(*ctx->roots[i]);
+    }
+    ctx->env = forward(ctx->env);
+    for (size_t i = 0; i < ctx->nglobals; i++) {
+        ctx->globals[i]->value = forward(ctx->globals[i]->value);
+    }
+    vm_gc_roots();
+    parser_gc_roots();
+    // 帧栈上的帧不移动，但是它们引用的对象要复制过来
+    for (char *p = ctx->frames_start; p < ctx->frames_ptr; ) {
+        Obj **owner = (Obj **)p;
+        Obj *frame = (Obj *)(owner + 1);
+        *owner = forward(*owner);
+        if (frame->type != TMOVED) {
+            scan_object(frame, gc_forward, NULL);
         }
-        list = list->cdr;
-        len++;
+        p += sizeof(Obj *) + frame->size;
+    }
+    
+    // 再从头扫描新半区，把每个对象引用的对象也复制过来
+    gc_scan(ctx->heap_start);
+    
+    if (always_gc) {
+        mprotect(ctx->heap_other, ctx->heap_size, PROT_NONE);
     }
+    ctx->from_start = ctx->from_end = NULL;
 }
 
 /**
- Evaluator 计算式
- 这部分负责实现 Obj 之间的各种运算
- 
+ 构造方法
  @author Charry Lee
- @date 2022-01-13
+ @date 2022-01-11
  */
 
-static Obj *eval(Obj *env, Obj *obj);
+/**
+ 标志不会被回收（符号表一直引用着它们），所以不放在 GC 堆里，而是从
+ 一块只增不减的区域里分配，GC 时也就不需要复制它们。
+ */
+#define SYMBOL_ARENA_SIZE (64 * 1024)
 
-static void add_variable(Obj *env, Obj *sym, Obj *val) {
-    env->vars = acon(sym, val, env->vars);
+// 各种对象的生成函数
+static Obj *make_symbol(const char *name, size_t len, uint32_t hash) {
+    size_t size = offsetof(Obj, name) + len + 1;
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if ((size_t)(ctx->symbol_arena_limit - ctx->symbol_arena_ptr) < size) {
+        size_t chunk = size > SYMBOL_ARENA_SIZE ? size : SYMBOL_ARENA_SIZE;
+        // 每块的开头记下上一块，销毁上下文时顺着它们释放
+        char *arena = malloc(sizeof(char *) + chunk);
+        if (!arena) {
+            error("Out of memory for symbols");
+        }
+        *(char **)arena = ctx->symbol_arena;
+        ctx->symbol_arena = arena;
+        ctx->symbol_arena_ptr = arena + sizeof(char *);
+        ctx->symbol_arena_limit = ctx->symbol_arena_ptr + chunk;
+    }
+    Obj *sym = (Obj *)ctx->symbol_arena_ptr;
+    ctx->symbol_arena_ptr += size;
+    sym->type = TSYMBOL;
+    sym->size = (int)size;
+    sym->value = Unbound;
+    sym->hash = hash;
+    memcpy(sym->name, name, len);
+    sym->name[len] = '\0';
+    return sym;
 }
 
-// 返回一个新创建的环境框架
-static Obj *push_env(Obj *env, Obj *vars, Obj *values) {
-    if (list_length(vars) != list_length(values)) {
-        error("Cannot apply function: number of argument doesn't match");
+// 复制 len 个字节作为字符串的内容；s 为 NULL 时只分配空间，由调用者填写
+static Obj *make_string(const char *s, size_t len) {
+    Obj *r = alloc(TSTRING, sizeof(size_t) + len + 1);
+    r->len = len;
+    if (s) {
+        memcpy(r->str, s, len);
     }
-    Obj *map = Nil;
-    for (Obj *p = vars, *q = values; p != Nil; p = p->cdr, q = q->cdr) {
-        Obj *sym = p->car;
-        Obj *val = q->car;
-        map = acon(sym, val, map);
+    r->str[len] = '\0';
+    return r;
+}
+
+// 登记一个原始函数的名字，返回它的编号。装载映像时原始函数对象已经在堆里，
+// 只需要登记名字
+static int register_primitive(const char *name) {
+    if (ctx->nprims == ctx->prims_cap) {
+        ctx->prims_cap = ctx->prims_cap ? ctx->prims_cap * 2 : 64;
+        ctx->prim_names = realloc(ctx->prim_names, sizeof(char *) * ctx->prims_cap);
+        STAT(ctx->stat_prim_calls = realloc(ctx->stat_prim_calls, sizeof(uint64_t) * ctx->prims_cap));
+        if (!ctx->prim_names) {
+            error("Out of memory for primitives");
+        }
     }
-    return make_env(map, env);
+    STAT(ctx->stat_prim_calls[ctx->nprims] = 0);
+    ctx->prim_names[ctx->nprims] = name;
+    return ctx->nprims++;
 }
 
-// 从头部开始计算列表元素并且返回最后一个值
-static Obj *progn(Obj *env, Obj *list) {
-    Obj *r = NULL;
-    for (Obj *lp = list; lp != Nil; lp = lp->cdr) {
-        r = eval(env, lp->car);
+// 现在还不知道这个 Primitive 有什么用
+static Obj *make_primitive(Primitive *fn, const char *name) {
+    int id = register_primitive(name);
+    Obj *r = alloc(TPRIMITIVE, sizeof(Primitive *) + sizeof(int));
+    r->fn = fn;
+    r->prim_id = id;
+    return r;
+}
+
+// 函数和宏对象的大小（不含头部）
+#define FUNCTION_SIZE (sizeof(Obj *) * 6 + sizeof(int) * 2 + sizeof(unsigned) + sizeof(bool))
+
+// 函数原型，由词法分析生成
+static Obj *make_lambda(Obj *params, Obj *body, Obj *locals, Obj *source, int nparams, int nlocals) {
+    GC_FRAME;
+    GC_ROOT(params);
+    GC_ROOT(body);
+    GC_ROOT(locals);
+    GC_ROOT(source);
+    Obj *r = alloc(TLAMBDA, FUNCTION_SIZE);
+    r->params = params;
+    r->body = body;
+    r->env = NULL;
+    r->locals = locals;
+    r->source = source;
+    r->nparams = nparams;
+    r->nlocals = nlocals;
+    r->epoch = 0;
+    r->stack_frame = false;
+    r->code = NULL;
+    return r;
+}
+
+static Obj *heap_env(Obj *env);
+
+// 把函数原型和环境绑定成函数或宏
+static Obj *make_function(int type, Obj *proto, Obj *env) {
+    assert(type == TFUNCTION || type == TMACRO);
+    GC_FRAME;
+    GC_ROOT(proto);
+    GC_ROOT(env);
+    // 函数会一直引用 env，帧栈上的帧要先搬到堆上
+    env = heap_env(env);
+    Obj *r = alloc(type, FUNCTION_SIZE);
+    r->params = proto->params;
+    r->body = proto->body;
+    r->env = env;
+    r->locals = proto->locals;
+    r->source = proto->source;
+    r->nparams = proto->nparams;
+    r->nlocals = proto->nlocals;
+    r->epoch = proto->epoch;
+    r->stack_frame = proto->stack_frame;
+    r->code = proto->code;
+    return r;
+}
+
+static Obj *make_env(Obj *vars, Obj *up) {
+    GC_FRAME;
+    GC_ROOT(vars);
+    GC_ROOT(up);
+    Obj *r = alloc(TENV, offsetof(Obj, slots) - offsetof(Obj, vars));
+    r->vars = vars;
+    r->up = up;
+    r->names = Nil;
+    r->nslots = 0;
+    return r;
+}
+
+// 函数调用时使用的帧，所有槽初始化为 Unbound
+static Obj *make_frame(Obj *up, Obj *names, int nslots) {
+    GC_FRAME;
+    GC_ROOT(up);
+    GC_ROOT(names);
+    Obj *r = alloc(TENV, offsetof(Obj, slots) - offsetof(Obj, vars) + sizeof(Obj *) * nslots);
+    r->vars = Nil;
+    r->up = up;
+    r->names = names;
+    r->nslots = nslots;
+    for (int i = 0; i < nslots; i++) {
+        r->slots[i] = Unbound;
     }
     return r;
 }
 
-// 计算所有列表元素并且返回他们的值作为一个新的列表
-static Obj *eval_list(Obj *env, Obj *list) {
-    Obj *head = NULL;
-    Obj *tail = NULL;
-    for (Obj *lp = list; lp != Nil; lp = lp->cdr) {
-        Obj *tmp = eval(env, lp->car);
-        if (head == NULL) {
-            head = tail = cons(tmp, Nil);
+/**
+ 帧栈
+ 不会被闭包引用的帧不在堆上分配，而是放在帧栈上，调用结束时整块弹出，
+ 函数调用因此不再产生垃圾。每一项是被调用的函数，后面紧跟着一个和
+ make_frame 的结果完全一样的 TENV 对象，访问变量的代码不用区分两种帧。
+ 只有词法分析时确定函数体里没有 lambda 这类格式的函数（stack_frame）才
+ 使用帧栈。运行时才展开的宏仍然可能创建引用帧的闭包，这时 make_function
+ 调用 heap_env 把帧搬到堆上，再运行一次 GC 把所有的引用改过去。
+ 帧栈在 GC 时是根；eval 和虚拟机在调用返回时弹出帧，尾调用时把新的帧
+ 移到旧帧的位置上，所以尾递归只占用固定的空间。
+ */
+
+static inline bool foreign(void *loc);
+
+// 帧栈上每个帧前面保存的函数
+#define FRAME_OWNER(frame) (((Obj **)(frame))[-1])
+
+static inline bool on_frame_stack(Obj *env) {
+    return ctx->frames_start <= (char *)env && (char *)env < ctx->frames_limit;
+}
+
+// 为函数 fn 的一次调用创建帧，所有槽初始化为 Unbound。帧可能被闭包引用，
+// 或者帧栈已经满了的时候在堆上创建
+static Obj *push_frame(Obj *fn) {
+    size_t size = offsetof(Obj, slots) + sizeof(Obj *) * fn->nlocals;
+    if (!fn->stack_frame || (size_t)(ctx->frames_limit - ctx->frames_ptr) < sizeof(Obj *) + size) {
+        return make_frame(fn->env, fn->locals, fn->nlocals);
+    }
+    STAT(ctx->stat_stack_frames++);
+    Obj **owner = (Obj **)ctx->frames_ptr;
+    ctx->frames_ptr += sizeof(Obj *) + size;
+    *owner = fn;
+    Obj *r = (Obj *)(owner + 1);
+    r->type = TENV;
+    r->size = (int)size;
+    r->vars = Nil;
+    r->up = fn->env;
+    r->names = fn->locals;
+    r->nslots = fn->nlocals;
+    for (int i = 0; i < fn->nlocals; i++) {
+        r->slots[i] = Unbound;
+    }
+    return r;
+}
+
+// 把帧栈上的 frame 搬到堆上。原来的位置留下转发指针，接着运行的 GC 把
+// 所有的引用都改成堆上的那一份。它的函数以后不再使用帧栈
+static void evacuate_frame(Obj *frame) {
+    STAT(ctx->stat_evacuations++);
+    Obj *copy = alloc(TENV, frame->size - offsetof(Obj, vars));
+    memcpy(copy, frame, frame->size);
+    Obj *owner = FRAME_OWNER(frame);
+    if (!foreign(owner)) {
+        owner->stack_frame = false;
+    }
+    frame->type = TMOVED;
+    frame->moved = copy;
+    ctx->evacuating = true;
+    gc();
+    ctx->evacuating = false;
+}
+
+// 保证 env 的环境链上没有帧栈上的帧，返回搬动之后的 env
+static Obj *heap_env(Obj *env) {
+    GC_FRAME;
+    GC_ROOT(env);
+    for (Obj *p = env; p; ) {
+        if (on_frame_stack(p)) {
+            evacuate_frame(p);
+            p = env;            // GC 之后 env 也可能变了，从头再检查一遍
         } else {
-            tail->cdr = cons(tmp, Nil);
-            tail = tail->cdr;
+            p = p->up;
         }
     }
-    if (head == NULL) {
+    return env;
+}
+
+static Obj *make_pref(Obj *sym, Obj *prim) {
+    GC_FRAME;
+    GC_ROOT(prim);
+    Obj *r = alloc(TPREF, sizeof(Obj *) * 2);
+    r->car = sym;
+    r->cdr = prim;
+    return r;
+}
+
+static Obj *make_lvar(Obj *sym, int depth, int slot) {
+    Obj *r = alloc(TLVAR, sizeof(Obj *) + sizeof(int) * 2);
+    r->sym = sym;       // 标志不在 GC 堆里，不需要登记为根
+    r->depth = depth;
+    r->slot = slot;
+    return r;
+}
+
+static Obj *cons(Obj *car, Obj *cdr) {
+    GC_FRAME;
+    GC_ROOT(car);
+    GC_ROOT(cdr);
+    Obj *cell = alloc(TCELL, sizeof(Obj *) * 2);
+    cell->car = car;
+    cell->cdr = cdr;
+    return cell;
+}
+
+// 由 n 个连续存放的单元组成的列表，car 都是 ()。长度事先知道的列表用它
+// 一次分配好整个骨架，再由调用者填写 car：前 n - 1 个是紧凑单元，最后一个
+// 是 cdr 为 () 的普通单元（见“CDR 编码”）。骨架在内存里是连续的，之后的
+// 遍历顺序访问内存，GC 复制时也会保持这个顺序（见 forward）
+static Obj *make_list(int n) {
+    if (n == 0) {
         return Nil;
     }
+    // 连同紧凑单元要预留的空间一起检查
+    reserve(CELL_SIZE * n);
+    ctx->alloc_limit -= (CELL_SIZE - COMPACT_CELL_SIZE) * (n - 1);
+    Obj *head = (Obj *)ctx->heap_ptr;
+    for (int i = 0; i < n; i++) {
+        Obj *cell = (Obj *)ctx->heap_ptr;
+        cell->type = TCELL;
+        cell->car = Nil;
+        if (i + 1 < n) {
+            cell->size = COMPACT_CELL_SIZE;
+        } else {
+            cell->size = CELL_SIZE;
+            cell->cdr = Nil;
+        }
+        ctx->heap_ptr += cell->size;
+    }
+    STAT(size_t size = COMPACT_CELL_SIZE * (n - 1) + CELL_SIZE);
+    STAT(ctx->stat_allocs += n; ctx->stat_alloc_bytes += size);
+    STAT(ctx->stat_type_allocs[TCELL] += n; ctx->stat_type_bytes[TCELL] += size);
     return head;
 }
 
-// 判断是否为列表
-static bool is_list(Obj *obj) {
-    return obj == Nil || obj->type == TCELL;
+// 向量对象的大小（不含头部）
+#define VECTOR_SIZE(n) (offsetof(Obj, elems) - offsetof(Obj, car) + sizeof(Obj *) * (n))
+
+// 向量最多能有多少个元素：对象的大小要能放进 int
+#define VECTOR_MAX ((int64_t)((INT_MAX - offsetof(Obj, elems)) / sizeof(Obj *)))
+
+// 长度为 n 的向量，每个元素都是 fill
+static Obj *make_vector(int64_t n, Obj *fill) {
+    if (n < 0 || VECTOR_MAX < n) {
+        error("make-vector: invalid length %" PRId64, n);
+    }
+    GC_FRAME;
+    GC_ROOT(fill);
+    Obj *r = alloc(TVECTOR, VECTOR_SIZE(n));
+    r->nelems = (int)n;
+    for (int i = 0; i < n; i++) {
+        r->elems[i] = fill;
+    }
+    return r;
 }
 
-// 将参数应用到 fn 上
-static Obj *apply(Obj *env, Obj *fn, Obj *args) {
-    if (!is_list(args)) {
-        error("argument must be a list");
+// 用列表的元素创建向量
+static Obj *list_to_vector(Obj *list, const char *name) {
+    int n = 0;
+    for (Obj *p = list; p != Nil; p = cdr_of(p), n++) {
+        if (type_of(p) != TCELL) {
+            error("%s: not a proper list", name);
+        }
+    }
+    GC_FRAME;
+    GC_ROOT(list);
+    Obj *r = make_vector(n, Nil);
+    for (int i = 0; i < n; i++, list = cdr_of(list)) {
+        r->elems[i] = list->car;
+    }
+    return r;
+}
+
+// acon 是复合类型，返回的是 ((x . y) . a)
+static Obj *acon(Obj *x, Obj *y, Obj *a) {
+    GC_FRAME;
+    GC_ROOT(a);
+    Obj *cell = cons(x, y);
+    return cons(cell, a);
+}
+
+/**
+ 语法分析器
+ 这部分是一个简易的向下递归的语法分析程序。
+ 在阅读这部分之前，有必要简单的了解一下 LISP 的语法。
+ @author Charry Lee
+ @date 2022-01-12
+ */
+
+/**
+ 输入
+ 读取器不再一个字符一个字符地调用 getchar，而是直接用下标在一段内存里
+ 扫描：普通文件（包括重定向进来的标准输入）用 mmap 整个映射进来，管道和
+ 终端则按块 read 进一个缓冲区，扫描到末尾时再补充。读取器同时记录行号，
+ 出错时可以报告错误发生的位置。
+ */
+typedef struct Reader {
+    char *buf;              // 输入的字节
+    size_t pos;             // 下一个要读的字节
+    size_t len;             // buf 中有效字节的个数
+    size_t cap;             // 缓冲区的容量，映射文件时为 0
+    size_t mark;            // 当前 token 的开始位置，补充缓冲区时从这里开始的字节要保留
+    int fd;                 // 还可以继续 read 的文件描述符，没有时为 -1
+    bool own_fd;            // fd 是否由读取器打开，需要由它关闭
+    bool mapped;            // buf 是映射进来的文件，需要 munmap
+    const char *name;       // 输入的名字，报错时使用
+    int line;               // 当前行号，从 1 开始
+    size_t line_start;      // 当前行第一个字节的位置，用来计算列号
+    int depth;              // 当前所在的列表嵌套层数
+    int form_line;          // 当前顶层表达式开始的行号
+    int err_col;            // 语法错误发生的列号，为 0 时只报告行号
+    struct Reader *prev;    // 打开这个输入之前正在读取的输入
+} Reader;
+
+#define READ_CHUNK (64 * 1024)
+
+// 读取一个表达式
+static Obj *read_expr(void);
+
+// 跳回最近的错误处理点，见后面的“错误恢复”
+static void throw_error(void) __attribute((noreturn));
+
+// 记下错误信息，然后跳回最近的错误处理点
+static void verror(char *fmt, va_list ap) __attribute((noreturn));
+
+static void verror(char *fmt, va_list ap) {
+    if (!ctx) {
+        // 还没有创建上下文，比如命令行参数有错
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    vsnprintf(ctx->error_message, sizeof(ctx->error_message), fmt, ap);  // 将 ap 按照 fmt 的格式写入 error_message
+    throw_error();
+}
+
+static void error(char *fmt, ...) {
+    va_list ap;                     // 定义一个可变参数表指针 ap（args_pointer）
+    va_start(ap, fmt);              // 从 fmt 的第一个参数开始，初始化 ap
+    verror(fmt, ap);
+    va_end(ap);                     // 使用完 ap 指针以后必须用 va_end 结束 ap 指针
+}
+
+// 语法错误，报告当前读到的行和列
+static void read_error(char *fmt, ...) __attribute((noreturn));
+
+static void read_error(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    ctx->reader->form_line = ctx->reader->line;
+    ctx->reader->err_col = (int)(ctx->reader->pos - ctx->reader->line_start) + 1;
+    verror(fmt, ap);
+    va_end(ap);
+}
+
+// 补充缓冲区，没有更多输入时返回 false
+static bool reader_fill(void) {
+    Reader *r = ctx->reader;
+    if (r->fd < 0) {
+        return false;
+    }
+    // 已经处理过的字节不再需要，把当前 token 挪到缓冲区开头
+    if (r->mark > 0) {
+        memmove(r->buf, r->buf + r->mark, r->len - r->mark);
+        r->len -= r->mark;
+        r->pos -= r->mark;
+        r->line_start -= r->mark;
+        r->mark = 0;
+    }
+    if (r->cap - r->len < READ_CHUNK / 2) {
+        r->cap = r->cap ? r->cap * 2 : READ_CHUNK;
+        r->buf = realloc(r->buf, r->cap);
+        if (!r->buf) {
+            error("Out of memory for input buffer");
+        }
+    }
+    // 输入来自终端或者管道时，对方可能在等前面的输出
+    out_flush(&ctx->out);
+    for (;;) {
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n > 0) {
+            r->len += n;
+            return true;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r->own_fd) {
+            close(r->fd);
+        }
+        r->fd = -1;
+        return false;
+    }
+}
+
+static inline int peek(void) {
+    if (ctx->reader->pos == ctx->reader->len && !reader_fill()) {
+        return EOF;
+    }
+    return (unsigned char)ctx->reader->buf[ctx->reader->pos];
+}
+
+// 取出下一个字符，顺便维护行号
+static inline int next_char(void) {
+    int c = peek();
+    if (c != EOF) {
+        ctx->reader->pos++;
+        if ('\n' == c) {
+            ctx->reader->line++;
+            ctx->reader->line_start = ctx->reader->pos;
+        }
+    }
+    return c;
+}
+
+// 从文件描述符创建读取器。普通文件直接映射到内存，其他的按块读取。
+static void reader_open(Reader *r, int fd, bool own_fd, const char *name) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->name = name;
+    r->line = r->form_line = 1;
+    r->prev = ctx->reader;
+    
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (st.st_size == 0 || offset >= st.st_size) {
+            // 空文件，不需要映射
+            if (own_fd) {
+                close(fd);
+            }
+            return;
+        }
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            r->buf = p;
+            r->mapped = true;
+            r->len = st.st_size;
+            r->pos = r->mark = r->line_start = offset < 0 ? 0 : (size_t)offset;
+            if (own_fd) {
+                close(fd);
+            } else {
+                // 标准输入被我们整个读完了，和 read 到末尾的效果保持一致
+                lseek(fd, 0, SEEK_END);
+            }
+            return;
+        }
+    }
+    r->fd = fd;
+    r->own_fd = own_fd;
+}
+
+// 从内存中的一段文本创建读取器，文本由调用者管理，读取期间不能释放
+static void reader_open_string(Reader *r, const char *src, size_t len, const char *name) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->name = name;
+    r->line = r->form_line = 1;
+    r->prev = ctx->reader;
+    r->buf = (char *)src;
+    r->len = len;
+}
+
+static void reader_close(Reader *r) {
+    if (r->cap) {
+        free(r->buf);
+    } else if (r->mapped) {
+        munmap(r->buf, r->len);
+    }
+    if (r->fd >= 0 && r->own_fd) {
+        close(r->fd);
+    }
+}
+
+// 字符分类表：可以作为标志第一个字符的，和可以出现在标志中间的
+enum {
+    CH_SYMBOL_START = 1,
+    CH_SYMBOL = 2,
+};
+
+static unsigned char char_class[256];
+
+static void init_char_class(void) {
+    for (int c = 0; c < 256; c++) {
+        if (isalpha(c)) {
+            char_class[c] |= CH_SYMBOL_START;
+        }
+        if (isalnum(c)) {
+            char_class[c] |= CH_SYMBOL;
+        }
+    }
+    for (const char *p = "+-*/<>=!?@#$%^&_"; *p; p++) {
+        char_class[(unsigned char)*p] |= CH_SYMBOL_START | CH_SYMBOL;
+    }
+}
+
+/**
+ 直到输入新行前一直跳过解释。
+ 根据操作系统的实现不同，换行可能为 '\r', "\r\n" or "\n"
+ */
+static void skip_line(void) {
+    for (;;) {
+        // 在已经读进来的字节里直接找行尾
+        Reader *r = ctx->reader;
+        const char *p = r->buf + r->pos;
+        const char *end = r->buf + r->len;
+        while (p < end && '\n' != *p && '\r' != *p) {
+            p++;
+        }
+        r->pos = p - r->buf;
+        int c = next_char();
+        if (EOF == c || '\n' == c) {
+            return;
+        }
+        if ('\r' == c) {
+            if ('\n' == peek()) {
+                next_char();
+            }
+            return;
+        }
+    }
+}
+
+// 读到一半的表达式出错之后，丢掉它剩下的部分：一直跳过输入，直到当前
+// 所在的 depth 层列表都已经结束。字符串和注释里的括号不算
+static void skip_form(void) {
+    int depth = ctx->reader->depth;
+    while (depth > 0) {
+        int c = next_char();
+        if (EOF == c) {
+            return;
+        }
+        if ('(' == c) {
+            depth++;
+        } else if (')' == c) {
+            depth--;
+        } else if (';' == c) {
+            skip_line();
+        } else if ('"' == c) {
+            for (c = next_char(); EOF != c && '"' != c; c = next_char()) {
+                if ('\\' == c) {
+                    next_char();
+                }
+            }
+        }
+    }
+}
+
+// 读取嵌套的列表和引用时递归，和 enter_eval 一样在栈快用完时报错
+static void check_read_stack(void) {
+    char here;
+    if (&here < ctx->stack_limit) {
+        read_error("Stack overflow: nesting too deep");
+    }
+}
+
+static Obj **vm_grow_stack(Obj **sp);
+
+// 读取列表，要注意此时列表的 '(' 已经被读取到
+static Obj *read_list(void) {
+    check_read_stack();
+    GC_FRAME;
+    ctx->reader->depth++;
+    // 长度事先不知道，元素先依次压在虚拟机的值栈上，那里是 GC 的根，出错时
+    // 由处理点恢复。读完之后再一次分配出连续的骨架（见 make_list）
+    size_t base = ctx->vm_sp;
+    Obj *tail = Nil;
+    GC_ROOT(tail);
+    int n = 0;
+    for (;; n++) {
+        Obj *obj = read_expr();
+        if (!obj) {                         // 未封闭的括号
+            read_error("Unclosed parenthesis");
+        }
+        if (Cparen == obj) {                // () == Nil
+            break;
+        }
+        if (Dot == obj) {
+            if (n == 0) {                   // 点的前面没有元素
+                read_error("Stray Dot");
+            }
+            tail = read_expr();
+            if (tail == Cparen) {
+                // 右括号已经读掉了，出错之后不用再跳过这个列表
+                ctx->reader->depth--;
+            }
+            if (!tail || tail == Dot || tail == Cparen || read_expr() != Cparen) {
+                read_error("Closed parenthesis excepted after dot");
+            }
+            break;
+        }
+        if (ctx->vm_stack + ctx->vm_sp == ctx->vm_stack_end) {
+            vm_grow_stack(ctx->vm_stack + ctx->vm_sp);
+        }
+        ctx->vm_stack[ctx->vm_sp++] = obj;
+    }
+    ctx->reader->depth--;
+    Obj *head = make_list(n);
+    Obj **items = ctx->vm_stack + base;
+    ctx->vm_sp = base;
+    for (Obj *cell = head; cell != Nil; cell = cdr_of(cell)) {
+        cell->car = *items++;
+        if (cdr_of(cell) == Nil) {
+            cell->cdr = tail;
+            break;
+        }
+    }
+    return head;
+}
+
+// FNV-1a 字符串哈希
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// 把符号表扩大一倍，已有的标志按缓存的哈希值重新放置
+static void symtab_grow(void) {
+    size_t cap = ctx->symtab_cap ? ctx->symtab_cap * 2 : 256;
+    Obj **tab = calloc(cap, sizeof(Obj *));
+    if (!tab) {
+        error("Out of memory for symbol table");
+    }
+    for (size_t i = 0; i < ctx->symtab_cap; i++) {
+        Obj *sym = ctx->symtab[i];
+        if (!sym) {
+            continue;
+        }
+        size_t j = sym->hash & (cap - 1);
+        while (tab[j]) {
+            j = (j + 1) & (cap - 1);
+        }
+        tab[j] = sym;
+    }
+    free(ctx->symtab);
+    ctx->symtab = tab;
+    ctx->symtab_cap = cap;
+}
+
+// 把一个已经存在的标志放进符号表，装载映像时使用
+static void symtab_add(Obj *sym) {
+    if (ctx->symtab_count * 2 >= ctx->symtab_cap) {
+        symtab_grow();
+    }
+    size_t i = sym->hash & (ctx->symtab_cap - 1);
+    while (ctx->symtab[i]) {
+        i = (i + 1) & (ctx->symtab_cap - 1);
+    }
+    ctx->symtab[i] = sym;
+    ctx->symtab_count++;
+}
+
+// 标志在符号表里的槽号
+static size_t symtab_slot(Obj *sym) {
+    size_t i = sym->hash & (ctx->symtab_cap - 1);
+    while (ctx->symtab[i] != sym) {
+        i = (i + 1) & (ctx->symtab_cap - 1);
+    }
+    return i;
+}
+
+// 如果存在同名的标志，则返回已经存在的那个，否则创建一个新的标志。
+// name 不需要以 '\0' 结尾，读取器直接传入输入缓冲区里的字节。
+// pmap 的工作线程共用父解释器的符号表，同一个名字才会是同一个标志。
+// 它们同时在里面添加标志时用这个锁互斥
+static pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Obj *intern_len(const char *name, size_t len) {
+    if (ctx->parent) {
+        Context *self = ctx;
+        pthread_mutex_lock(&symbol_lock);
+        ctx = self->parent;
+        Obj *sym = intern_len(name, len);
+        ctx = self;
+        pthread_mutex_unlock(&symbol_lock);
+        return sym;
+    }
+    uint32_t hash = hash_name(name, len);
+    // 装载率保持在一半以下，探测序列就会很短
+    if (ctx->symtab_count * 2 >= ctx->symtab_cap) {
+        symtab_grow();
+    }
+    size_t i = hash & (ctx->symtab_cap - 1);
+    for (; ctx->symtab[i]; i = (i + 1) & (ctx->symtab_cap - 1)) {
+        Obj *sym = ctx->symtab[i];
+        if (sym->hash == hash && 0 == memcmp(name, sym->name, len) && '\0' == sym->name[len]) {
+            return sym;
+        }
+    }
+    Obj *sym = make_symbol(name, len, hash);
+    ctx->symtab[i] = sym;
+    ctx->symtab_count++;
+    return sym;
+}
+
+static Obj *intern(char *name) {
+    return intern_len(name, strlen(name));
+}
+
+// 读取巨集 '(...)。读取一个表达式然后返回 (quote <expr>)
+static Obj *read_quote(void) {
+    check_read_stack();
+    GC_FRAME;
+    Obj *sym = intern("quote");     // 标志不在 GC 堆里，不会被移动
+    Obj *expr = read_expr();
+    GC_ROOT(expr);
+    expr = cons(expr, Nil);
+    return cons(sym, expr);
+}
+
+// 读取整数剩下的数字，sign 为 -1 时读的是负数。超出 fixnum 范围时报错
+static Obj *read_number(int64_t val, int sign) {
+    // 负数的范围比正数多一个
+    int64_t limit = sign > 0 ? FIXNUM_MAX : -FIXNUM_MIN;
+    while (isdigit(peek())) {
+        int d = next_char() - '0';
+        if (val > (limit - d) / 10) {
+            read_error("Number too large");
+        }
+        val = val * 10 + d;
+    }
+    return make_int(sign > 0 ? val : -val);
+}
+
+#define SYMBOL_MAX_LEN 200      // 定义标志最大长度为 200
+
+// 标志的第一个字符已经读过了，它位于 mark 处。名字直接在缓冲区里取，不再复制。
+static Obj *read_symbol(void) {
+    Reader *r = ctx->reader;
+    for (;;) {
+        while (r->pos < r->len && (char_class[(unsigned char)r->buf[r->pos]] & CH_SYMBOL)) {
+            r->pos++;
+        }
+        // 缓冲区到头了，补充之后标志可能还没结束
+        if (r->pos < r->len || !reader_fill()) {
+            break;
+        }
+    }
+    size_t len = r->pos - r->mark;
+    if (SYMBOL_MAX_LEN < len) {
+        read_error("Symbol name too long");
+    }
+    return intern_len(r->buf + r->mark, len);
+}
+
+// 读取字符串，开头的 '"' 已经读过了
+static Obj *read_string(void) {
+    // 先找到结尾的引号，算出字符串的长度
+    size_t len = 0;
+    for (;;) {
+        int c = next_char();
+        if (EOF == c) {
+            read_error("Unclosed string");
+        }
+        if ('"' == c) {
+            break;
+        }
+        if ('\\' == c && EOF == next_char()) {
+            read_error("Unclosed string");
+        }
+        len++;
+    }
+    // 再把转义之后的内容复制出来，mark 保证了这段字节还在缓冲区里
+    Obj *str = make_string(NULL, len);
+    const char *p = ctx->reader->buf + ctx->reader->mark + 1;
+    for (size_t i = 0; i < len; i++, p++) {
+        if ('\\' == *p) {
+            p++;
+            str->str[i] = 'n' == *p ? '\n' : 't' == *p ? '\t' : *p;
+        } else {
+            str->str[i] = *p;
+        }
+    }
+    return str;
+}
+
+// 读取 #(...)，开头的 '#' 已经读过了
+static Obj *read_vector(void) {
+    next_char();
+    Obj *list = read_list();
+    for (Obj *p = list; p != Nil; p = cdr_of(p)) {
+        if (type_of(p) != TCELL) {
+            read_error("Malformed vector");
+        }
+    }
+    return list_to_vector(list, "read");
+}
+
+// read_expr 函数的具体实现就，这个应该是一个很重要的函数。
+static Obj *read_expr(void) {
+    for (; ; ) {
+        ctx->reader->mark = ctx->reader->pos;
+        int c = next_char();
+        if (' ' == c || '\n' == c || '\r' == c || '\t' == c) {
+            continue;
+        }
+        if (EOF == c) {
+            return NULL;
+        }
+        if (';' == c) {
+            skip_line();
+            continue;
+        }
+        // 第一行的 #! 是给系统看的，脚本可以直接执行
+        if ('#' == c && '!' == peek() && 1 == ctx->reader->line) {
+            skip_line();
+            continue;
+        }
+        if (0 == ctx->reader->depth) {
+            ctx->reader->form_line = ctx->reader->line;
+        }
+        if ('(' == c) {
+            return read_list();
+        }
+        if (')' == c) {
+            return Cparen;
+        }
+        if ('\'' == c) {
+            return read_quote();
+        }
+        if ('"' == c) {
+            return read_string();
+        }
+        if ('#' == c && '(' == peek()) {
+            return read_vector();
+        }
+        if ('.' == c) {
+            return Dot;
+        }
+        if (isdigit(c)) {
+            return read_number(c - '0', 1);
+        }
+        if ('-' == c && isdigit(peek())) {
+            return read_number(0, -1);
+        }
+        if (char_class[c] & CH_SYMBOL_START) {
+            return read_symbol();
+        }
+        read_error("Don't know how to handle %c", c);
+    }
+}
+
+// 打印不是列表也不是向量的对象
+static void print_atom(Out *out, Obj *obj) {
+    switch (type_of(obj)) {
+        case TINT:
+            out_int(out, int_value(obj));
+            break;
+        case TSYMBOL:
+            out_str(out, obj->name);
+            break;
+        case TSTRING:
+            out_char(out, '"');
+            for (size_t i = 0; i < obj->len; i++) {
+                char c = obj->str[i];
+                if ('"' == c || '\\' == c) {
+                    out_char(out, '\\');
+                    out_char(out, c);
+                } else if ('\n' == c) {
+                    out_str(out, "\\n");
+                } else {
+                    out_char(out, c);
+                }
+            }
+            out_char(out, '"');
+            break;
+        case TPRIMITIVE:
+            out_str(out, "<primitive>");
+            break;
+        case TFUNCTION:
+            out_str(out, "<function>");
+            break;
+        case TMACRO:
+            out_str(out, "<marcro>");
+            break;
+        case TLVAR:
+            out_str(out, obj->sym->name);
+            break;
+        case TPREF:
+            out_str(out, obj->car->name);
+            break;
+        case TLAMBDA:
+            out_str(out, "<lambda>");
+            break;
+        case TTABLE:
+            out_str(out, "<hash-table ");
+            out_int(out, obj->nentries);
+            out_char(out, '>');
+            break;
+        case TSPECIAL:
+            if (Nil == obj) {
+                out_str(out, "()");
+            } else if (True == obj) {
+                out_str(out, "t");
+            } else {
+                error("Bug: print: Unknown subtype: %d", special_subtype(obj));
+            }
+            break;
+        default:
+            error("Bug: print: Unknown tag type: %d", obj->type);
+    }
+}
+
+// 打印时还没有打印完的列表或向量。列表的 obj 是正在打印的单元，向量的 i 是
+// 正在打印的元素的下标
+typedef struct PrintFrame {
+    Obj *obj;
+    int i;
+} PrintFrame;
+
+#define PRINT_STACK 64
+
+// 将给定的 Obj 打印到 out。嵌套的列表和向量放在一个显式的栈上，不再递归，
+// 所以再深的结构也不会让 C 栈溢出。打印不会分配 GC 堆上的内存
+static void print_to(Out *out, Obj *obj) {
+    PrintFrame small[PRINT_STACK];
+    PrintFrame *stack = small;
+    int cap = PRINT_STACK;
+    int n = 0;
+    for (;;) {
+        // 打印 obj：列表和向量先打印开头的括号，然后从第一个元素开始
+        int type = type_of(obj);
+        if ((type == TCELL || type == TCALL || (type == TVECTOR && obj->nelems > 0))) {
+            if (n == cap) {
+                PrintFrame *p = malloc(sizeof(PrintFrame) * cap * 2);
+                if (!p) {
+                    if (stack != small) {
+                        free(stack);
+                    }
+                    error("Out of memory for print");
+                }
+                memcpy(p, stack, sizeof(PrintFrame) * cap);
+                if (stack != small) {
+                    free(stack);
+                }
+                stack = p;
+                cap *= 2;
+            }
+            stack[n++] = (PrintFrame){ obj, 0 };
+            if (type == TVECTOR) {
+                out_str(out, "#(");
+                obj = obj->elems[0];
+            } else {
+                out_char(out, '(');
+                obj = obj->car;
+            }
+            continue;
+        }
+        if (type == TVECTOR) {
+            out_str(out, "#()");
+        } else {
+            print_atom(out, obj);
+        }
+        
+        // 找到下一个要打印的对象，同时打印已经结束的列表和向量的右括号。
+        // 写满了长度有限的输出（比如错误报告）就不用再往下走了，这样带环的
+        // 列表也不会让打印停不下来
+        for (;;) {
+            if (n == 0 || out->full) {
+                if (stack != small) {
+                    free(stack);
+                }
+                return;
+            }
+            PrintFrame *f = &stack[n - 1];
+            if (type_of(f->obj) == TVECTOR) {
+                if (++f->i < f->obj->nelems) {
+                    out_char(out, ' ');
+                    obj = f->obj->elems[f->i];
+                    break;
+                }
+            } else if (f->i == 0) {
+                Obj *rest = cdr_of(f->obj);
+                if (TCELL == type_of(rest)) {
+                    out_char(out, ' ');
+                    f->obj = rest;
+                    obj = rest->car;
+                    break;
+                }
+                if (Nil != rest) {
+                    // 点对形式的尾部，打印完它再打印右括号
+                    out_str(out, " . ");
+                    f->i = 1;
+                    obj = rest;
+                    break;
+                }
+            }
+            out_char(out, ')');
+            n--;
+        }
+    }
+}
+
+// 将给定的 Obj 打印到标准输出
+static void print(Obj *obj) {
+    print_to(&ctx->out, obj);
+}
+
+//取得列表的长度
+static int list_length(Obj *list) {
+    int len = 0;
+    for (; ; ) {
+        if (Nil == list) {
+            return len;
+        }
+        if (TCELL != type_of(list)) {
+            error("length: cannot handle dotted list");
+        }
+        list = cdr_of(list);
+        len++;
+    }
+}
+
+/**
+ Evaluator 计算式
+ 这部分负责实现 Obj 之间的各种运算
+ 
+ @author Charry Lee
+ @date 2022-01-13
+ */
+
+static Obj *eval(Obj *env, Obj *obj);
+static Obj **find(Obj *env, Obj *sym);
+static void refresh_function(Obj *fn);
+static Obj *vm_run(Obj *fn, Obj *frame);
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// pmap 的工作线程只能读父解释器堆里的对象，不能修改：写进去的指针会指向
+// 工作线程自己的堆，任务结束之后就失效了。loc 是要写入的位置
+static inline bool foreign(void *loc) {
+    return ctx->parent && ((char *)loc < ctx->heap_start || ctx->heap_limit <= (char *)loc);
+}
+
+static void check_store(void *loc) {
+    if (foreign(loc)) {
+        error("Cannot modify shared data in a pmap worker");
+    }
+}
+
+// 覆盖一个变量之前调用，旧的值是宏的话让所有展开结果失效。编译好的字节码
+// 把原始函数内联成了指令，所以覆盖原始函数也要让它们重新编译。新的值是宏
+// 时，分析时把这个名字当作函数应用的代码也要重新分析，见 optimize_call
+static inline void note_overwrite(Obj *old, Obj *val) {
+    if (type_of(old) == TMACRO || type_of(old) == TPRIMITIVE || type_of(val) == TMACRO) {
+        ctx->macro_epoch++;
+    }
+}
+
+// 设置标志的全局值
+static void set_global(Obj *sym, Obj *val) {
+    if (sym->value == Unbound) {
+        if (ctx->nglobals == ctx->globals_cap) {
+            size_t cap = ctx->globals_cap ? ctx->globals_cap * 2 : 256;
+            Obj **globals = realloc(ctx->globals, sizeof(Obj *) * cap);
+            if (!globals) {
+                error("Out of memory for globals");
+            }
+            ctx->globals = globals;
+            ctx->globals_cap = cap;
+        }
+        ctx->globals[ctx->nglobals++] = sym;
+    }
+    sym->value = val;
+}
+
+static void add_variable(Obj *env, Obj *sym, Obj *val) {
+    // 全局环境里的变量放在标志里
+    bool global = !env->up;
+    check_store(global ? &sym->value : &env->vars);
+    Obj **old = find(env, sym);
+    note_overwrite(old ? *old : Unbound, val);
+    if (global) {
+        set_global(sym, val);
+        return;
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    // 同一个环境里已经有这个变量时直接修改原来的绑定
+    for (Obj *cell = env->vars; cell != Nil; cell = cdr_of(cell)) {
+        Obj *bind = cell->car;
+        if (bind->car == sym) {
+            bind->cdr = val;
+            return;
+        }
+    }
+    Obj *vars = acon(sym, val, env->vars);
+    env->vars = vars;
+}
+
+// 为调用 fn 创建一个新的帧，values 是已经求好值的实参列表
+static Obj *push_env(Obj *env, Obj *fn, Obj *values) {
+    if (list_length(values) != fn->nparams) {
+        error("Cannot apply function: number of argument doesn't match");
+    }
+    GC_FRAME;
+    GC_ROOT(values);
+    Obj *frame = make_frame(env, fn->locals, fn->nlocals);
+    for (int i = 0; values != Nil; values = cdr_of(values), i++) {
+        frame->slots[i] = values->car;
+    }
+    return frame;
+}
+
+// 从头部开始计算列表元素并且返回最后一个值
+static Obj *progn(Obj *env, Obj *list) {
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *r = NULL;
+    for (; list != Nil; list = cdr_of(list)) {
+        r = eval(env, list->car);
+    }
+    return r;
+}
+
+// 计算所有列表元素并且返回他们的值作为一个新的列表
+static Obj *eval_list(Obj *env, Obj *list) {
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *head = make_list(list_length(list));
+    Obj *cell = head;
+    GC_ROOT(head);
+    GC_ROOT(cell);
+    for (; list != Nil; list = cdr_of(list), cell = cdr_of(cell)) {
+        Obj *value = eval(env, list->car);
+        cell->car = value;
+    }
+    return head;
+}
+
+// 判断是否为列表
+static bool is_list(Obj *obj) {
+    return obj == Nil || type_of(obj) == TCELL;
+}
+
+/**
+ 尾调用和求值深度
+ 函数体的最后一个表达式、if 的分支都处在尾部位置，它们的值就是整个调用的
+ 值。apply 和 if 不递归求值这样的表达式，而是用 tail_eval 把它交回给 eval，
+ 由 eval 的循环接着求值，所以尾递归写成的循环只占用固定的 C 栈。
+ 其他的递归求值仍然使用 C 栈，解释器运行在一个按 --max-depth 分配了足够
+ 大的栈的线程里（见 main），嵌套超过这个深度时报错，而不是让进程崩溃。
+ */
+
+#define DEFAULT_MAX_DEPTH 100000
+#define STACK_PER_DEPTH 1024            // 每层求值预留的 C 栈字节数
+#define STACK_MARGIN (256 * 1024)       // 栈底留给错误处理和原始函数的空间
+
+static void stack_overflow(void) __attribute((noreturn));
+
+static void stack_overflow(void) {
+    error("Stack overflow: nesting deeper than %d", ctx->max_depth);
+}
+
+// 当前线程的栈底再往上留出 STACK_MARGIN 的地址，求值时栈增长到这里就报错。
+// 取不到栈的范围时（不是 Linux 或者 macOS）为 NULL，这时只按 --max-depth 检查
+static __thread char *thread_stack_limit;
+static __thread bool thread_stack_known;
+
+static char *current_stack_limit(void) {
+    if (!thread_stack_known) {
+#if defined(__linux__)
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        if (!pthread_getattr_np(pthread_self(), &attr)) {
+            if (!pthread_attr_getstack(&attr, &addr, &size) && size > STACK_MARGIN) {
+                thread_stack_limit = (char *)addr + STACK_MARGIN;
+            }
+            pthread_attr_destroy(&attr);
+        }
+#elif defined(__APPLE__)
+        // macOS 给出的是栈顶，也就是最高的地址
+        char *top = pthread_get_stackaddr_np(pthread_self());
+        size_t size = pthread_get_stacksize_np(pthread_self());
+        if (size > STACK_MARGIN) {
+            thread_stack_limit = top - size + STACK_MARGIN;
+        }
+#endif
+        thread_stack_known = true;
+    }
+    return thread_stack_limit;
+}
+
+static inline int enter_eval(void) {
+    char here;
+    if (++ctx->eval_depth > ctx->max_depth || &here < ctx->stack_limit) {
+        stack_overflow();
+    }
+    return ctx->eval_depth;
+}
+
+static inline void leave_eval(int *depth) {
+    ctx->eval_depth = *depth - 1;
+}
+
+static inline void restore_form(Obj ***saved) {
+    ctx->current_form = *saved;
+}
+
+// 弹出这次求值期间压入帧栈的帧
+static inline void pop_frames(char **saved) {
+    ctx->frames_ptr = *saved;
+}
+
+static Obj *tail_eval(Obj *env, Obj *expr) {
+    ctx->tail_env = env;
+    ctx->tail_expr = expr;
+    return TailCall;
+}
+
+// 在 eval 以外调用原始函数时使用，替它求值尾部位置的表达式
+static Obj *call_primitive(Obj *prim, Obj *env, Obj *args) {
+    STAT(ctx->stat_prim_calls[prim->prim_id]++);
+    Obj *r = prim->fn(env, args);
+    return r == TailCall ? eval(ctx->tail_env, ctx->tail_expr) : r;
+}
+
+// 将参数应用到 fn 上。函数体的最后一个表达式不在这里求值，而是通过
+// tail_eval 交给调用者
+static Obj *apply(Obj *env, Obj *fn, Obj *args) {
+    if (!is_list(args)) {
+        error("argument must be a list");
+    }
+    if (type_of(fn) == TPRIMITIVE) {
+        STAT(ctx->stat_prim_calls[fn->prim_id]++);
+        return fn->fn(env, args);
+    }
+    if (type_of(fn) == TFUNCTION) {
+        STAT(ctx->stat_applies++);
+        if (list_length(args) != fn->nparams) {
+            error("Cannot apply function: number of argument doesn't match");
+        }
+        // 实参直接求值到新帧的槽里，不再先拼出一个实参列表
+        GC_FRAME;
+        GC_ROOT(env);
+        GC_ROOT(fn);
+        GC_ROOT(args);
+        refresh_function(fn);
+        Obj *frame = push_frame(fn);
+        GC_ROOT(frame);
+        for (int i = 0; args != Nil; args = cdr_of(args), i++) {
+            Obj *value = eval(env, args->car);
+            frame->slots[i] = value;
+        }
+        if (ctx->use_vm) {
+            return vm_run(fn, frame);
+        }
+        Obj *body = fn->body;
+        GC_ROOT(body);
+        for (; cdr_of(body) != Nil; body = cdr_of(body)) {
+            eval(frame, body->car);
+        }
+        return tail_eval(frame, body->car);
+    }
+    error("not supported");
+}
+
+// 通过符号找到变量，返回存放变量值的位置，如果未找到就返回 NULL。
+// 先找各层的帧，都没有时就是标志里的全局值，只需要读一次内存。
+// 返回的位置在对象内部，调用者不能在分配内存之后继续使用它。
+static Obj **find(Obj *env, Obj *sym) {
+    STAT(ctx->stat_finds++);
+    for (Obj *p = env; p; p = p->up) {
+        int i = 0;
+        for (Obj *name = p->names; name != Nil; name = cdr_of(name), i++) {
+            STAT(ctx->stat_find_steps++);
+            if (sym == name->car) {
+                return &p->slots[i];
+            }
+        }
+        for (Obj *cell = p->vars; cell != Nil; cell = cdr_of(cell)) {
+            Obj *bind = cell->car;
+            STAT(ctx->stat_find_steps++);
+            if (sym == bind->car) {
+                return &bind->cdr;
+            }
+        }
+    }
+    return sym->value != Unbound ? &sym->value : NULL;
+}
+
+// 取得 TLVAR 节点指向的槽
+static inline Obj **lvar_slot(Obj *env, Obj *lvar) {
+    for (int i = lvar->depth; i > 0; i--) {
+        env = env->up;
+    }
+    return &env->slots[lvar->slot];
+}
+
+// 拓展给定的巨集应用格式
+// 用参数 args 调用宏，返回展开的结果
+static Obj *expand_macro(Obj *env, Obj *macro, Obj *args) {
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(macro);
+    GC_ROOT(args);
+    STAT(ctx->stat_expansions++);
+    refresh_function(macro);
+    Obj *newenv = push_env(env, macro, args);
+    return progn(newenv, macro->body);
+}
+
+// 拓展给定的巨集应用格式
+static Obj *macroexpand(Obj *env, Obj *obj) {
+    if (type_of(obj) != TCELL || type_of(obj->car) != TSYMBOL) {
+        return obj;
+    }
+    Obj **loc = find(env, obj->car);
+    if (!loc || type_of(*loc) != TMACRO) {
+        return obj;
+    }
+    return expand_macro(env, *loc, cdr_of(obj));
+}
+
+// 求取 S 表达式的值。尾部位置的表达式不递归求值，而是回到循环开头
+static Obj *eval(Obj *env, Obj *obj) {
+    // 整数和特殊常量的值就是它们自己，只看标签位就能判断，不用访问内存
+    STAT(ctx->stat_evals++);
+    if (!is_pointer(obj)) {
+        return obj;
+    }
+    int depth __attribute((cleanup(leave_eval))) = enter_eval();
+    Obj **outer_form __attribute((cleanup(restore_form))) = ctx->current_form;
+    char *frames __attribute((cleanup(pop_frames))) = ctx->frames_ptr;
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(obj);
+    Obj *r;
+    for (; ; ) {
+        if (!is_pointer(obj)) {
+            return obj;
+        }
+        switch (obj->type) {
+            case TPRIMITIVE:
+            case TFUNCTION:
+            case TSTRING:
+            case TVECTOR:
+            case TTABLE:
+                return obj;
+            case TLVAR: {
+                Obj *value = *lvar_slot(env, obj);
+                if (value == Unbound) {
+                    error("Undefined symbol: %s", obj->sym->name);
+                }
+                return value;
+            }
+            case TLAMBDA:
+                return make_function(TFUNCTION, obj, env);
+            case TPREF:
+                if (obj->car->value == obj->cdr) {
+                    return obj->cdr;
+                }
+                // 原始函数已经被重新定义了，按名字查找
+                obj = obj->car;
+                continue;
+            case TSYMBOL: {
+                Obj **loc = find(env, obj);
+                if (!loc || *loc == Unbound) {
+                    error("Undefined symbol: %s", obj->name);
+                }
+                return *loc;
+            }
+            case TCELL: {
+                // 函数应用格式
+                ctx->current_form = &obj;
+                Obj *expanded = macroexpand(env, obj);
+                if (expanded != obj) {
+                    obj = expanded;
+                    continue;
+                }
+                Obj *fn = eval(env, obj->car);
+                Obj *args = cdr_of(obj);
+                if (type_of(fn) != TPRIMITIVE && type_of(fn) != TFUNCTION) {
+                    error("The head of a list must be a function");
+                }
+                r = apply(env, fn, args);
+                break;
+            }
+            case TCALL: {
+                // 词法分析过的函数应用格式，宏在分析时已经展开，不用再查一遍
+                ctx->current_form = &obj;
+                Obj *head = obj->car;
+                Obj *fn = type_of(head) == TPREF && head->car->value == head->cdr ? head->cdr : eval(env, head);
+                if (type_of(fn) == TMACRO) {
+                    // 函数体执行到一半时才定义了这个宏，只好在运行时展开
+                    obj = expand_macro(env, fn, cdr_of(obj));
+                    continue;
+                }
+                if (type_of(fn) != TPRIMITIVE && type_of(fn) != TFUNCTION) {
+                    error("The head of a list must be a function");
+                }
+                r = apply(env, fn, cdr_of(obj));
+                break;
+            }
+            default:
+                error("Bug: eval: Unknown tag type %d", obj->type);
+                break;
+        }
+        // 只有函数应用会走到这里
+        if (r != TailCall) {
+            return r;
+        }
+        env = ctx->tail_env;
+        obj = ctx->tail_expr;
+        // 之前压入帧栈的帧都用不到了，只留下尾调用的帧，把它移到最下面
+        char *entry = (char *)env - sizeof(Obj *);
+        if (on_frame_stack(env) && frames <= entry) {
+            size_t size = sizeof(Obj *) + env->size;
+            if (entry != frames) {
+                memmove(frames, entry, size);
+                env = (Obj *)(frames + sizeof(Obj *));
+            }
+            ctx->frames_ptr = frames + size;
+        } else {
+            ctx->frames_ptr = frames;
+        }
+    }
+}
+
+/**
+ 词法分析
+ 创建函数（lambda、defun、defmacro）时先把函数体扫描一遍，把对局部变量
+ 的引用换成 TLVAR 节点，节点里记录了变量所在的帧离当前帧有几层、在帧里
+ 是第几个槽，运行时沿 up 走几步再按下标取值就行了，不用再逐个比较标志。
+ 函数体里 define 的变量也在帧里分配槽，嵌套的 lambda 会被提前分析成
+ TLAMBDA 原型，运行时只需要和当前环境绑定。
+ 找不到的标志（全局变量，或者宏展开之后才出现的代码）保持原样，运行时
+ 再由 find 按名字查找，所以帧里仍然保存着每个槽的名字。
+ */
+
+// 分析期间的作用域，和运行时的帧一一对应
+typedef struct Scope {
+    Obj *names;             // 已分配槽的标志，最后分配的在最前面
+    int nslots;
+    struct Scope *up;       // 外层函数的作用域
+    Obj *env;               // 最外层作用域之外的运行时环境，宏的函数体没有（为 NULL）
+    Obj *menv;              // 用来判断一个标志是不是宏的环境
+    bool resolved;          // 这一层函数体依赖分析时的全局绑定：展开过宏，或者优化过原始函数的应用
+    bool captures;          // 函数体会创建引用当前帧的函数，帧不能放在帧栈上
+} Scope;
+
+static Obj *analyze(Scope *sc, Obj *form);
+static Obj *optimize_call(Scope *sc, Obj *call);
+
+// 在作用域链中查找标志，找到时返回 true 并设置深度和槽号
+static bool scope_lookup(Scope *sc, Obj *sym, int *depth, int *slot) {
+    int d = 0;
+    Obj *env = NULL;
+    for (; sc; sc = sc->up, d++) {
+        int i = sc->nslots - 1;
+        for (Obj *p = sc->names; p != Nil; p = cdr_of(p), i--) {
+            if (p->car == sym) {
+                *depth = d;
+                *slot = i;
+                return true;
+            }
+        }
+        env = sc->env;
+    }
+    // 再到定义函数时的运行时环境里找，这些帧在运行时同样位于当前帧的外层
+    for (; env; env = env->up, d++) {
+        int i = 0;
+        for (Obj *p = env->names; p != Nil; p = cdr_of(p), i++) {
+            if (p->car == sym) {
+                *depth = d;
+                *slot = i;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// 在当前作用域里为 define 的变量分配一个槽
+static Obj *scope_define(Scope *sc, Obj *sym) {
+    int i = sc->nslots - 1;
+    for (Obj *p = sc->names; p != Nil; p = cdr_of(p), i--) {
+        if (p->car == sym) {
+            return make_lvar(sym, 0, i);
+        }
+    }
+    sc->names = cons(sym, sc->names);
+    return make_lvar(sym, 0, sc->nslots++);
+}
+
+// 依次分析列表中的每个元素，返回新的列表。call 为 true 时第一个单元的类型
+// 是 TCALL，表示这是一个已经分析过的函数应用
+static Obj *analyze_list(Scope *sc, Obj *list, bool call) {
+    int n = 0;
+    for (Obj *p = list; type_of(p) == TCELL; p = cdr_of(p)) {
+        n++;
+    }
+    if (n == 0) {
+        // 点对形式的尾部原样保留，运行时再报错
+        return list;
+    }
+    GC_FRAME;
+    GC_ROOT(list);
+    Obj *head = make_list(n);
+    Obj *cell = head;
+    GC_ROOT(head);
+    GC_ROOT(cell);
+    if (call) {
+        head->type = TCALL;
+    }
+    for (;; list = cdr_of(list), cell = cdr_of(cell)) {
+        Obj *value = analyze(sc, list->car);
+        cell->car = value;
+        if (cdr_of(cell) == Nil) {
+            cell->cdr = cdr_of(list);
+            return head;
+        }
+    }
+}
+
+// 分析 (<params> expr ...)，返回函数原型
+static Obj *analyze_lambda(Scope *up, Obj *env, Obj *menv, Obj *list) {
+    if (type_of(list) != TCELL || !is_list(list->car) || type_of(cdr_of(list)) != TCELL) {
+        error("Malformed lambda");
+    }
+    for (Obj *p = list->car; p != Nil; p = cdr_of(p)) {
+        if (type_of(p->car) != TSYMBOL) {
+            error("Param must be a symbol");
+        }
+        if (!is_list(cdr_of(p))) {
+            error("Param is not a flat list");
+        }
+    }
+    GC_FRAME;
+    GC_ROOT(list);
+    Scope sc = { Nil, 0, up, env, menv, false, false };
+    GC_ROOT(sc.names);
+    GC_ROOT(sc.env);
+    GC_ROOT(sc.menv);
+    Obj *p = list->car;
+    GC_ROOT(p);
+    for (; p != Nil; p = cdr_of(p)) {
+        sc.names = cons(p->car, sc.names);
+        sc.nslots++;
+    }
+    int nparams = sc.nslots;
+    Obj *body = analyze_list(&sc, cdr_of(list), false);
+    GC_ROOT(body);
+    
+    // 把槽名字倒过来，变成按槽号排列
+    Obj *locals = Nil;
+    GC_ROOT(locals);
+    for (p = sc.names; p != Nil; p = cdr_of(p)) {
+        locals = cons(p->car, locals);
+    }
+    // 依赖全局绑定的函数要记住源代码，宏或者原始函数被重新定义之后用来重新分析
+    Obj *proto = make_lambda(list->car, body, locals, sc.resolved ? list : NULL, nparams, sc.nslots);
+    proto->epoch = ctx->macro_epoch;
+    proto->stack_frame = !sc.captures;
+    return proto;
+}
+
+// (define <symbol> expr) 和 (defun <symbol> (<symbol> ...) expr ...) 在函数体里
+// 定义的是局部变量，都改写成 (define <TLVAR> <分析后的值>)
+static Obj *analyze_define(Scope *sc, Obj *form) {
+    Obj *rest = cdr_of(form);
+    if (type_of(rest) != TCELL || type_of(rest->car) != TSYMBOL || type_of(cdr_of(rest)) != TCELL) {
+        return form;
+    }
+    if (form->car == ctx->Sym_define && cdr_of(cdr_of(rest)) != Nil) {
+        return form;
+    }
+    GC_FRAME;
+    GC_ROOT(form);
+    // 先分配槽再分析值，这样值里面的递归引用也能找到这个变量
+    Obj *target = scope_define(sc, cdr_of(form)->car);
+    GC_ROOT(target);
+    Obj *value;
+    if (form->car == ctx->Sym_define) {
+        value = analyze(sc, cdr_of(cdr_of(form))->car);
+    } else {
+        value = analyze_lambda(sc, NULL, sc->menv, cdr_of(cdr_of(form)));
+        sc->captures = true;
+    }
+    value = cons(value, Nil);
+    value = cons(target, value);
+    return cons(ctx->Sym_define, value);
+}
+
+static Obj *analyze(Scope *sc, Obj *form) {
+    int depth, slot;
+    if (type_of(form) == TSYMBOL) {
+        if (scope_lookup(sc, form, &depth, &slot)) {
+            return make_lvar(form, depth, slot);
+        }
+        return form;
+    }
+    if (type_of(form) != TCELL) {
+        return form;
+    }
+    Obj *head = form->car;
+    if (type_of(head) == TSYMBOL && !scope_lookup(sc, head, &depth, &slot)) {
+        // 这几个格式的参数不是表达式，不能分析
+        if (head == ctx->Sym_quote || head == ctx->Sym_macroexpand) {
+            Obj *call = cons(head, cdr_of(form));
+            call->type = TCALL;
+            return optimize_call(sc, call);
+        }
+        if (head == ctx->Sym_defmacro) {
+            sc->captures = true;
+            return form;
+        }
+        if (head == ctx->Sym_lambda) {
+            sc->captures = true;
+            return analyze_lambda(sc, NULL, sc->menv, cdr_of(form));
+        }
+        if (head == ctx->Sym_define || head == ctx->Sym_defun) {
+            return analyze_define(sc, form);
+        }
+        // 已经定义好的宏在分析时就展开，运行时不用每次重新展开，展开的
+        // 结果和其他代码一样做词法分析
+        Obj **loc = find(sc->menv, head);
+        if (loc && type_of(*loc) == TMACRO) {
+            Obj *expanded = expand_macro(sc->menv, *loc, cdr_of(form));
+            sc->resolved = true;
+            return analyze(sc, expanded);
+        }
+    }
+    form = analyze_list(sc, form, true);
+    return type_of(form) == TCALL ? optimize_call(sc, form) : form;
+}
+
+// 函数展开过的宏被重新定义了的话，用源代码重新分析一遍函数体。
+// pmap 的工作线程不能修改父解释器的函数，父解释器派发任务之前已经刷新过
+// 全局的函数，其他的只好继续使用旧的函数体
+static void refresh_function(Obj *fn) {
+    if (!fn->source || fn->epoch == ctx->macro_epoch || foreign(fn)) {
+        return;
+    }
+    GC_FRAME;
+    GC_ROOT(fn);
+    Obj *env = fn->env;
+    Obj *menv = fn->env;
+    if (type_of(fn) == TMACRO) {
+        // 和 handle_function 一样，宏的函数体只按顶层环境判断宏
+        while (menv->up) {
+            menv = menv->up;
+        }
+        env = NULL;
+    }
+    Obj *proto = analyze_lambda(NULL, env, menv, fn->source);
+    fn->code = NULL;
+    fn->body = proto->body;
+    fn->locals = proto->locals;
+    fn->nlocals = proto->nlocals;
+    fn->epoch = proto->epoch;
+    fn->stack_frame = fn->stack_frame && proto->stack_frame;
+}
+
+/**
+ 函数和一些其他特殊的格式。
+ 
+ @author Charry Lee
+ @date 2022-01-14
+ */
+
+// ‘expr
+static Obj *prim_quote(Obj *env, Obj *list) {
+    (void)env;
+    if (list_length(list) != 1) {
+        error("Malformed quote");
+    }
+    return list->car;
+}
+
+// (list expr ...)
+static Obj *prim_list(Obj *env, Obj *list) {
+    return eval_list(env, list);
+}
+
+// 判断是否可以作为 setq/define 的目标：标志，或者词法分析后的局部变量
+static bool is_variable(Obj *obj) {
+    return type_of(obj) == TSYMBOL || type_of(obj) == TLVAR;
+}
+
+// (setq <symbol> expr)
+static Obj *prim_setq(Obj *env, Obj *list) {
+    if (list_length(list) != 2 || !is_variable(list->car)) {
+        error("Malformed setq");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *value = eval(env, cdr_of(list)->car);
+    // 求值可能触发 GC，所以在求值之后才去找变量的位置
+    Obj *var = list->car;
+    Obj **loc = type_of(var) == TLVAR ? lvar_slot(env, var) : find(env, var);
+    if (!loc || *loc == Unbound) {
+        error("Unbound variable %s", type_of(var) == TLVAR ? var->sym->name : var->name);
+    }
+    check_store(loc);
+    note_overwrite(*loc, value);
+    *loc = value;
+    return value;
+}
+
+static Obj *handle_function(Obj *env, Obj *list, int type) {
+    GC_FRAME;
+    GC_ROOT(env);
+    // 宏的帧在展开时建立在调用者的环境之上，所以宏的函数体不能按定义时的
+    // 环境做词法分析，只分析它自己的参数
+    Obj *menv = env;
+    if (type == TMACRO) {
+        while (menv->up) {
+            menv = menv->up;
+        }
+    }
+    Obj *proto = analyze_lambda(NULL, type == TFUNCTION ? env : NULL, menv, list);
+    return make_function(type, proto, env);
+}
+
+// (lambda (<symbol> ...) expr ...)
+static Obj *prim_lambda(Obj *env, Obj *list) {
+    return handle_function(env, list, TFUNCTION);
+}
+
+static Obj *handle_defun(Obj *env, Obj *list, int type) {
+    if (type_of(list) != TCELL || type_of(list->car) != TSYMBOL || type_of(cdr_of(list)) != TCELL)
+        error("Malformed defun");
+    GC_FRAME;
+    GC_ROOT(env);
+    Obj *sym = list->car;
+    GC_ROOT(sym);
+    Obj *fn = handle_function(env, cdr_of(list), type);
+    GC_ROOT(fn);
+    add_variable(env, sym, fn);
+    return fn;
+}
+
+// (defun <symbol> (<symbol> ...) expr ...)
+static Obj *prim_defun(Obj *env, Obj *list) {
+    return handle_defun(env, list, TFUNCTION);
+}
+
+// (define <symbol> expr)
+static Obj *prim_define(Obj *env, Obj *list) {
+    if (list_length(list) != 2 || !is_variable(list->car))
+        error("Malformed define");
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *value = eval(env, cdr_of(list)->car);
+    if (type_of(list->car) == TLVAR) {
+        // 函数体里的 define，词法分析已经为它分配好了槽
+        Obj **loc = lvar_slot(env, list->car);
+        check_store(loc);
+        *loc = value;
+        return value;
+    }
+    GC_ROOT(value);
+    add_variable(env, list->car, value);
+    return value;
+}
+
+// (defmacro <symbol> (<symbol> ...) expr ...)
+static Obj *prim_defmacro(Obj *env, Obj *list) {
+    return handle_defun(env, list, TMACRO);
+}
+
+// (macroexpand expr)
+static Obj *prim_macroexpand(Obj *env, Obj *list) {
+    if (list_length(list) != 1)
+        error("Malformed macroexpand");
+    Obj *body = list->car;
+    return macroexpand(env, body);
+}
+
+// (println expr)
+static Obj *prim_println(Obj *env, Obj *list) {
+    if (list_length(list) != 1)
+        error("Malformed println");
+    Obj *obj = eval(env, list->car);
+    // 字符串输出它的内容，不加引号
+    if (type_of(obj) == TSTRING) {
+        out_write(&ctx->out, obj->str, obj->len);
+    } else {
+        print(obj);
+    }
+    out_char(&ctx->out, '\n');
+    return Nil;
+}
+
+// (if expr expr expr ...)
+static Obj *prim_if(Obj *env, Obj *list) {
+    if (list_length(list) < 2)
+        error("Malformed if");
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *cond = eval(env, list->car);
+    if (cond != Nil) {
+        return tail_eval(env, cdr_of(list)->car);
+    }
+    Obj *els = cdr_of(cdr_of(list));
+    if (els == Nil) {
+        return Nil;
+    }
+    GC_ROOT(els);
+    for (; cdr_of(els) != Nil; els = cdr_of(els)) {
+        eval(env, els->car);
+    }
+    return tail_eval(env, els->car);
+}
+
+/**
+ 整数运算
+ 整数是 63 位的 fixnum，运算结果超出这个范围时报错，而不是悄悄地溢出。
+ 参数在一遍循环里边求值边累计，不再先用 eval_list 拼出一个参数列表。
+ */
+
+static inline Obj *checked_int(int64_t value) {
+    if (value < FIXNUM_MIN || FIXNUM_MAX < value) {
+        error("Integer overflow");
+    }
+    return make_int(value);
+}
+
+// 两个 fixnum 的和与差不会超出 int64_t，只有乘法需要检查 int64_t 本身的溢出
+static inline Obj *int_add(int64_t x, int64_t y) {
+    return checked_int(x + y);
+}
+
+static inline Obj *int_sub(int64_t x, int64_t y) {
+    return checked_int(x - y);
+}
+
+static inline Obj *int_mul(int64_t x, int64_t y) {
+    int64_t r;
+    if (__builtin_mul_overflow(x, y, &r)) {
+        error("Integer overflow");
+    }
+    return checked_int(r);
+}
+
+// 向零取整的除法
+static inline Obj *int_div(int64_t x, int64_t y) {
+    if (y == 0) {
+        error("Division by zero");
+    }
+    return checked_int(x / y);
+}
+
+// 余数的符号和除数相同
+static inline Obj *int_mod(int64_t x, int64_t y) {
+    if (y == 0) {
+        error("Division by zero");
+    }
+    int64_t r = x % y;
+    if (r != 0 && (r < 0) != (y < 0)) {
+        r += y;
+    }
+    return make_int(r);
+}
+
+// 检查参数是整数
+static inline int64_t check_int(Obj *value, const char *name) {
+    if (!is_fixnum(value)) {
+        error("%s takes only numbers", name);
+    }
+    return int_value(value);
+}
+
+// 求值一个参数，它必须是整数
+static inline int64_t eval_int(Obj *env, Obj *expr, const char *name) {
+    return check_int(eval(env, expr), name);
+}
+
+// 依次求值参数，从左到右用 op 累计。只有一个参数时结果是 op(unit, x)，
+// 没有参数时是 unit；unit 为 NULL 表示至少要有 min 个参数。
+// 求值的顺序和虚拟机的指令序列 a b OP c OP ... 相同：先求出下一个参数，
+// 再检查参与这一步运算的两个值，所以一个参数不是整数时，它右边的那个参数
+// 也已经求值过了。acc 不用登记为 GC 的根：它是整数的话不在堆里，不是的话
+// 也只会在 check_int 里看一下标记位，然后报错
+static Obj *fold_int(Obj *env, Obj *list, const char *name, Obj *(*op)(int64_t, int64_t),
+                     Obj *unit, int min) {
+    int n = list_length(list);
+    if (n < min) {
+        error("Malformed %s", name);
+    }
+    if (n == 0) {
+        return unit;
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *acc = eval(env, list->car);
+    if (n == 1) {
+        return op(int_value(unit), check_int(acc, name));
+    }
+    for (list = cdr_of(list); list != Nil; list = cdr_of(list)) {
+        Obj *y = eval(env, list->car);
+        int64_t x = check_int(acc, name);
+        acc = op(x, check_int(y, name));
+    }
+    return acc;
+}
+
+// (+ <integer> ...)
+static Obj *prim_plus(Obj *env, Obj *list) {
+    return fold_int(env, list, "+", int_add, make_int(0), 0);
+}
+
+// (- <integer> <integer> ...)，只有一个参数时取相反数
+static Obj *prim_minus(Obj *env, Obj *list) {
+    return fold_int(env, list, "-", int_sub, make_int(0), 1);
+}
+
+// (* <integer> ...)
+static Obj *prim_mul(Obj *env, Obj *list) {
+    return fold_int(env, list, "*", int_mul, make_int(1), 0);
+}
+
+// (/ <integer> <integer> ...)
+static Obj *prim_div(Obj *env, Obj *list) {
+    return fold_int(env, list, "/", int_div, make_int(1), 2);
+}
+
+// (mod <integer> <integer>)
+static Obj *prim_mod(Obj *env, Obj *list) {
+    if (list_length(list) != 2) {
+        error("Malformed mod");
+    }
+    return fold_int(env, list, "mod", int_mod, NULL, 2);
+}
+
+// 比较运算符
+enum {
+    CMP_EQ,
+    CMP_LT,
+    CMP_GT,
+    CMP_LE,
+    CMP_GE,
+};
+
+static inline bool compare_int(int op, int64_t x, int64_t y) {
+    switch (op) {
+        case CMP_EQ: return x == y;
+        case CMP_LT: return x < y;
+        case CMP_GT: return x > y;
+        case CMP_LE: return x <= y;
+        default:     return x >= y;
+    }
+}
+
+// 相邻的每两个参数都满足 op 时返回 t。所有参数都会被求值，和 fold_int
+// 一样先求出下一个参数再检查两边是不是整数，x 同样不用登记为根
+static Obj *compare_chain(Obj *env, Obj *list, const char *name, int op) {
+    if (list_length(list) < 2) {
+        error("Malformed %s", name);
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *x = eval(env, list->car);
+    bool r = true;
+    for (list = cdr_of(list); list != Nil; list = cdr_of(list)) {
+        Obj *y = eval(env, list->car);
+        r = compare_int(op, check_int(x, name), check_int(y, name)) && r;
+        x = y;
+    }
+    return r ? True : Nil;
+}
+
+// (= <integer> <integer> ...)
+static Obj *prim_num_eq(Obj *env, Obj *list) {
+    return compare_chain(env, list, "=", CMP_EQ);
+}
+
+// (< <integer> <integer> ...)
+static Obj *prim_lt(Obj *env, Obj *list) {
+    return compare_chain(env, list, "<", CMP_LT);
+}
+
+// (> <integer> <integer> ...)
+static Obj *prim_gt(Obj *env, Obj *list) {
+    return compare_chain(env, list, ">", CMP_GT);
+}
+
+// (<= <integer> <integer> ...)
+static Obj *prim_le(Obj *env, Obj *list) {
+    return compare_chain(env, list, "<=", CMP_LE);
+}
+
+// (>= <integer> <integer> ...)
+static Obj *prim_ge(Obj *env, Obj *list) {
+    return compare_chain(env, list, ">=", CMP_GE);
+}
+
+/**
+ 向量
+ 元素连续存放在一个对象里，按下标访问只需要一次乘法和加法。向量和字符串
+ 一样求值得到它自己，读取器把 #(...) 读成向量。
+ */
+
+// 求值一个参数，它必须是向量
+static Obj *eval_vector(Obj *env, Obj *expr, const char *name) {
+    Obj *value = eval(env, expr);
+    if (type_of(value) != TVECTOR) {
+        error("%s: not a vector", name);
+    }
+    return value;
+}
+
+// 求值下标，它必须在 [0, limit) 里
+static int eval_index(Obj *env, Obj *expr, int limit, const char *name) {
+    int64_t i = eval_int(env, expr, name);
+    if (i < 0 || limit <= i) {
+        error("%s: index %" PRId64 " out of range", name, i);
+    }
+    return (int)i;
+}
+
+// 求值可选的 [start [end]] 参数，默认是整个向量 v
+static void eval_range(Obj *env, Obj *list, Obj *v, int *start, int *end, const char *name) {
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    GC_ROOT(v);
+    *start = 0;
+    *end = v->nelems;
+    if (list != Nil) {
+        *start = eval_index(env, list->car, v->nelems + 1, name);
+        list = cdr_of(list);
+    }
+    if (list != Nil) {
+        *end = eval_index(env, list->car, v->nelems + 1, name);
+        list = cdr_of(list);
+    }
+    if (list != Nil || *end < *start) {
+        error("Malformed %s", name);
+    }
+}
+
+// (vector expr ...)
+static Obj *prim_vector(Obj *env, Obj *list) {
+    return list_to_vector(eval_list(env, list), "vector");
+}
+
+// (make-vector <integer> [fill])
+static Obj *prim_make_vector(Obj *env, Obj *list) {
+    int n = list_length(list);
+    if (n != 1 && n != 2) {
+        error("Malformed make-vector");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    int64_t len = eval_int(env, list->car, "make-vector");
+    Obj *fill = n == 2 ? eval(env, cdr_of(list)->car) : Nil;
+    return make_vector(len, fill);
+}
+
+// (vector-length v)
+static Obj *prim_vector_length(Obj *env, Obj *list) {
+    if (list_length(list) != 1) {
+        error("Malformed vector-length");
+    }
+    return make_int(eval_vector(env, list->car, "vector-length")->nelems);
+}
+
+// (vector-ref v i)
+static Obj *prim_vector_ref(Obj *env, Obj *list) {
+    if (list_length(list) != 2) {
+        error("Malformed vector-ref");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *v = eval_vector(env, list->car, "vector-ref");
+    GC_ROOT(v);
+    int i = eval_index(env, cdr_of(list)->car, v->nelems, "vector-ref");
+    return v->elems[i];
+}
+
+// (vector-set! v i expr)，返回新的值
+static Obj *prim_vector_set(Obj *env, Obj *list) {
+    if (list_length(list) != 3) {
+        error("Malformed vector-set!");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *v = eval_vector(env, list->car, "vector-set!");
+    GC_ROOT(v);
+    int i = eval_index(env, cdr_of(list)->car, v->nelems, "vector-set!");
+    Obj *value = eval(env, cdr_of(cdr_of(list))->car);
+    check_store(&v->elems[i]);
+    v->elems[i] = value;
+    return value;
+}
+
+// (vector->list v [start [end]])
+static Obj *prim_vector_to_list(Obj *env, Obj *list) {
+    if (list_length(list) < 1) {
+        error("Malformed vector->list");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *v = eval_vector(env, list->car, "vector->list");
+    GC_ROOT(v);
+    int start, end;
+    eval_range(env, cdr_of(list), v, &start, &end, "vector->list");
+    Obj *r = make_list(end - start);
+    Obj *cell = r;
+    for (int i = start; i < end; i++, cell = cdr_of(cell)) {
+        cell->car = v->elems[i];
+    }
+    return r;
+}
+
+// (list->vector list)
+static Obj *prim_list_to_vector(Obj *env, Obj *list) {
+    if (list_length(list) != 1) {
+        error("Malformed list->vector");
+    }
+    return list_to_vector(eval(env, list->car), "list->vector");
+}
+
+// (vector-fill! v expr [start [end]])，返回 v
+static Obj *prim_vector_fill(Obj *env, Obj *list) {
+    if (list_length(list) < 2) {
+        error("Malformed vector-fill!");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *v = eval_vector(env, list->car, "vector-fill!");
+    GC_ROOT(v);
+    Obj *fill = eval(env, cdr_of(list)->car);
+    GC_ROOT(fill);
+    int start, end;
+    eval_range(env, cdr_of(cdr_of(list)), v, &start, &end, "vector-fill!");
+    if (start < end) {
+        check_store(v->elems);
+    }
+    for (int i = start; i < end; i++) {
+        v->elems[i] = fill;
+    }
+    return v;
+}
+
+// (vector-copy v [start [end]])，返回新的向量
+static Obj *prim_vector_copy(Obj *env, Obj *list) {
+    if (list_length(list) < 1) {
+        error("Malformed vector-copy");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *v = eval_vector(env, list->car, "vector-copy");
+    GC_ROOT(v);
+    int start, end;
+    eval_range(env, cdr_of(list), v, &start, &end, "vector-copy");
+    Obj *r = make_vector(end - start, Nil);
+    memcpy(r->elems, v->elems + start, sizeof(Obj *) * (end - start));
+    return r;
+}
+
+// (vector-copy! to at from [start [end]])，把 from 的一段复制到 to 的 at 处，
+// 两者可以是同一个向量。返回 to
+static Obj *prim_vector_copy_to(Obj *env, Obj *list) {
+    if (list_length(list) < 3) {
+        error("Malformed vector-copy!");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *to = eval_vector(env, list->car, "vector-copy!");
+    GC_ROOT(to);
+    int at = eval_index(env, cdr_of(list)->car, to->nelems + 1, "vector-copy!");
+    Obj *from = eval_vector(env, cdr_of(cdr_of(list))->car, "vector-copy!");
+    GC_ROOT(from);
+    int start, end;
+    eval_range(env, cdr_of(cdr_of(cdr_of(list))), from, &start, &end, "vector-copy!");
+    if (to->nelems - at < end - start) {
+        error("vector-copy!: destination too small");
+    }
+    if (start < end) {
+        check_store(to->elems);
+    }
+    memmove(to->elems + at, from->elems + start, sizeof(Obj *) * (end - start));
+    return to;
+}
+
+/**
+ 散列表
+ (make-hash-table) 创建一个空的散列表，键是标志或整数，按 eq 比较。标志的
+ 哈希值在创建时已经算好，整数用乘法打散，查找只需要访问一个桶。
+ 条目数超过桶数时桶的个数翻倍，但旧的桶不是一次搬完：新的条目总是放进新的
+ 桶里，之后每次 puthash 和 remhash 顺便搬几个旧的桶，查找时两边都要找。这样
+ 一次插入的耗时总是有上限，不会因为表很大而突然停顿。
+ */
+
+#define TABLE_MIN_BUCKETS 8
+
+// 每次修改散列表时最多搬几个旧的桶。插入的次数追上桶数之前旧的桶一定搬完了
+#define TABLE_MIGRATE_STEP 4
+
+// 键的哈希值。标志不在 GC 堆里，但映像装载时可能换了地址，所以用名字的哈希值
+static uint64_t hash_key(Obj *key, const char *name) {
+    if (!is_pointer(key)) {
+        return ((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ull) >> 32;
+    }
+    if (key->type != TSYMBOL) {
+        error("%s: key must be a symbol or an integer", name);
+    }
+    return key->hash;
+}
+
+// 在 buckets 里找 key，返回 (key . value)，找不到时返回 NULL
+static Obj *bucket_find(Obj *buckets, Obj *key, uint64_t h) {
+    for (Obj *p = buckets->elems[h & (buckets->nelems - 1)]; p != Nil; p = cdr_of(p)) {
+        if (p->car->car == key) {
+            return p->car;
+        }
+    }
+    return NULL;
+}
+
+static Obj *table_find(Obj *table, Obj *key, uint64_t h) {
+    Obj *entry = bucket_find(table->buckets, key, h);
+    if (!entry && table->old_buckets != Nil) {
+        entry = bucket_find(table->old_buckets, key, h);
+    }
+    return entry;
+}
+
+// 把旧的桶搬到新的桶里，最多搬 n 个。链上的单元直接挂到新的桶上，不分配内存
+static void table_migrate(Obj *table, int n) {
+    Obj *old = table->old_buckets;
+    if (old == Nil) {
+        return;
+    }
+    Obj *buckets = table->buckets;
+    for (; n > 0 && table->nmigrated < old->nelems; n--, table->nmigrated++) {
+        Obj **loc = &old->elems[table->nmigrated];
+        while (*loc != Nil) {
+            Obj *p = *loc;
+            *loc = cdr_of(p);
+            Obj **bucket = &buckets->elems[hash_key(p->car->car, "puthash") & (buckets->nelems - 1)];
+            p->cdr = *bucket;
+            *bucket = p;
+        }
+    }
+    if (table->nmigrated == old->nelems) {
+        table->old_buckets = Nil;
+    }
+}
+
+// 从 buckets 里删掉 key，返回是否找到了它
+static bool bucket_remove(Obj *buckets, Obj *key, uint64_t h) {
+    for (Obj **loc = &buckets->elems[h & (buckets->nelems - 1)]; *loc != Nil; loc = &(*loc)->cdr) {
+        if ((*loc)->car->car == key) {
+            *loc = cdr_of(*loc);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 求值一个参数，它必须是散列表
+static Obj *eval_table(Obj *env, Obj *expr, const char *name) {
+    Obj *value = eval(env, expr);
+    if (type_of(value) != TTABLE) {
+        error("%s: not a hash table", name);
+    }
+    return value;
+}
+
+// (make-hash-table [size])，size 是预计的条目数
+static Obj *prim_make_hash_table(Obj *env, Obj *list) {
+    int n = list_length(list);
+    if (n > 1) {
+        error("Malformed make-hash-table");
+    }
+    int64_t size = n == 1 ? eval_int(env, list->car, "make-hash-table") : 0;
+    if (size < 0 || VECTOR_MAX / 2 < size) {
+        error("make-hash-table: invalid size %" PRId64, size);
+    }
+    int64_t nbuckets = TABLE_MIN_BUCKETS;
+    while (nbuckets < size) {
+        nbuckets *= 2;
+    }
+    GC_FRAME;
+    Obj *buckets = make_vector(nbuckets, Nil);
+    GC_ROOT(buckets);
+    Obj *r = alloc(TTABLE, sizeof(Obj *) * 2 + sizeof(int) * 2);
+    r->buckets = buckets;
+    r->old_buckets = Nil;
+    r->nentries = 0;
+    r->nmigrated = 0;
+    return r;
+}
+
+// (gethash key table [default])，找不到时返回 default，默认是 ()
+static Obj *prim_gethash(Obj *env, Obj *list) {
+    int n = list_length(list);
+    if (n != 2 && n != 3) {
+        error("Malformed gethash");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *key = eval(env, list->car);
+    GC_ROOT(key);
+    Obj *table = eval_table(env, cdr_of(list)->car, "gethash");
+    Obj *entry = table_find(table, key, hash_key(key, "gethash"));
+    if (entry) {
+        return cdr_of(entry);
+    }
+    return n == 3 ? eval(env, cdr_of(cdr_of(list))->car) : Nil;
+}
+
+// (puthash key value table)，返回 value
+static Obj *prim_puthash(Obj *env, Obj *list) {
+    if (list_length(list) != 3) {
+        error("Malformed puthash");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *key = eval(env, list->car);
+    GC_ROOT(key);
+    Obj *value = eval(env, cdr_of(list)->car);
+    GC_ROOT(value);
+    Obj *table = eval_table(env, cdr_of(cdr_of(list))->car, "puthash");
+    GC_ROOT(table);
+    uint64_t h = hash_key(key, "puthash");
+    check_store(&table->buckets);
+    table_migrate(table, TABLE_MIGRATE_STEP);
+    Obj *entry = table_find(table, key, h);
+    if (entry) {
+        entry->cdr = value;
+        return value;
+    }
+    if (table->nentries >= table->buckets->nelems && table->buckets->nelems <= VECTOR_MAX / 2) {
+        // 上一次扩容的旧桶一般早已搬完，没有的话先一次搬完
+        table_migrate(table, INT_MAX);
+        Obj *buckets = make_vector(table->buckets->nelems * 2, Nil);
+        table->old_buckets = table->buckets;
+        table->buckets = buckets;
+        table->nmigrated = 0;
+    }
+    entry = cons(key, value);
+    // cons 可能触发 GC，桶的地址要在分配之后再取
+    Obj *chain = cons(entry, table->buckets->elems[h & (table->buckets->nelems - 1)]);
+    table->buckets->elems[h & (table->buckets->nelems - 1)] = chain;
+    table->nentries++;
+    return value;
+}
+
+// (remhash key table)，删掉了条目时返回 t
+static Obj *prim_remhash(Obj *env, Obj *list) {
+    if (list_length(list) != 2) {
+        error("Malformed remhash");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *key = eval(env, list->car);
+    GC_ROOT(key);
+    Obj *table = eval_table(env, cdr_of(list)->car, "remhash");
+    uint64_t h = hash_key(key, "remhash");
+    check_store(&table->buckets);
+    table_migrate(table, TABLE_MIGRATE_STEP);
+    if (!bucket_remove(table->buckets, key, h)
+        && (table->old_buckets == Nil || !bucket_remove(table->old_buckets, key, h))) {
+        return Nil;
+    }
+    table->nentries--;
+    return True;
+}
+
+// (hash-count table)
+static Obj *prim_hash_count(Obj *env, Obj *list) {
+    if (list_length(list) != 1) {
+        error("Malformed hash-count");
+    }
+    return make_int(eval_table(env, list->car, "hash-count")->nentries);
+}
+
+// 把 buckets 里的条目 (key . value) 接到 list 前面
+static Obj *bucket_entries(Obj *buckets, Obj *list) {
+    GC_FRAME;
+    GC_ROOT(buckets);
+    GC_ROOT(list);
+    Obj *p = Nil;
+    GC_ROOT(p);
+    for (int i = 0; i < buckets->nelems; i++) {
+        for (p = buckets->elems[i]; p != Nil; p = cdr_of(p)) {
+            list = cons(p->car, list);
+        }
+    }
+    return list;
+}
+
+// (maphash fn table)，用每个条目的键和值调用 fn，返回 ()。先取出所有的条目
+// 再调用，fn 里修改散列表不会打乱遍历，只是新加的条目不会被访问到
+static Obj *prim_maphash(Obj *env, Obj *list) {
+    if (list_length(list) != 2) {
+        error("Malformed maphash");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *fn = eval(env, list->car);
+    GC_ROOT(fn);
+    Obj *table = eval_table(env, cdr_of(list)->car, "maphash");
+    GC_ROOT(table);
+    Obj *entries = bucket_entries(table->buckets, Nil);
+    GC_ROOT(entries);
+    if (table->old_buckets != Nil) {
+        entries = bucket_entries(table->old_buckets, entries);
+    }
+    // 拼成 (fn (quote key) (quote value)) 交给 eval，和普通的函数调用走同一条路
+    Obj *form = Nil;
+    GC_ROOT(form);
+    for (; entries != Nil; entries = cdr_of(entries)) {
+        form = cons(cdr_of(entries->car), Nil);
+        form = cons(ctx->Sym_quote, form);
+        form = cons(form, Nil);
+        Obj *arg = cons(entries->car->car, Nil);
+        arg = cons(ctx->Sym_quote, arg);
+        form = cons(arg, form);
+        form = cons(fn, form);
+        eval(env, form);
+    }
+    return Nil;
+}
+
+/**
+ 字节码编译器和虚拟机
+ 使用 --vm 时，函数第一次被调用前会把它经过词法分析的函数体编译成字节码，
+ 然后在一个栈式虚拟机里执行。和直接解释语法树相比，虚拟机不用在每个节点上
+ 按类型分派、检查格式，if、+、= 这样的原始函数被直接编译成指令，函数之间
+ 的调用也不再递归调用 C 函数，尾部位置的调用会复用当前的活动记录。
+ 指令是直接线索化（direct threading）的：每条指令的第一个字就是它在
+ vm_run 里对应代码的地址，执行完一条指令后直接跳到下一条。
+ 帧和解释器使用的完全相同，所以编译过的函数和解释执行的代码可以互相调用；
+ 编译器不认识的格式就编译成 OP_EVAL，交给 eval 处理。
+ */
+
+enum {
+    OP_PUSHI,       // <imm>            压入一个立即数（整数或特殊常量）
+    OP_CONST,       // <k>              压入常量 k
+    OP_LREF0,       // <slot> <sym>     压入当前帧的局部变量
+    OP_LREF,        // <depth> <slot> <sym>
+    OP_LSET,        // <depth> <slot> <sym>  setq 局部变量，值留在栈顶
+    OP_LDEF,        // <depth> <slot>   define 局部变量，值留在栈顶
+    OP_GREF,        // <sym>            全局变量，值在标志里
+    OP_GSET,        // <sym>
+    OP_SYMREF,      // <sym>            按名字查找变量
+    OP_SYMSET,      // <sym>
+    OP_POP,
+    OP_JMP,         // <off>
+    OP_JNIL,        // <off>            弹出栈顶，是 () 时跳转
+    OP_CLOSURE,     // <k>              用原型 k 和当前帧创建函数
+    OP_ADD,         // 下面是整数的二元运算，弹出两个参数，压入结果
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_NUMEQ,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_PRIM,        // <k1> <k2>        用参数列表 k2 调用原始函数 k1
+    OP_EVAL,        // <k>              用 eval 求值常量 k
+    OP_CHECKFN,     // <k> <off>        栈顶不是函数时按原始函数或者宏处理参数列表 k，然后跳转
+    OP_CALL,        // <n>
+    OP_TAILCALL,    // <n>
+    OP_RET,
+    OP_COUNT,
+};
+
+// 每个操作码对应的指令地址，由 vm_run 填写
+static void **vm_labels;
+
+// 活动记录，每个还没有返回的函数调用一个
+typedef struct Activation {
+    Obj *code;
+    Obj *env;
+    intptr_t pc;            // 挂起时的下一条指令（相对于指令开头）
+} Activation;
+
+// 字节码翻译成的机器码，执行栈顶的活动记录，见“即时编译”
+typedef Obj *NativeCode(struct Context *);
+
+static void vm_gc_roots(void) {
+    for (size_t i = 0; i < ctx->vm_sp; i++) {
+        ctx->vm_stack[i] = forward(ctx->vm_stack[i]);
+    }
+    for (size_t i = 0; i < ctx->vm_nframes; i++) {
+        ctx->vm_frames[i].code = forward(ctx->vm_frames[i].code);
+        ctx->vm_frames[i].env = forward(ctx->vm_frames[i].env);
+    }
+}
+
+static inline intptr_t *code_ops(Obj *code) {
+    return (intptr_t *)&code->consts[code->nconsts];
+}
+
+// 编译一个函数体时的状态
+typedef struct Compiler {
+    intptr_t *ops;
+    int nops;
+    int cap;
+    Obj *consts;            // 常量列表，最后加入的在最前面
+    int nconsts;
+    Obj *env;               // 函数定义时的环境，用来查找全局变量和原始函数
+} Compiler;
+
+static void emit(Compiler *c, intptr_t word) {
+    if (c->nops == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->ops = realloc(c->ops, sizeof(intptr_t) * c->cap);
+        if (!c->ops) {
+            error("Out of memory for bytecode");
+        }
+    }
+    c->ops[c->nops++] = word;
+}
+
+static void emit_op(Compiler *c, int op) {
+    emit(c, (intptr_t)vm_labels[op]);
+}
+
+// 写一个跳转偏移的占位，返回它的位置
+static int emit_jump(Compiler *c) {
+    emit(c, 0);
+    return c->nops - 1;
+}
+
+// 让 at 处的跳转跳到下一条要生成的指令
+static void patch_jump(Compiler *c, int at) {
+    c->ops[at] = c->nops - (at + 1);
+}
+
+static int add_const(Compiler *c, Obj *obj) {
+    c->consts = cons(obj, c->consts);
+    return c->nconsts++;
+}
+
+// sym 有全局值，并且从 env 按名字查找也会找到它时返回 true
+static bool is_global(Obj *env, Obj *sym) {
+    return find(env, sym) == &sym->value;
+}
+
+static void compile_expr(Compiler *c, Obj *form, bool tail);
+static Obj *compile_lambda(Obj *fn, Obj *env);
+
+static void compile_const(Compiler *c, Obj *obj) {
+    if (is_pointer(obj)) {
+        emit_op(c, OP_CONST);
+        emit(c, add_const(c, obj));
+    } else {
+        emit_op(c, OP_PUSHI);
+        emit(c, (intptr_t)obj);
+    }
+}
+
+// 依次编译 list 里的表达式，只保留最后一个的值
+static void compile_body(Compiler *c, Obj *list, bool tail) {
+    GC_FRAME;
+    GC_ROOT(list);
+    for (; list != Nil; list = cdr_of(list)) {
+        if (cdr_of(list) == Nil) {
+            compile_expr(c, list->car, tail);
+            return;
+        }
+        compile_expr(c, list->car, false);
+        emit_op(c, OP_POP);
+    }
+}
+
+// (if cond then else ...)，args 是 if 之后的部分
+static void compile_if(Compiler *c, Obj *args, bool tail) {
+    GC_FRAME;
+    GC_ROOT(args);
+    compile_expr(c, args->car, false);
+    emit_op(c, OP_JNIL);
+    int to_else = emit_jump(c);
+    compile_expr(c, cdr_of(args)->car, tail);
+    int to_end = -1;
+    if (!tail) {
+        emit_op(c, OP_JMP);
+        to_end = emit_jump(c);
+    }
+    patch_jump(c, to_else);
+    if (cdr_of(cdr_of(args)) == Nil) {
+        compile_const(c, Nil);
+        if (tail) {
+            emit_op(c, OP_RET);
+        }
+    } else {
+        compile_body(c, cdr_of(cdr_of(args)), tail);
+    }
+    if (!tail) {
+        patch_jump(c, to_end);
+    }
+}
+
+// 整数运算的原始函数和对应的二元运算指令。参数少于两个时在前面补上 unit；
+// max 为 2 的运算只有恰好两个参数时才编译成指令，其他情况在运行时报错
+static const struct {
+    Primitive *fn;
+    int op;
+    int64_t unit;
+    int min;
+    int max;
+} int_ops[] = {
+    { prim_plus,   OP_ADD,   0, 0, -1 },
+    { prim_minus,  OP_SUB,   0, 1, -1 },
+    { prim_mul,    OP_MUL,   1, 0, -1 },
+    { prim_div,    OP_DIV,   0, 2, -1 },
+    { prim_mod,    OP_MOD,   0, 2, 2 },
+    { prim_num_eq, OP_NUMEQ, 0, 2, 2 },
+    { prim_lt,     OP_LT,    0, 2, 2 },
+    { prim_gt,     OP_GT,    0, 2, 2 },
+    { prim_le,     OP_LE,    0, 2, 2 },
+    { prim_ge,     OP_GE,    0, 2, 2 },
+};
+
+// (op a b c) 编译成 a b OP c OP，(op a) 编译成 unit a OP，成功时返回 true
+static bool compile_int_op(Compiler *c, Primitive *fn, Obj *args, int nargs) {
+    for (size_t i = 0; i < sizeof(int_ops) / sizeof(int_ops[0]); i++) {
+        if (int_ops[i].fn != fn) {
+            continue;
+        }
+        if (nargs < int_ops[i].min || (int_ops[i].max >= 0 && nargs > int_ops[i].max)) {
+            return false;
+        }
+        if (nargs < 2) {
+            compile_const(c, make_int(int_ops[i].unit));
+            if (nargs == 0) {
+                return true;
+            }
+        }
+        GC_FRAME;
+        GC_ROOT(args);
+        compile_expr(c, args->car, false);
+        if (nargs == 1) {
+            emit_op(c, int_ops[i].op);
+        }
+        for (args = cdr_of(args); args != Nil; args = cdr_of(args)) {
+            compile_expr(c, args->car, false);
+            emit_op(c, int_ops[i].op);
+        }
+        return true;
+    }
+    return false;
+}
+
+// 参数是表达式的原始函数编译成专门的指令，成功时返回 true
+static bool compile_primitive(Compiler *c, Primitive *fn, Obj *args, int nargs, bool tail) {
+    GC_FRAME;
+    GC_ROOT(args);
+    if (fn == prim_quote && nargs == 1) {
+        compile_const(c, args->car);
+    } else if (fn == prim_if && nargs >= 2) {
+        compile_if(c, args, tail);
+        return true;
+    } else if (compile_int_op(c, fn, args, nargs)) {
+        // 已经编译成了整数运算指令
+    } else if ((fn == prim_setq || fn == prim_define) && nargs == 2 && type_of(args->car) == TLVAR) {
+        compile_expr(c, cdr_of(args)->car, false);
+        Obj *var = args->car;
+        emit_op(c, fn == prim_setq ? OP_LSET : OP_LDEF);
+        emit(c, var->depth);
+        emit(c, var->slot);
+        if (fn == prim_setq) {
+            emit(c, (intptr_t)var->sym);
+        }
+    } else if (fn == prim_setq && nargs == 2 && type_of(args->car) == TSYMBOL) {
+        compile_expr(c, cdr_of(args)->car, false);
+        if (is_global(c->env, args->car)) {
+            emit_op(c, OP_GSET);
+            emit(c, (intptr_t)args->car);
+        } else {
+            emit_op(c, OP_SYMSET);
+            emit(c, (intptr_t)args->car);
+        }
+    } else {
+        return false;
+    }
+    if (tail) {
+        emit_op(c, OP_RET);
+    }
+    return true;
+}
+
+// 函数应用格式
+static void compile_call(Compiler *c, Obj *form, bool tail) {
+    GC_FRAME;
+    GC_ROOT(form);
+    int nargs = 0;
+    Obj *p;
+    for (p = cdr_of(form); type_of(p) == TCELL; p = cdr_of(p)) {
+        nargs++;
+    }
+    if (p != Nil) {
+        // 点对形式的参数表，运行时报错
+        emit_op(c, OP_EVAL);
+        emit(c, add_const(c, form));
+        if (tail) {
+            emit_op(c, OP_RET);
+        }
+        return;
+    }
+    
+    // 头部是原始函数时，参数由原始函数自己求值
+    Obj *sym = type_of(form->car) == TPREF ? form->car->car : form->car;
+    if (type_of(sym) == TSYMBOL) {
+        if (is_global(c->env, sym) && type_of(sym->value) == TPRIMITIVE) {
+            if (compile_primitive(c, sym->value->fn, cdr_of(form), nargs, tail)) {
+                return;
+            }
+            emit_op(c, OP_PRIM);
+            emit(c, add_const(c, sym->value));
+            emit(c, add_const(c, cdr_of(form)));
+            if (tail) {
+                emit_op(c, OP_RET);
+            }
+            return;
+        }
+    }
+    
+    compile_expr(c, form->car, false);
+    emit_op(c, OP_CHECKFN);
+    emit(c, add_const(c, cdr_of(form)));
+    int to_slow = emit_jump(c);
+    for (p = cdr_of(form); p != Nil; p = cdr_of(p)) {
+        GC_ROOT(p);
+        compile_expr(c, p->car, false);
+    }
+    emit_op(c, tail ? OP_TAILCALL : OP_CALL);
+    emit(c, nargs);
+    patch_jump(c, to_slow);
+    if (tail) {
+        emit_op(c, OP_RET);
+    }
+}
+
+// 编译一个表达式，tail 为 true 时生成的代码最后会从函数返回
+static void compile_expr(Compiler *c, Obj *form, bool tail) {
+    if (!is_pointer(form)) {
+        compile_const(c, form);
+    } else {
+        switch (form->type) {
+            case TSTRING:
+            case TVECTOR:
+            case TTABLE:
+            case TPRIMITIVE:
+            case TFUNCTION:
+                compile_const(c, form);
+                break;
+            case TLVAR:
+                if (form->depth == 0) {
+                    emit_op(c, OP_LREF0);
+                } else {
+                    emit_op(c, OP_LREF);
+                    emit(c, form->depth);
+                }
+                emit(c, form->slot);
+                emit(c, (intptr_t)form->sym);
+                break;
+            case TSYMBOL: {
+                if (is_global(c->env, form)) {
+                    emit_op(c, OP_GREF);
+                    emit(c, (intptr_t)form);
+                } else {
+                    emit_op(c, OP_SYMREF);
+                    emit(c, (intptr_t)form);
+                }
+                break;
+            }
+            case TPREF:
+                // 和标志一样编译成对全局变量的引用
+                compile_expr(c, form->car, tail);
+                break;
+            case TLAMBDA: {
+                GC_FRAME;
+                GC_ROOT(form);
+                compile_lambda(form, c->env);
+                emit_op(c, OP_CLOSURE);
+                emit(c, add_const(c, form));
+                break;
+            }
+            case TCALL:
+                compile_call(c, form, tail);
+                return;
+            default:
+                emit_op(c, OP_EVAL);
+                emit(c, add_const(c, form));
+                break;
+        }
+    }
+    if (tail) {
+        emit_op(c, OP_RET);
+    }
+}
+
+// 编译函数或者函数原型 fn 的函数体，结果放在 fn->code 里并返回。pmap 的
+// 工作线程编译父解释器的函数时不保存结果
+static Obj *compile_lambda(Obj *fn, Obj *env) {
+    GC_FRAME;
+    GC_ROOT(fn);
+    Compiler c = { NULL, 0, 0, Nil, 0, env };
+    GC_ROOT(c.consts);
+    GC_ROOT(c.env);
+    compile_body(&c, fn->body, true);
+    
+    Obj *code = alloc(TCODE, offsetof(Obj, consts) - offsetof(Obj, nops)
+                      + sizeof(Obj *) * c.nconsts + sizeof(intptr_t) * c.nops);
+    code->nops = c.nops;
+    code->nconsts = c.nconsts;
+    code->cepoch = ctx->macro_epoch;
+    code->calls = 0;
+    code->native = NULL;
+    int i = c.nconsts;
+    for (Obj *p = c.consts; p != Nil; p = cdr_of(p)) {
+        code->consts[--i] = p->car;
+    }
+    memcpy(code_ops(code), c.ops, sizeof(intptr_t) * c.nops);
+    free(c.ops);
+    if (!foreign(fn)) {
+        fn->code = code;
+    }
+    return code;
+}
+
+// 取得函数的字节码，需要时先编译
+static Obj *function_code(Obj *fn) {
+    GC_FRAME;
+    GC_ROOT(fn);
+    refresh_function(fn);
+    if (!fn->code || fn->code->cepoch != ctx->macro_epoch) {
+        return compile_lambda(fn, fn->env);
+    }
+    return fn->code;
+}
+
+static Obj **vm_grow_stack(Obj **sp) {
+    size_t n = sp - ctx->vm_stack;
+    size_t cap = ctx->vm_stack ? (ctx->vm_stack_end - ctx->vm_stack) * 2 : 1024;
+    ctx->vm_stack = realloc(ctx->vm_stack, sizeof(Obj *) * cap);
+    if (!ctx->vm_stack) {
+        error("Out of memory for VM stack");
+    }
+    ctx->vm_stack_end = ctx->vm_stack + cap;
+    return ctx->vm_stack + n;
+}
+
+static void vm_push_frame(Obj *code, Obj *env) {
+    if (ctx->vm_nframes >= (size_t)ctx->max_depth) {
+        stack_overflow();
+    }
+    if (ctx->vm_nframes == ctx->vm_frames_cap) {
+        ctx->vm_frames_cap = ctx->vm_frames_cap ? ctx->vm_frames_cap * 2 : 256;
+        ctx->vm_frames = realloc(ctx->vm_frames, sizeof(Activation) * ctx->vm_frames_cap);
+        if (!ctx->vm_frames) {
+            error("Out of memory for VM frames");
+        }
+    }
+    ctx->vm_frames[ctx->vm_nframes++] = (Activation){ code, env, 0 };
+}
+
+#ifdef __x86_64__
+static void jit_compile(Obj *code);
+#endif
+
+// 调用 fn 之前做的检查，返回 fn 的字节码
+static Obj *vm_prepare_call(Obj *fn, int nargs) {
+    if (type_of(fn) != TFUNCTION) {
+        error("The head of a list must be a function");
+    }
+    if (nargs != fn->nparams) {
+        error("Cannot apply function: number of argument doesn't match");
+    }
+    Obj *code = function_code(fn);
+#ifdef __x86_64__
+    if (ctx->use_jit && !code->native && !foreign(code) && ++code->calls == JIT_THRESHOLD) {
+        jit_compile(code);
+    }
+#endif
+    return code;
+}
+
+// 活动记录结束时弹出它的帧。帧是调用时为它创建的，这时已经没有别的引用了
+static inline void vm_pop_frame(Obj *env) {
+    if (on_frame_stack(env)) {
+        ctx->frames_ptr = (char *)env - sizeof(Obj *);
+    }
+}
+
+// 执行栈顶的活动记录，直到活动记录减少到 base 个时返回最后的值。第一次
+// 调用（见 init_globals）只初始化 vm_labels
+static Obj *vm_exec(size_t base) {
+    static void *labels[OP_COUNT] = {
+        [OP_PUSHI] = &&op_pushi, [OP_CONST] = &&op_const,
+        [OP_LREF0] = &&op_lref0, [OP_LREF] = &&op_lref,
+        [OP_LSET] = &&op_lset, [OP_LDEF] = &&op_ldef,
+        [OP_GREF] = &&op_gref, [OP_GSET] = &&op_gset,
+        [OP_SYMREF] = &&op_symref, [OP_SYMSET] = &&op_symset,
+        [OP_POP] = &&op_pop, [OP_JMP] = &&op_jmp, [OP_JNIL] = &&op_jnil,
+        [OP_CLOSURE] = &&op_closure,
+        [OP_ADD] = &&op_add, [OP_SUB] = &&op_sub, [OP_MUL] = &&op_mul,
+        [OP_DIV] = &&op_div, [OP_MOD] = &&op_mod,
+        [OP_NUMEQ] = &&op_numeq, [OP_LT] = &&op_lt, [OP_GT] = &&op_gt,
+        [OP_LE] = &&op_le, [OP_GE] = &&op_ge,
+        [OP_PRIM] = &&op_prim, [OP_EVAL] = &&op_eval, [OP_CHECKFN] = &&op_checkfn,
+        [OP_CALL] = &&op_call, [OP_TAILCALL] = &&op_tailcall, [OP_RET] = &&op_ret,
+    };
+    if (!vm_labels) {
+        vm_labels = labels;
+        return NULL;
+    }
+    
+    GC_FRAME;
+    Obj *tmp = NULL;                // 慢速路径上的临时变量，登记为根
+    GC_ROOT(tmp);
+    Obj *fn, *frame;
+    
+    // 虚拟机的寄存器。code 和 env 同时保存在当前的活动记录里，GC 之后从
+    // 那里重新读取；sp 和 pc 在可能分配内存的操作之前先同步出去
+    Obj *code, *env;
+    Obj **sp;
+    intptr_t *pc;
+    bool flag;      // 共用代码的两条指令用它区分（相邻标签的地址可能相同）
+    
+#define VM_SAVE()   (ctx->vm_sp = sp - ctx->vm_stack, ctx->vm_frames[ctx->vm_nframes - 1].pc = pc - code_ops(code))
+#define VM_LOAD()   (code = ctx->vm_frames[ctx->vm_nframes - 1].code, env = ctx->vm_frames[ctx->vm_nframes - 1].env, \
+                     pc = code_ops(code) + ctx->vm_frames[ctx->vm_nframes - 1].pc, sp = ctx->vm_stack + ctx->vm_sp)
+#define PUSH(v)     do { Obj *v_ = (v); if (sp == ctx->vm_stack_end) sp = vm_grow_stack(sp); *sp++ = v_; } while (0)
+#define NEXT()      goto *(void *)*pc++
+    
+    VM_LOAD();
+    if (code->native) {
+        goto run_native;
+    }
+    NEXT();
+    
+op_pushi:
+    PUSH((Obj *)*pc++);
+    NEXT();
+op_const:
+    PUSH(code->consts[*pc++]);
+    NEXT();
+op_lref0: {
+    Obj *value = env->slots[pc[0]];
+    if (value == Unbound) {
+        error("Undefined symbol: %s", ((Obj *)pc[1])->name);
+    }
+    pc += 2;
+    PUSH(value);
+    NEXT();
+}
+op_lref: {
+    Obj *e = env;
+    for (intptr_t i = pc[0]; i > 0; i--) {
+        e = e->up;
+    }
+    Obj *value = e->slots[pc[1]];
+    if (value == Unbound) {
+        error("Undefined symbol: %s", ((Obj *)pc[2])->name);
+    }
+    pc += 3;
+    PUSH(value);
+    NEXT();
+}
+op_lset:
+    flag = false;
+    goto do_lset;
+op_ldef:
+    flag = true;
+do_lset: {
+    bool define = flag;
+    Obj *e = env;
+    for (intptr_t i = pc[0]; i > 0; i--) {
+        e = e->up;
+    }
+    Obj **loc = &e->slots[pc[1]];
+    check_store(loc);
+    if (!define) {
+        if (*loc == Unbound) {
+            error("Unbound variable %s", ((Obj *)pc[2])->name);
+        }
+        note_overwrite(*loc, sp[-1]);
+    }
+    *loc = sp[-1];
+    pc += define ? 2 : 3;
+    NEXT();
+}
+op_gref:
+    PUSH(((Obj *)*pc++)->value);
+    NEXT();
+op_gset: {
+    Obj *sym = (Obj *)*pc++;
+    check_store(&sym->value);
+    note_overwrite(sym->value, sp[-1]);
+    sym->value = sp[-1];
+    NEXT();
+}
+op_symref: {
+    Obj *sym = (Obj *)*pc++;
+    Obj **loc = find(env, sym);
+    if (!loc || *loc == Unbound) {
+        error("Undefined symbol: %s", sym->name);
+    }
+    PUSH(*loc);
+    NEXT();
+}
+op_symset: {
+    Obj *sym = (Obj *)*pc++;
+    Obj **loc = find(env, sym);
+    if (!loc || *loc == Unbound) {
+        error("Unbound variable %s", sym->name);
+    }
+    check_store(loc);
+    note_overwrite(*loc, sp[-1]);
+    *loc = sp[-1];
+    NEXT();
+}
+op_pop:
+    sp--;
+    NEXT();
+op_jmp:
+    pc += pc[0] + 1;
+    NEXT();
+op_jnil:
+    if (*--sp == Nil) {
+        pc += pc[0] + 1;
+    } else {
+        pc++;
+    }
+    NEXT();
+op_closure: {
+    Obj *proto = code->consts[*pc++];
+    VM_SAVE();
+    tmp = make_function(TFUNCTION, proto, env);
+    VM_LOAD();
+    PUSH(tmp);
+    NEXT();
+}
+    // 整数二元运算，结果直接覆盖第一个参数
+#define INT_OP(name, expr) do { \
+        Obj *x = sp[-2], *y = sp[-1]; \
+        if (!is_fixnum(x) || !is_fixnum(y)) { \
+            error("%s takes only numbers", name); \
+        } \
+        int64_t a = int_value(x), b = int_value(y); \
+        (void)a; (void)b; \
+        sp[-2] = (expr); \
+        sp--; \
+        NEXT(); \
+    } while (0)
+op_add:     INT_OP("+", int_add(a, b));
+op_sub:     INT_OP("-", int_sub(a, b));
+op_mul:     INT_OP("*", int_mul(a, b));
+op_div:     INT_OP("/", int_div(a, b));
+op_mod:     INT_OP("mod", int_mod(a, b));
+    // 值相同的 fixnum 编码也完全相同，直接比较指针即可
+op_numeq:   INT_OP("=", x == y ? True : Nil);
+op_lt:      INT_OP("<", a < b ? True : Nil);
+op_gt:      INT_OP(">", a > b ? True : Nil);
+op_le:      INT_OP("<=", a <= b ? True : Nil);
+op_ge:      INT_OP(">=", a >= b ? True : Nil);
+#undef INT_OP
+op_prim: {
+    Obj *prim = code->consts[pc[0]];
+    Obj *args = code->consts[pc[1]];
+    pc += 2;
+    VM_SAVE();
+    tmp = call_primitive(prim, env, args);
+    VM_LOAD();
+    PUSH(tmp);
+    NEXT();
+}
+op_eval: {
+    Obj *form = code->consts[*pc++];
+    VM_SAVE();
+    tmp = eval(env, form);
+    VM_LOAD();
+    PUSH(tmp);
+    NEXT();
+}
+op_checkfn: {
+    Obj *head = sp[-1];
+    if (type_of(head) == TFUNCTION) {
+        pc += 2;
+        NEXT();
+    }
+    Obj *args = code->consts[pc[0]];
+    pc += pc[1] + 2;
+    sp--;
+    VM_SAVE();
+    if (type_of(head) == TPRIMITIVE) {
+        tmp = call_primitive(head, env, args);
+    } else if (type_of(head) == TMACRO) {
+        // 函数体执行到一半时才定义了这个宏，只好在运行时展开
+        tmp = expand_macro(env, head, args);
+        tmp = eval(ctx->vm_frames[ctx->vm_nframes - 1].env, tmp);
+    } else {
+        error("The head of a list must be a function");
+    }
+    VM_LOAD();
+    PUSH(tmp);
+    NEXT();
+}
+op_call:
+    flag = false;
+    goto do_call;
+op_tailcall:
+    flag = true;
+do_call: {
+    bool tailcall = flag;
+    intptr_t n = *pc++;
+    VM_SAVE();
+    tmp = vm_prepare_call(sp[-n - 1], (int)n);
+    STAT(ctx->stat_applies++);
+    fn = ctx->vm_stack[ctx->vm_sp - n - 1];
+    if (tailcall) {
+        // 实参都在值栈上，旧的帧已经用不到了，新的帧直接压在它的位置上
+        vm_pop_frame(ctx->vm_frames[ctx->vm_nframes - 1].env);
+        ctx->vm_frames[ctx->vm_nframes - 1].env = Nil;
+    }
+    frame = push_frame(fn);
+    Obj **args = ctx->vm_stack + ctx->vm_sp - n;
+    for (intptr_t i = 0; i < n; i++) {
+        frame->slots[i] = args[i];
+    }
+    ctx->vm_sp -= n + 1;
+    if (tailcall) {
+        ctx->vm_frames[ctx->vm_nframes - 1] = (Activation){ tmp, frame, 0 };
+    } else {
+        vm_push_frame(tmp, frame);
+    }
+    VM_LOAD();
+    if (code->native) {
+        goto run_native;
+    }
+    NEXT();
+}
+op_ret: {
+    Obj *value = *--sp;
+    vm_pop_frame(env);
+    if (--ctx->vm_nframes == base) {
+        ctx->vm_sp = sp - ctx->vm_stack;
+        return value;
+    }
+    ctx->vm_sp = sp - ctx->vm_stack;
+    VM_LOAD();
+    PUSH(value);
+    NEXT();
+}
+run_native:
+    // 机器码执行完整个函数，尾部调用别的函数时换好活动记录，返回 TailCall
+    VM_SAVE();
+    tmp = ((NativeCode *)code->native)(ctx);
+    if (tmp == TailCall) {
+        VM_LOAD();
+        if (code->native) {
+            goto run_native;
+        }
+        NEXT();
+    }
+    if (ctx->vm_nframes == base) {
+        return tmp;
+    }
+    VM_LOAD();
+    PUSH(tmp);
+    NEXT();
+#undef VM_SAVE
+#undef VM_LOAD
+#undef PUSH
+#undef NEXT
+}
+
+// 在帧 frame 里执行函数 fn
+static Obj *vm_run(Obj *fn, Obj *frame) {
+    GC_FRAME;
+    GC_ROOT(frame);
+    Obj *code = function_code(fn);
+    size_t base = ctx->vm_nframes;
+    vm_push_frame(code, frame);
+    return vm_exec(base);
+}
+
+// 整数的二元运算 op（OP_ADD 到 OP_GE），即时编译的机器码和编译成 C 的库
+// 在快速路径走不通时调用
+static Obj *int_op(int op, Obj *x, Obj *y) {
+    static const char *names[OP_COUNT] = {
+        [OP_ADD] = "+", [OP_SUB] = "-", [OP_MUL] = "*", [OP_DIV] = "/", [OP_MOD] = "mod",
+        [OP_NUMEQ] = "=", [OP_LT] = "<", [OP_GT] = ">", [OP_LE] = "<=", [OP_GE] = ">=",
+    };
+    if (!is_fixnum(x) || !is_fixnum(y)) {
+        error("%s takes only numbers", names[op]);
+    }
+    int64_t a = int_value(x), b = int_value(y);
+    switch (op) {
+        case OP_ADD:   return int_add(a, b);
+        case OP_SUB:   return int_sub(a, b);
+        case OP_MUL:   return int_mul(a, b);
+        case OP_DIV:   return int_div(a, b);
+        case OP_MOD:   return int_mod(a, b);
+        case OP_NUMEQ: return x == y ? True : Nil;
+        case OP_LT:    return a < b ? True : Nil;
+        case OP_GT:    return a > b ? True : Nil;
+        case OP_LE:    return a <= b ? True : Nil;
+        case OP_GE:    return a >= b ? True : Nil;
+    }
+    error("Unknown integer operation %d", op);
+}
+
+/**
+ 即时编译
+ 使用 --jit 时（只支持 x86-64），虚拟机统计每段字节码被调用的次数，达到
+ JIT_THRESHOLD 次就把它逐条翻译成机器码，每条指令套用一个固定的模板。
+ 整数的加减和比较、局部变量和全局变量的读取、条件跳转直接生成指令，
+ 参数不是 fixnum 或者结果溢出时才调用 C 函数；其他的指令调用和虚拟机做
+ 同样事情的 jit_ 开头的函数。调用已经编译成机器码的函数时直接 call 它的
+ 机器码（调用自己时是相对地址的 call），尾部调用时跳到它的机器码里，
+ 尾部递归就变成了一个循环。
+ 机器码和虚拟机共用值栈和活动记录：rbx 是值栈的栈顶，r12 是当前的帧，
+ r13 是字节码对象（读取常量），r14 是 ctx。调用 C 函数时把栈顶传给它，
+ 由它同步到 ctx->vm_sp；之后帧和字节码可能被 GC 移动了，从活动记录里
+ 重新读取，和虚拟机的 VM_SAVE、VM_LOAD 一样。机器码执行栈顶的活动记录，
+ 返回函数的值；尾部调用没有机器码的函数时把活动记录换成被调用的函数，
+ 然后返回 TailCall，由调用者（vm_exec 或者 jit_resume）接着执行。
+ 每个上下文有自己的一块 JIT_BUFFER_SIZE 字节的内存放机器码，第一次编译时
+ 申请，minilisp_free 时释放。内存一开始可写不可执行，每个函数从新的一页开始，
+ 写好之后它占的页改成只读可执行，不会再变回可写。用完以后这个上下文不再编译
+ 新的函数，已经编译的照常执行。pmap 的工作线程每组任务开始时清空自己的机器码，
+ 复制回父解释器的字节码去掉机器码，需要时由父解释器重新编译。
+ */
+
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+
+#ifdef __x86_64__
+
+// 下面这些函数由机器码调用。sp 是机器码里的栈顶，返回新的栈顶
+static inline void jit_sync(Obj **sp) {
+    ctx->vm_sp = sp - ctx->vm_stack;
+}
+
+static inline Obj **jit_sp(void) {
+    return ctx->vm_stack + ctx->vm_sp;
+}
+
+static inline Activation *jit_top(void) {
+    return &ctx->vm_frames[ctx->vm_nframes - 1];
+}
+
+static inline void jit_check_stack(void) {
+    char here;
+    if (&here < ctx->stack_limit) {
+        stack_overflow();
+    }
+}
+
+// 保证值栈从 sp 到 end 都可以使用，函数开头按它最多用到的深度调用一次
+static Obj **jit_reserve(Obj **sp, Obj **end) {
+    size_t n = end - sp;
+    jit_sync(sp);
+    while ((size_t)(ctx->vm_stack_end - sp) < n) {
+        sp = vm_grow_stack(sp);
+    }
+    return sp;
+}
+
+static void jit_unbound(Obj **sp, Obj *sym) __attribute((noreturn));
+
+static void jit_unbound(Obj **sp, Obj *sym) {
+    jit_sync(sp);
+    error("Undefined symbol: %s", sym->name);
+}
+
+// 整数运算。加减和比较只有参数不是 fixnum 或者溢出时才会调用
+static Obj **jit_int_op(Obj **sp, intptr_t op) {
+    jit_sync(sp);
+    sp[-2] = int_op(op, sp[-2], sp[-1]);
+    return sp - 1;
+}
+
+// OP_LSET 和 OP_LDEF，sym 为 NULL 时是 define
+static Obj **jit_lset(Obj **sp, intptr_t depth, intptr_t slot, Obj *sym) {
+    jit_sync(sp);
+    Obj *e = jit_top()->env;
+    for (; depth > 0; depth--) {
+        e = e->up;
+    }
+    Obj **loc = &e->slots[slot];
+    check_store(loc);
+    if (sym) {
+        if (*loc == Unbound) {
+            error("Unbound variable %s", sym->name);
+        }
+        note_overwrite(*loc, sp[-1]);
+    }
+    *loc = sp[-1];
+    return sp;
+}
+
+static Obj **jit_gset(Obj **sp, Obj *sym) {
+    jit_sync(sp);
+    check_store(&sym->value);
+    note_overwrite(sym->value, sp[-1]);
+    sym->value = sp[-1];
+    return sp;
+}
+
+static Obj **jit_symref(Obj **sp, Obj *sym) {
+    jit_sync(sp);
+    Obj **loc = find(jit_top()->env, sym);
+    if (!loc || *loc == Unbound) {
+        error("Undefined symbol: %s", sym->name);
+    }
+    *sp++ = *loc;
+    return sp;
+}
+
+static Obj **jit_symset(Obj **sp, Obj *sym) {
+    jit_sync(sp);
+    Obj **loc = find(jit_top()->env, sym);
+    if (!loc || *loc == Unbound) {
+        error("Unbound variable %s", sym->name);
+    }
+    check_store(loc);
+    note_overwrite(*loc, sp[-1]);
+    *loc = sp[-1];
+    return sp;
+}
+
+static Obj **jit_closure(Obj **sp, intptr_t k) {
+    jit_sync(sp);
+    Obj *fn = make_function(TFUNCTION, jit_top()->code->consts[k], jit_top()->env);
+    sp = jit_sp();
+    *sp++ = fn;
+    return sp;
+}
+
+static Obj **jit_prim(Obj **sp, intptr_t prim, intptr_t args) {
+    jit_sync(sp);
+    Obj *code = jit_top()->code;
+    Obj *r = call_primitive(code->consts[prim], jit_top()->env, code->consts[args]);
+    sp = jit_sp();
+    *sp++ = r;
+    return sp;
+}
+
+static Obj **jit_eval(Obj **sp, intptr_t k) {
+    jit_sync(sp);
+    Obj *r = eval(jit_top()->env, jit_top()->code->consts[k]);
+    sp = jit_sp();
+    *sp++ = r;
+    return sp;
+}
+
+// OP_CHECKFN 的慢速路径：栈顶不是函数
+static Obj **jit_checkfn(Obj **sp, intptr_t k) {
+    Obj *head = *--sp;
+    jit_sync(sp);
+    Obj *args = jit_top()->code->consts[k];
+    Obj *r;
+    if (type_of(head) == TPRIMITIVE) {
+        r = call_primitive(head, jit_top()->env, args);
+    } else if (type_of(head) == TMACRO) {
+        r = expand_macro(jit_top()->env, head, args);
+        r = eval(jit_top()->env, r);
+    } else {
+        error("The head of a list must be a function");
+    }
+    sp = jit_sp();
+    *sp++ = r;
+    return sp;
+}
+
+// 用栈上的 n 个参数调用它们下面的函数，和 OP_CALL 一样
+static Obj **jit_call(Obj **sp, intptr_t n) {
+    jit_sync(sp);
+    jit_check_stack();
+    vm_prepare_call(sp[-n - 1], (int)n);
+    STAT(ctx->stat_applies++);
+    Obj *frame = push_frame(ctx->vm_stack[ctx->vm_sp - n - 1]);
+    Obj *fn = ctx->vm_stack[ctx->vm_sp - n - 1];
+    Obj **args = ctx->vm_stack + ctx->vm_sp - n;
+    for (intptr_t i = 0; i < n; i++) {
+        frame->slots[i] = args[i];
+    }
+    ctx->vm_sp -= n + 1;
+    Obj *r = vm_run(fn, frame);
+    sp = jit_sp();
+    *sp++ = r;
+    return sp;
+}
+
+// fn 可以用 n 个参数调用，并且字节码已经编译成了机器码。这时不用经过
+// vm_prepare_call 的检查
+static inline bool jit_callable(Obj *fn, intptr_t n) {
+    return type_of(fn) == TFUNCTION && fn->nparams == n && fn->code && fn->code->native
+        && fn->code->cepoch == ctx->macro_epoch && (!fn->source || fn->epoch == ctx->macro_epoch);
+}
+
+// 被调用的函数已经编译成机器码时，为它建立帧和活动记录，返回机器码的入口，
+// 由机器码直接调用。不是的话返回 NULL，交给 jit_call
+static NativeCode *jit_enter(Obj **sp, intptr_t n) {
+    Obj *fn = sp[-n - 1];
+    if (!jit_callable(fn, n)) {
+        return NULL;
+    }
+    jit_sync(sp);
+    jit_check_stack();
+    STAT(ctx->stat_applies++);
+    Obj *frame = push_frame(fn);
+    fn = ctx->vm_stack[ctx->vm_sp - n - 1];
+    Obj **args = ctx->vm_stack + ctx->vm_sp - n;
+    for (intptr_t i = 0; i < n; i++) {
+        frame->slots[i] = args[i];
+    }
+    ctx->vm_sp -= n + 1;
+    vm_push_frame(fn->code, frame);
+    return fn->code->native;
+}
+
+// 直接调用的机器码返回了 TailCall：执行换上来的活动记录，直到它返回
+static Obj *jit_resume(void) {
+    return vm_exec(ctx->vm_nframes - 1);
+}
+
+// 机器码开头保存寄存器的部分之后的位置，所有函数都一样。尾部调用跳到这里。
+// 开头是 push rbx、push r12 到 r15 和 mov r14, rdi，见 jit_compile
+#define JIT_BODY 12
+
+// 尾部调用，把当前的活动记录换成被调用的函数。被调用的函数有机器码时返回
+// 跳转的地址，否则返回 NULL，机器码返回 TailCall
+static void *jit_tailcall(Obj **sp, intptr_t n) {
+    jit_sync(sp);
+    Obj *fn = sp[-n - 1];
+    Obj *code = jit_callable(fn, n) ? fn->code : vm_prepare_call(fn, (int)n);
+    STAT(ctx->stat_applies++);
+    // 字节码先放进活动记录，push_frame 引起 GC 时会被更新
+    Activation *top = jit_top();
+    vm_pop_frame(top->env);
+    *top = (Activation){ code, Nil, 0 };
+    Obj *frame = push_frame(ctx->vm_stack[ctx->vm_sp - n - 1]);
+    Obj **args = ctx->vm_stack + ctx->vm_sp - n;
+    for (intptr_t i = 0; i < n; i++) {
+        frame->slots[i] = args[i];
+    }
+    ctx->vm_sp -= n + 1;
+    top->env = frame;
+    code = top->code;
+    return code->native ? (char *)code->native + JIT_BODY : NULL;
+}
+
+static Obj *jit_ret(Obj **sp) {
+    Obj *value = sp[-1];
+    jit_sync(sp - 1);
+    vm_pop_frame(jit_top()->env);
+    ctx->vm_nframes--;
+    return value;
+}
+
+/**
+ 生成 x86-64 指令
+ 只用到很少几种指令格式，寄存器都是 64 位的。内存操作数一律写成
+ [base + disp32]，生成的代码里跳转都是相对地址，所以可以先生成在普通的
+ 缓冲区里，最后整体复制到可执行内存。
+ */
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R12 = 12, R13, R14, R15 };
+
+// 条件码
+enum { CC_O = 0, CC_E = 4, CC_NE = 5, CC_BE = 6, CC_L = 12, CC_GE = 13, CC_LE = 14, CC_G = 15 };
+
+typedef struct Asm {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    bool failed;            // 内存不够，放弃编译
+} Asm;
+
+static void asm_byte(Asm *a, int byte) {
+    if (a->len == a->cap) {
+        size_t cap = a->cap ? a->cap * 2 : 1024;
+        uint8_t *buf = realloc(a->buf, cap);
+        if (!buf) {
+            a->failed = true;
+            a->len = 0;
+            return;
+        }
+        a->buf = buf;
+        a->cap = cap;
+    }
+    a->buf[a->len++] = (uint8_t)byte;
+}
+
+static void asm_u32(Asm *a, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        asm_byte(a, (v >> (i * 8)) & 0xff);
+    }
+}
+
+static void asm_u64(Asm *a, uint64_t v) {
+    asm_u32(a, (uint32_t)v);
+    asm_u32(a, (uint32_t)(v >> 32));
+}
+
+static void asm_rex(Asm *a, int reg, int rm) {
+    asm_byte(a, 0x48 | (reg >> 3) << 2 | rm >> 3);
+}
+
+// op reg, [base + disp]，或者 op [base + disp], reg
+static void asm_mem(Asm *a, int op, int reg, int base, int32_t disp) {
+    asm_rex(a, reg, base);
+    asm_byte(a, op);
+    asm_byte(a, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        asm_byte(a, 0x24);
+    }
+    asm_u32(a, (uint32_t)disp);
+}
+
+// op rm, reg
+static void asm_reg(Asm *a, int op, int reg, int rm) {
+    asm_rex(a, reg, rm);
+    asm_byte(a, op);
+    asm_byte(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op rm, imm32。ext 是 0x81 组里的操作：0 add，1 or，5 sub，7 cmp
+static void asm_imm(Asm *a, int ext, int rm, int32_t imm) {
+    asm_rex(a, 0, rm);
+    asm_byte(a, 0x81);
+    asm_byte(a, 0xc0 | ext << 3 | (rm & 7));
+    asm_u32(a, (uint32_t)imm);
+}
+
+// test rm, imm32
+static void asm_test(Asm *a, int rm, int32_t imm) {
+    asm_rex(a, 0, rm);
+    asm_byte(a, 0xf7);
+    asm_byte(a, 0xc0 | (rm & 7));
+    asm_u32(a, (uint32_t)imm);
+}
+
+static void asm_mov_imm(Asm *a, int reg, uint64_t imm) {
+    asm_rex(a, 0, reg);
+    asm_byte(a, 0xb8 + (reg & 7));
+    asm_u64(a, imm);
+}
+
+static void asm_push(Asm *a, int reg) {
+    if (reg >= 8) {
+        asm_byte(a, 0x41);
+    }
+    asm_byte(a, 0x50 + (reg & 7));
+}
+
+static void asm_pop(Asm *a, int reg) {
+    if (reg >= 8) {
+        asm_byte(a, 0x41);
+    }
+    asm_byte(a, 0x58 + (reg & 7));
+}
+
+// 条件跳转和无条件跳转，返回偏移量的位置，之后用 asm_patch 填写
+static size_t asm_jcc(Asm *a, int cc) {
+    asm_byte(a, 0x0f);
+    asm_byte(a, 0x80 + cc);
+    asm_u32(a, 0);
+    return a->len - 4;
+}
+
+static size_t asm_jmp(Asm *a) {
+    asm_byte(a, 0xe9);
+    asm_u32(a, 0);
+    return a->len - 4;
+}
+
+static void asm_patch(Asm *a, size_t at, size_t target) {
+    if (!a->failed) {
+        int32_t rel = (int32_t)(target - (at + 4));
+        memcpy(a->buf + at, &rel, 4);
+    }
+}
+
+// 调用 C 函数 fn，第一个参数是栈顶，其余参数由调用者事先放在 rsi、rdx、rcx 里
+static void jit_emit_call(Asm *a, void *fn) {
+    asm_reg(a, 0x89, RBX, RDI);
+    asm_mov_imm(a, RAX, (uint64_t)(uintptr_t)fn);
+    asm_byte(a, 0xff);
+    asm_byte(a, 0xd0);
+}
+
+// 从活动记录里重新读取帧和字节码
+static void jit_emit_reload(Asm *a) {
+    asm_mem(a, 0x8b, RCX, R14, offsetof(Context, vm_nframes));
+    asm_rex(a, RCX, RCX);
+    asm_byte(a, 0x6b);                                      // imul rcx, rcx, sizeof(Activation)
+    asm_byte(a, 0xc9);
+    asm_byte(a, sizeof(Activation));
+    asm_mem(a, 0x03, RCX, R14, offsetof(Context, vm_frames));
+    asm_mem(a, 0x8b, R13, RCX, (int)offsetof(Activation, code) - (int)sizeof(Activation));
+    asm_mem(a, 0x8b, R12, RCX, (int)offsetof(Activation, env) - (int)sizeof(Activation));
+}
+
+// 调用返回新栈顶的 C 函数，然后重新读取帧和字节码
+static void jit_emit_helper(Asm *a, void *fn) {
+    jit_emit_call(a, fn);
+    asm_reg(a, 0x89, RAX, RBX);
+    jit_emit_reload(a);
+}
+
+// 从 ctx->vm_sp 读取栈顶
+static void jit_emit_load_sp(Asm *a) {
+    asm_mem(a, 0x8b, RBX, R14, offsetof(Context, vm_sp));
+    asm_rex(a, 0, RBX);
+    asm_byte(a, 0xc1);                                      // shl rbx, 3
+    asm_byte(a, 0xe3);
+    asm_byte(a, 3);
+    asm_mem(a, 0x03, RBX, R14, offsetof(Context, vm_stack));
+}
+
+// 压入 rax
+static void jit_emit_push(Asm *a) {
+    asm_mem(a, 0x89, RAX, RBX, 0);
+    asm_imm(a, 0, RBX, sizeof(Obj *));
+}
+
+static void jit_emit_epilogue(Asm *a) {
+    asm_pop(a, R15);
+    asm_pop(a, R14);
+    asm_pop(a, R13);
+    asm_pop(a, R12);
+    asm_pop(a, RBX);
+    asm_byte(a, 0xc3);
+}
+
+// 把栈顶的两个参数读进 rax 和 rcx，不都是 fixnum 时跳到 stub 处理
+static size_t jit_emit_int_args(Asm *a) {
+    asm_mem(a, 0x8b, RAX, RBX, -2 * (int)sizeof(Obj *));
+    asm_mem(a, 0x8b, RCX, RBX, -(int)sizeof(Obj *));
+    asm_reg(a, 0x89, RAX, RDX);
+    asm_reg(a, 0x21, RCX, RDX);
+    asm_test(a, RDX, TAG_FIXNUM);
+    return asm_jcc(a, CC_E);
+}
+
+/**
+ 翻译字节码
+ */
+
+// 慢速路径，放在函数的机器码后面
+enum { STUB_INT_OP, STUB_UNBOUND, STUB_CHECKFN };
+
+typedef struct JitStub {
+    int kind;
+    size_t at[2];           // 跳到这里的跳转
+    int nat;
+    intptr_t arg;
+    size_t resume;          // STUB_INT_OP 执行完之后回到的位置
+    int target;             // STUB_CHECKFN 执行完之后跳到的字节码
+} JitStub;
+
+// 跳到某条字节码的跳转，最后统一填写
+typedef struct JitFixup {
+    size_t at;
+    int target;
+} JitFixup;
+
+typedef struct Jit {
+    Asm a;
+    intptr_t *ops;
+    int nops;
+    int *depth;             // 每条字节码执行之前值栈的深度，-1 表示还不知道
+    size_t *pos;            // 每条字节码对应的机器码的位置
+    JitStub *stubs;
+    int nstubs;
+    JitFixup *fixups;
+    int nfixups;
+    bool failed;
+} Jit;
+
+static JitStub *jit_stub(Jit *j, int kind, intptr_t arg) {
+    JitStub *s = realloc(j->stubs, sizeof(JitStub) * (j->nstubs + 1));
+    if (!s) {
+        j->failed = true;
+        return NULL;
+    }
+    j->stubs = s;
+    s = &s[j->nstubs++];
+    memset(s, 0, sizeof(*s));
+    s->kind = kind;
+    s->arg = arg;
+    return s;
+}
+
+static void jit_stub_from(JitStub *s, size_t at) {
+    if (s) {
+        s->at[s->nat++] = at;
+    }
+}
+
+// 跳到字节码 target，同时记录那里的栈深度。只有向前的跳转，深度不一致
+// 的字节码不编译
+static void jit_branch(Jit *j, size_t at, int target, int depth) {
+    if (target <= 0 || target >= j->nops || (j->depth[target] >= 0 && j->depth[target] != depth)) {
+        j->failed = true;
+        return;
+    }
+    j->depth[target] = depth;
+    JitFixup *f = realloc(j->fixups, sizeof(JitFixup) * (j->nfixups + 1));
+    if (!f) {
+        j->failed = true;
+        return;
+    }
+    j->fixups = f;
+    f[j->nfixups++] = (JitFixup){ at, target };
+}
+
+// 由指令地址找到操作码。两个操作码的地址相同时分不清是哪一条，不编译
+static int jit_opcode(intptr_t word) {
+    int r = -1;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if ((intptr_t)vm_labels[op] == word) {
+            if (r >= 0) {
+                return -1;
+            }
+            r = op;
+        }
+    }
+    return r;
+}
+
+// 每条指令的操作数个数
+static const int jit_nargs[OP_COUNT] = {
+    [OP_PUSHI] = 1, [OP_CONST] = 1, [OP_LREF0] = 2, [OP_LREF] = 3, [OP_LSET] = 3, [OP_LDEF] = 2,
+    [OP_GREF] = 1, [OP_GSET] = 1, [OP_SYMREF] = 1, [OP_SYMSET] = 1, [OP_JMP] = 1, [OP_JNIL] = 1,
+    [OP_CLOSURE] = 1, [OP_PRIM] = 2, [OP_EVAL] = 1, [OP_CHECKFN] = 2, [OP_CALL] = 1, [OP_TAILCALL] = 1,
+};
+
+// 翻译一条指令，返回执行之后的栈深度，-1 表示之后的字节码不会接着执行
+static int jit_op(Jit *j, int op, intptr_t *arg, int i, int depth) {
+    Asm *a = &j->a;
+    switch (op) {
+        case OP_PUSHI:
+            asm_mov_imm(a, RAX, (uint64_t)arg[0]);
+            jit_emit_push(a);
+            return depth + 1;
+        case OP_CONST:
+            asm_mem(a, 0x8b, RAX, R13, offsetof(Obj, consts) + sizeof(Obj *) * arg[0]);
+            jit_emit_push(a);
+            return depth + 1;
+        case OP_LREF0:
+        case OP_LREF: {
+            int base = R12;
+            if (op == OP_LREF) {
+                asm_reg(a, 0x89, R12, RAX);
+                for (intptr_t k = 0; k < arg[0]; k++) {
+                    asm_mem(a, 0x8b, RAX, RAX, offsetof(Obj, up));
+                }
+                base = RAX;
+                arg++;
+            }
+            asm_mem(a, 0x8b, RAX, base, offsetof(Obj, slots) + sizeof(Obj *) * arg[0]);
+            asm_imm(a, 7, RAX, (int32_t)(intptr_t)Unbound);
+            jit_stub_from(jit_stub(j, STUB_UNBOUND, arg[1]), asm_jcc(a, CC_E));
+            jit_emit_push(a);
+            return depth + 1;
+        }
+        case OP_LSET:
+        case OP_LDEF:
+            asm_mov_imm(a, RSI, (uint64_t)arg[0]);
+            asm_mov_imm(a, RDX, (uint64_t)arg[1]);
+            asm_mov_imm(a, RCX, op == OP_LSET ? (uint64_t)arg[2] : 0);
+            jit_emit_helper(a, jit_lset);
+            return depth;
+        case OP_GREF:
+            asm_mov_imm(a, RAX, (uint64_t)arg[0]);
+            asm_mem(a, 0x8b, RAX, RAX, offsetof(Obj, value));
+            jit_emit_push(a);
+            return depth + 1;
+        case OP_GSET:
+        case OP_SYMREF:
+        case OP_SYMSET:
+            asm_mov_imm(a, RSI, (uint64_t)arg[0]);
+            jit_emit_helper(a, op == OP_GSET ? (void *)jit_gset : op == OP_SYMREF ? (void *)jit_symref : (void *)jit_symset);
+            return op == OP_SYMREF ? depth + 1 : depth;
+        case OP_POP:
+            asm_imm(a, 5, RBX, sizeof(Obj *));
+            return depth - 1;
+        case OP_JMP:
+            jit_branch(j, asm_jmp(a), i + 2 + (int)arg[0], depth);
+            return -1;
+        case OP_JNIL:
+            asm_imm(a, 5, RBX, sizeof(Obj *));
+            asm_mem(a, 0x8b, RAX, RBX, 0);
+            asm_imm(a, 7, RAX, (int32_t)(intptr_t)Nil);
+            jit_branch(j, asm_jcc(a, CC_E), i + 2 + (int)arg[0], depth - 1);
+            return depth - 1;
+        case OP_CLOSURE:
+        case OP_EVAL:
+            asm_mov_imm(a, RSI, (uint64_t)arg[0]);
+            jit_emit_helper(a, op == OP_CLOSURE ? (void *)jit_closure : (void *)jit_eval);
+            return depth + 1;
+        case OP_ADD:
+        case OP_SUB: {
+            JitStub *s = jit_stub(j, STUB_INT_OP, op);
+            jit_stub_from(s, jit_emit_int_args(a));
+            // fixnum 是 2n+1，去掉一个标志位再相加；相减之后补上标志位
+            if (op == OP_ADD) {
+                asm_imm(a, 5, RAX, 1);
+                asm_reg(a, 0x01, RCX, RAX);
+                jit_stub_from(s, asm_jcc(a, CC_O));
+            } else {
+                asm_reg(a, 0x29, RCX, RAX);
+                jit_stub_from(s, asm_jcc(a, CC_O));
+                asm_imm(a, 1, RAX, 1);
+            }
+            asm_mem(a, 0x89, RAX, RBX, -2 * (int)sizeof(Obj *));
+            asm_imm(a, 5, RBX, sizeof(Obj *));
+            if (s) {
+                s->resume = a->len;
+            }
+            return depth - 1;
+        }
+        case OP_NUMEQ:
+        case OP_LT:
+        case OP_GT:
+        case OP_LE:
+        case OP_GE: {
+            static const int cc[OP_COUNT] = {
+                [OP_NUMEQ] = CC_E, [OP_LT] = CC_L, [OP_GT] = CC_G, [OP_LE] = CC_LE, [OP_GE] = CC_GE,
+            };
+            JitStub *s = jit_stub(j, STUB_INT_OP, op);
+            jit_stub_from(s, jit_emit_int_args(a));
+            // 编码之后的 fixnum 大小顺序不变
+            asm_reg(a, 0x39, RCX, RAX);
+            asm_mov_imm(a, RAX, (uint64_t)(uintptr_t)Nil);
+            asm_mov_imm(a, RDX, (uint64_t)(uintptr_t)True);
+            asm_rex(a, RAX, RDX);
+            asm_byte(a, 0x0f);                              // cmovcc rax, rdx
+            asm_byte(a, 0x40 + cc[op]);
+            asm_byte(a, 0xc2);
+            asm_mem(a, 0x89, RAX, RBX, -2 * (int)sizeof(Obj *));
+            asm_imm(a, 5, RBX, sizeof(Obj *));
+            if (s) {
+                s->resume = a->len;
+            }
+            return depth - 1;
+        }
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+            asm_mov_imm(a, RSI, (uint64_t)op);
+            jit_emit_call(a, jit_int_op);
+            asm_reg(a, 0x89, RAX, RBX);
+            return depth - 1;
+        case OP_PRIM:
+            asm_mov_imm(a, RSI, (uint64_t)arg[0]);
+            asm_mov_imm(a, RDX, (uint64_t)arg[1]);
+            jit_emit_helper(a, jit_prim);
+            return depth + 1;
+        case OP_CHECKFN: {
+            // 栈顶是函数时什么也不做，否则交给 jit_checkfn，然后跳过参数和调用
+            JitStub *s = jit_stub(j, STUB_CHECKFN, arg[0]);
+            asm_mem(a, 0x8b, RAX, RBX, -(int)sizeof(Obj *));
+            asm_test(a, RAX, TAG_MASK);
+            jit_stub_from(s, asm_jcc(a, CC_NE));
+            asm_byte(a, 0x8b);                              // mov ecx, [rax]
+            asm_byte(a, 0x08);
+            asm_byte(a, 0x81);                              // cmp ecx, TFUNCTION
+            asm_byte(a, 0xf9);
+            asm_u32(a, TFUNCTION);
+            jit_stub_from(s, asm_jcc(a, CC_NE));
+            int target = i + 3 + (int)arg[1];
+            if (s) {
+                s->target = target;
+            }
+            if (target <= 0 || target >= j->nops || (j->depth[target] >= 0 && j->depth[target] != depth)) {
+                j->failed = true;
+            } else {
+                j->depth[target] = depth;
+            }
+            return depth;
+        }
+        case OP_CALL: {
+            // 被调用的函数有机器码时直接 call 它，是自己的话用相对地址。
+            // 返回 TailCall 的话还要接着执行换上来的活动记录
+            asm_mov_imm(a, RSI, (uint64_t)arg[0]);
+            jit_emit_call(a, jit_enter);
+            asm_reg(a, 0x85, RAX, RAX);
+            size_t to_generic = asm_jcc(a, CC_E);
+            asm_reg(a, 0x89, R14, RDI);
+            asm_rex(a, RCX, 0);
+            asm_byte(a, 0x8d);                              // lea rcx, [rip + 开头]
+            asm_byte(a, 0x0d);
+            asm_u32(a, (uint32_t)(0 - (int32_t)(a->len + 4)));
+            asm_reg(a, 0x39, RCX, RAX);
+            size_t to_other = asm_jcc(a, CC_NE);
+            asm_byte(a, 0xe8);                              // call 开头
+            asm_u32(a, (uint32_t)(0 - (int32_t)(a->len + 4)));
+            size_t to_called = asm_jmp(a);
+            asm_patch(a, to_other, a->len);
+            asm_byte(a, 0xff);                              // call rax
+            asm_byte(a, 0xd0);
+            asm_patch(a, to_called, a->len);
+            asm_imm(a, 7, RAX, (int32_t)(intptr_t)TailCall);
+            size_t to_done = asm_jcc(a, CC_NE);
+            asm_mov_imm(a, RAX, (uint64_t)(uintptr_t)jit_resume);
+            asm_byte(a, 0xff);
+            asm_byte(a, 0xd0);
+            asm_patch(a, to_done, a->len);
+            jit_emit_load_sp(a);
+            jit_emit_push(a);
+            jit_emit_reload(a);
+            size_t to_next = asm_jmp(a);
+            asm_patch(a, to_generic, a->len);
+            asm_mov_imm(a, RSI, (uint64_t)arg[0]);
+            jit_emit_helper(a, jit_call);
+            asm_patch(a, to_next, a->len);
+            return depth - (int)arg[0];
+        }
+        case OP_TAILCALL: {
+            asm_mov_imm(a, RSI, (uint64_t)arg[0]);
+            jit_emit_call(a, jit_tailcall);
+            asm_reg(a, 0x85, RAX, RAX);
+            size_t to_return = asm_jcc(a, CC_E);
+            asm_byte(a, 0xff);                              // jmp rax
+            asm_byte(a, 0xe0);
+            asm_patch(a, to_return, a->len);
+            asm_mov_imm(a, RAX, (uint64_t)(uintptr_t)TailCall);
+            jit_emit_epilogue(a);
+            return -1;
+        }
+        case OP_RET:
+            jit_emit_call(a, jit_ret);
+            jit_emit_epilogue(a);
+            return -1;
+    }
+    j->failed = true;
+    return -1;
+}
+
+// 把机器码复制到当前上下文的机器码内存里，放不下时返回 NULL
+static void *jit_install(Asm *a) {
+    if (!ctx->jit_start) {
+        void *p = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            ctx->jit_disabled = true;
+            return NULL;
+        }
+        ctx->jit_start = ctx->jit_ptr = p;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (a->len + page - 1) & ~(page - 1);
+    if ((size_t)(ctx->jit_start + JIT_BUFFER_SIZE - ctx->jit_ptr) < size) {
+        ctx->jit_disabled = true;
+        return NULL;
+    }
+    void *r = ctx->jit_ptr;
+    memcpy(r, a->buf, a->len);
+    if (mprotect(r, size, PROT_READ | PROT_EXEC)) {
+        ctx->jit_disabled = true;
+        return NULL;
+    }
+    ctx->jit_ptr += size;
+    return r;
+}
+
+// 把字节码 code 翻译成机器码，成功时设置 code->native。遇到不能翻译的
+// 字节码时什么也不做，函数继续在虚拟机里执行
+static void jit_compile(Obj *code) {
+    if (ctx->jit_disabled) {
+        return;
+    }
+    Jit j = { 0 };
+    j.ops = code_ops(code);
+    j.nops = code->nops;
+    j.depth = malloc(sizeof(int) * (j.nops + 1));
+    j.pos = malloc(sizeof(size_t) * (j.nops + 1));
+    if (!j.depth || !j.pos) {
+        j.failed = true;
+    } else {
+        for (int i = 0; i <= j.nops; i++) {
+            j.depth[i] = -1;
+        }
+        j.depth[0] = 0;
+    }
+    Asm *a = &j.a;
+    
+    // 函数开头：保存寄存器，r14 = ctx，读取栈顶、帧和字节码，预留值栈
+    asm_push(a, RBX);
+    asm_push(a, R12);
+    asm_push(a, R13);
+    asm_push(a, R14);
+    asm_push(a, R15);
+    asm_reg(a, 0x89, RDI, R14);
+    if (!a->failed && a->len != JIT_BODY) {
+        error("Bug: JIT prologue is %zu bytes", a->len);
+    }
+    jit_emit_load_sp(a);
+    jit_emit_reload(a);
+    asm_reg(a, 0x89, RBX, RAX);
+    asm_imm(a, 0, RAX, 0);
+    size_t reserve = a->len - 4;
+    asm_mem(a, 0x3b, RAX, R14, offsetof(Context, vm_stack_end));
+    size_t to_ok = asm_jcc(a, CC_BE);
+    asm_reg(a, 0x89, RAX, RSI);
+    jit_emit_call(a, jit_reserve);
+    asm_reg(a, 0x89, RAX, RBX);
+    asm_patch(a, to_ok, a->len);
+    
+    int depth = 0, max = 0;
+    for (int i = 0; i < j.nops && !j.failed; ) {
+        int op = jit_opcode(j.ops[i]);
+        if (op < 0) {
+            j.failed = true;
+            break;
+        }
+        if (depth < 0) {
+            depth = j.depth[i];
+        } else if (j.depth[i] >= 0 && j.depth[i] != depth) {
+            j.failed = true;
+            break;
+        }
+        j.pos[i] = a->len;
+        if (depth >= 0) {
+            j.depth[i] = depth;
+            depth = jit_op(&j, op, &j.ops[i + 1], i, depth);
+            max = depth > max ? depth : max;
+        }
+        i += 1 + jit_nargs[op];
+    }
+    if (depth >= 0) {
+        // 字节码总是以返回或者跳转结束
+        j.failed = true;
+    }
+    
+    // 慢速路径
+    for (int k = 0; k < j.nstubs && !j.failed; k++) {
+        JitStub *s = &j.stubs[k];
+        for (int n = 0; n < s->nat; n++) {
+            asm_patch(a, s->at[n], a->len);
+        }
+        asm_mov_imm(a, RSI, (uint64_t)s->arg);
+        switch (s->kind) {
+            case STUB_INT_OP:
+                jit_emit_call(a, jit_int_op);
+                asm_reg(a, 0x89, RAX, RBX);
+                asm_patch(a, asm_jmp(a), s->resume);
+                break;
+            case STUB_UNBOUND:
+                jit_emit_call(a, jit_unbound);
+                asm_byte(a, 0xcc);                          // int3，不会执行到
+                break;
+            case STUB_CHECKFN:
+                jit_emit_helper(a, jit_checkfn);
+                jit_branch(&j, asm_jmp(a), s->target, j.depth[s->target]);
+                break;
+        }
+    }
+    for (int k = 0; k < j.nfixups && !j.failed; k++) {
+        asm_patch(a, j.fixups[k].at, j.pos[j.fixups[k].target]);
+    }
+    if (!j.failed && !a->failed) {
+        int32_t bytes = (int32_t)(sizeof(Obj *) * (max + 1));
+        memcpy(a->buf + reserve, &bytes, 4);
+        code->native = jit_install(a);
+        STAT(if (code->native) ctx->stat_jit_functions++);
+    }
+    free(a->buf);
+    free(j.depth);
+    free(j.pos);
+    free(j.stubs);
+    free(j.fixups);
+}
+
+#endif
+
+/**
+ 错误恢复
+ error 不会结束进程，而是用 longjmp 跳回最近的错误处理点：顶层的读取-求值
+ 循环，或者 Lisp 代码里的 catch。建立处理点时记下 GC 根、求值深度、虚拟机
+ 的栈和当前输入，跳回来时恢复这些状态，中间被跳过的 C 函数来不及撤销的
+ 登记就一次撤销掉了。堆和环境不需要恢复：出错之前完成的定义和赋值都保留，
+ 做了一半的分配只是变成了垃圾，所以一个出错的表达式不会影响之后的求值。
+ */
+typedef struct Handler {
+    jmp_buf jb;
+    struct Handler *prev;   // 外层的处理点
+    size_t nroots;
+    int eval_depth;
+    size_t vm_sp;
+    size_t vm_nframes;
+    char *frames_ptr;
+    Obj **current_form;
+    Reader *reader;         // 之后打开的输入在跳回来之前关闭
+} Handler;
+
+// 建立错误处理点，之后要调用 setjmp(h->jb)。正常离开时用 pop_handler 撤销，
+// 出错跳回来时处理点已经撤销了
+static void push_handler(Handler *h) {
+    h->prev = ctx->handler;
+    h->nroots = ctx->nroots;
+    h->eval_depth = ctx->eval_depth;
+    h->vm_sp = ctx->vm_sp;
+    h->vm_nframes = ctx->vm_nframes;
+    h->frames_ptr = ctx->frames_ptr;
+    h->current_form = ctx->current_form;
+    h->reader = ctx->reader;
+    ctx->handler = h;
+}
+
+static void pop_handler(Handler *h) {
+    ctx->handler = h->prev;
+}
+
+// 把错误的位置、error_message 和出错的表达式写进 error_report。跳回去以后
+// 出错的输入已经关闭，表达式也可能被 GC 移动，所以要在跳之前写好
+static void format_error(void) {
+    size_t size = sizeof(ctx->error_report);
+    int n = 0;
+    if (ctx->reader) {
+        if (ctx->reader->err_col) {
+            n = snprintf(ctx->error_report, size, "%s:%d:%d: ", ctx->reader->name, ctx->reader->form_line, ctx->reader->err_col);
+        } else {
+            n = snprintf(ctx->error_report, size, "%s:%d: ", ctx->reader->name, ctx->reader->form_line);
+        }
+    }
+    n += snprintf(ctx->error_report + n, size - n, "%s", ctx->error_message);
+    // 语法错误发生在读取时，正在求值的表达式和它无关
+    if (!ctx->current_form || (ctx->reader && ctx->reader->err_col) || (size_t)n >= size - 16) {
+        return;
+    }
+    n += snprintf(ctx->error_report + n, size - n, "\n    in: ");
+    Out out;
+    out_open_buffer(&out, ctx->error_report + n, size - n);
+    print_to(&out, *ctx->current_form);
+}
+
+static void throw_error(void) {
+    format_error();
+    Handler *h = ctx->handler;
+    if (!h) {
+        out_flush(&ctx->out);
+        fprintf(stderr, "%s\n", ctx->error_report);
+        exit(1);                    // 发生错误，异常退出（返回 1）
+    }
+    while (ctx->reader != h->reader) {
+        Reader *r = ctx->reader;
+        ctx->reader = r->prev;
+        reader_close(r);
+    }
+    ctx->nroots = h->nroots;
+    ctx->eval_depth = h->eval_depth;
+    ctx->vm_sp = h->vm_sp;
+    ctx->vm_nframes = h->vm_nframes;
+    ctx->frames_ptr = h->frames_ptr;
+    ctx->current_form = h->current_form;
+    ctx->handler = h->prev;
+    longjmp(h->jb, 1);
+}
+
+// (catch expr handler)
+// 求值 expr。出错时求值 handler 得到一个函数，用错误信息（字符串）调用它，
+// 返回它的结果
+static Obj *prim_catch(Obj *env, Obj *list) {
+    if (list_length(list) != 2) {
+        error("Malformed catch");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Handler h;
+    push_handler(&h);
+    if (!setjmp(h.jb)) {
+        Obj *r = eval(env, list->car);
+        pop_handler(&h);
+        return r;
+    }
+    if (ctx->exiting) {
+        // (exit) 不是错误，接着跳回外层
+        throw_error();
+    }
+    Obj *fn = eval(env, cdr_of(list)->car);
+    if (type_of(fn) != TPRIMITIVE && type_of(fn) != TFUNCTION) {
+        error("catch: handler must be a function");
+    }
+    GC_ROOT(fn);
+    // 字符串的值是它自己，直接拼成 (fn "message") 交给 eval
+    Obj *call = make_string(ctx->error_message, strlen(ctx->error_message));
+    call = cons(call, Nil);
+    return tail_eval(env, cons(fn, call));
+}
+
+// (error expr)
+// 报告错误。字符串直接作为错误信息，其他的值打印出来
+static Obj *prim_error(Obj *env, Obj *list) {
+    if (list_length(list) != 1) {
+        error("Malformed error");
+    }
+    Obj *obj = eval(env, list->car);
+    if (type_of(obj) == TSTRING) {
+        error("%s", obj->str);
+    }
+    char buf[sizeof(ctx->error_message)];
+    Out out;
+    out_open_buffer(&out, buf, sizeof(buf));
+    print_to(&out, obj);
+    error("%s", buf);
+}
+
+/**
+ 优化
+ 分析函数体时顺便做几种简单的优化：头部是原始函数的应用格式把头部换成
+ TPREF 节点，运行时不用再沿着各层的帧查找；参数都是常量的整数运算和比较
+ 在分析时就算出结果；条件是常量的 if 只留下会执行的分支。
+ 这些优化依赖分析时原始函数的绑定，所以和展开过宏的函数一样记住源代码：
+ 原始函数被重新定义时 macro_epoch 改变，函数在下一次调用之前重新分析。
+ TPREF 在运行时还会确认标志的值仍然是原来的原始函数，所以正在执行的函数体
+ 也不会用到旧的定义。
+ */
+
+// 结果只取决于参数、也没有副作用的原始函数，参数都是常量时可以在分析时求值
+static bool foldable(Primitive *fn) {
+    return fn == prim_plus || fn == prim_minus || fn == prim_mul || fn == prim_div || fn == prim_mod
+        || fn == prim_num_eq || fn == prim_lt || fn == prim_gt || fn == prim_le || fn == prim_ge;
+}
+
+// form 的值在分析时就能确定的话，返回 true 并设置 value
+static bool constant_value(Obj *form, Obj **value) {
+    switch (type_of(form)) {
+        case TINT:
+        case TSPECIAL:
+        case TSTRING:
+        case TVECTOR:
+            *value = form;
+            return true;
+        case TCALL:
+            if (type_of(form->car) == TPREF && form->car->cdr->fn == prim_quote
+                && type_of(cdr_of(form)) == TCELL && cdr_of(cdr_of(form)) == Nil) {
+                *value = cdr_of(form)->car;
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+// 参数都是整数之类的立即数时直接调用原始函数，出错（比如溢出、除以零）的话
+// 保持原样，留到运行时再报错
+static Obj *fold_call(Obj *call) {
+    Obj *p = cdr_of(call);
+    for (; type_of(p) == TCELL; p = cdr_of(p)) {
+        if (is_pointer(p->car)) {
+            return call;
+        }
+    }
+    if (p != Nil) {
+        return call;
+    }
+    Handler h;
+    push_handler(&h);
+    if (!setjmp(h.jb)) {
+        Obj *r = call->car->cdr->fn(NULL, cdr_of(call));
+        pop_handler(&h);
+        return r;
+    }
+    return call;
+}
+
+// 条件是常量的 (if cond then else ...) 换成会执行的分支。else 有多个表达式时
+// 保持原样
+static Obj *fold_if(Obj *call) {
+    Obj *args = cdr_of(call);
+    Obj *cond;
+    if (type_of(args) != TCELL || type_of(cdr_of(args)) != TCELL || !is_list(cdr_of(cdr_of(args)))
+        || !constant_value(args->car, &cond)) {
+        return call;
+    }
+    if (cond != Nil) {
+        return cdr_of(args)->car;
+    }
+    Obj *els = cdr_of(cdr_of(args));
+    if (els == Nil) {
+        return Nil;
+    }
+    return cdr_of(els) == Nil ? els->car : call;
+}
+
+static Obj *prim_pcall(Obj *env, Obj *list);
+
+// 优化分析过的应用格式 call
+static Obj *optimize_call(Scope *sc, Obj *call) {
+    Obj *sym = call->car;
+    if (type_of(sym) != TSYMBOL) {
+        return call;
+    }
+    // 头部不是局部变量（否则分析后是 TLVAR），并且按名字查找会找到全局的原始函数
+    Obj **loc = find(sc->menv, sym);
+    if (loc != &sym->value || type_of(*loc) != TPRIMITIVE) {
+        // 这个名字以后可能被定义成宏，那时实参已经分析过了，不能再交给宏
+        // 展开。记住源代码，定义宏之后重新分析整个函数体
+        sc->resolved = true;
+        return call;
+    }
+    GC_FRAME;
+    GC_ROOT(call);
+    Obj *pref = make_pref(sym, *loc);
+    call->car = pref;
+    sc->resolved = true;
+    if (pref->cdr->fn == prim_pcall) {
+        // 工作线程求值时可能创建函数，pcall 会先把环境搬到堆上
+        sc->captures = true;
+    }
+    if (pref->cdr->fn == prim_if) {
+        return fold_if(call);
+    }
+    if (pref->cdr->fn == prim_quote) {
+        // 整数和特殊常量的值就是它们自己
+        Obj *value;
+        return constant_value(call, &value) && !is_pointer(value) ? value : call;
+    }
+    if (foldable(pref->cdr->fn)) {
+        return fold_call(call);
+    }
+    return call;
+}
+
+/**
+ 并行求值
+ (pmap fn list) 把 fn 分别应用到 list 的每个元素上，(pcall expr ...) 分别求值
+ 每个表达式，结果都按原来的顺序排成列表。任务由一组常驻的工作线程执行，
+ 线程数默认等于处理器个数（--threads 可以修改）。任务开始时平均分给每个
+ 线程，每个线程从自己那份的前面取任务，做完了就从别的线程那份的后面偷，
+ 这样任务的耗时不均匀时也不会有线程闲着。
+
+ 每个工作线程有自己的上下文和堆，分配和 GC 都不需要和别的线程协调。父解释器
+ 的堆在任务期间不会变化，工作线程直接读取里面的函数、参数和全局变量，但不能
+ 修改它们（见 check_store），所以 fn 应该是没有副作用的函数。任务结束后工作
+ 线程先做一次 GC，堆里只剩下结果，父解释器再用 GC 的复制过程把它们搬进自己
+ 的堆里。多个任务出错时报告下标最小的那个，和顺序执行时看到的错误一样。
+ 同一时间只有一个 pmap 在使用这组线程，工作线程里嵌套的 pmap 按顺序执行。
+ */
+
+static int nthreads;                // --threads，0 表示和处理器个数相同
+
+// 用一个按嵌套深度 depth（--max-depth）分配的栈启动线程，和解释器线程一样
+// 可以深度递归。out 不是 NULL 时存入栈的映射，线程结束后由调用者 munmap
+typedef struct Stack {
+    char *base;
+    size_t size;
+} Stack;
+
+static bool spawn_thread(pthread_t *thread, int depth, void *(*fn)(void *), void *arg, Stack *out) {
+    // 栈用 mmap 保留地址空间，实际用到的页才会分配物理内存。最低的一页设成
+    // 不可访问，栈溢出时进程收到 SIGSEGV，而不是写坏下面的其他映射
+    size_t guard = (size_t)sysconf(_SC_PAGESIZE);
+    size_t stack_size = (size_t)depth * STACK_PER_DEPTH + STACK_MARGIN;
+    stack_size = (stack_size + guard - 1) / guard * guard;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_STACK
+    flags |= MAP_STACK;     // Linux 和 BSD 有，macOS 没有
+#endif
+    char *stack = mmap(NULL, guard + stack_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (stack == MAP_FAILED) {
+        return false;
+    }
+    if (mprotect(stack, guard, PROT_NONE)) {
+        munmap(stack, guard + stack_size);
+        return false;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack + guard, stack_size);
+    int err = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        munmap(stack, guard + stack_size);
+        return false;
+    }
+    if (out) {
+        out->base = stack;
+        out->size = guard + stack_size;
+    }
+    return true;
+}
+
+typedef struct Worker {
+    pthread_t thread;
+    Stack stack;
+    Context *ctx;
+    pthread_mutex_t lock;   // 保护 lo 和 hi
+    int lo, hi;             // 还没开始的任务 [lo, hi)，自己从前面取，别的线程从后面偷
+    Obj *results;           // 做完的任务 ((下标 . 值) ...)，在工作线程自己的堆里
+} Worker;
+
+// 正在执行的一组任务
+typedef struct Job {
+    Context *parent;
+    Obj *fn;                // pmap 的函数，pcall 时为 NULL
+    Obj *env;               // pcall 求值表达式的环境
+    Obj **items;            // pmap 的参数或者 pcall 的表达式
+    int n;
+    int error_index;        // 出错的任务中最小的下标，没有出错时为 n
+    char error[sizeof(((Context *)0)->error_message)];
+} Job;
+
+static Worker *workers;
+static int nworkers;
+static size_t pool_heap_size;       // 工作线程的堆和栈是按这两个选项分配的
+static int pool_max_depth;
+static Job job;
+static unsigned job_generation;     // 每派发一组任务加一，工作线程用它发现新任务
+static int job_running;             // 还没做完的工作线程个数
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;  // 同一时间只运行一组任务
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;   // 保护上面几个变量和 job
+static pthread_cond_t job_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+// 取下一个任务，先取自己的，没有了就去偷别人的。全部做完时返回 -1
+static int next_task(Worker *self) {
+    pthread_mutex_lock(&self->lock);
+    int i = self->lo < self->hi ? self->lo++ : -1;
+    pthread_mutex_unlock(&self->lock);
+    for (int k = 1; i < 0 && k < nworkers; k++) {
+        Worker *victim = &workers[(self - workers + k) % nworkers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->lo < victim->hi) {
+            i = --victim->hi;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return i;
+}
+
+// 用参数 arg 调用 fn。拼成 (fn (quote arg)) 交给 eval，和普通的函数调用走同一条路
+static Obj *apply_value(Obj *env, Obj *fn, Obj *arg) {
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(fn);
+    Obj *form = cons(arg, Nil);
+    form = cons(ctx->Sym_quote, form);
+    form = cons(form, Nil);
+    form = cons(fn, form);
+    return eval(env, form);
+}
+
+// 执行第 i 个任务
+static Obj *run_task(int i) {
+    if (job.fn) {
+        return apply_value(ctx->env, job.fn, job.items[i]);
+    }
+    return eval(job.env, job.items[i]);
+}
+
+// 工作线程执行分到的任务，结果留在 self->results 里
+static void run_tasks(Worker *self) {
+    // 上一组任务的结果已经被父解释器取走，整个堆都可以重新使用
+    Context *parent = job.parent;
+    ctx->heap_ptr = ctx->heap_start;
+    // 机器码也都属于已经丢掉的函数，改回可写以便重新使用
+    if (ctx->jit_ptr != ctx->jit_start) {
+        mprotect(ctx->jit_start, ctx->jit_ptr - ctx->jit_start, PROT_READ | PROT_WRITE);
+        ctx->jit_ptr = ctx->jit_start;
+    }
+    ctx->jit_disabled = false;
+    ctx->parent = parent;
+    ctx->env = parent->env;
+    ctx->Sym_quote = parent->Sym_quote;
+    ctx->Sym_lambda = parent->Sym_lambda;
+    ctx->Sym_define = parent->Sym_define;
+    ctx->Sym_defun = parent->Sym_defun;
+    ctx->Sym_defmacro = parent->Sym_defmacro;
+    ctx->Sym_macroexpand = parent->Sym_macroexpand;
+    ctx->macro_epoch = parent->macro_epoch;
+    ctx->use_vm = parent->use_vm;
+    ctx->use_jit = parent->use_jit;
+    // 栈是按线程池创建时最深的要求分配的，嵌套深度仍然按父解释器的限制
+    ctx->max_depth = parent->max_depth;
+    ctx->prim_names = parent->prim_names;
+    ctx->nprims = parent->nprims;
+#ifdef MINILISP_STATS
+    if (ctx->prims_cap < parent->nprims) {
+        ctx->prims_cap = parent->nprims;
+        ctx->stat_prim_calls = realloc(ctx->stat_prim_calls, sizeof(uint64_t) * ctx->prims_cap);
+        memset(ctx->stat_prim_calls, 0, sizeof(uint64_t) * ctx->prims_cap);
+    }
+#endif
+    
+    Obj *results = Nil;
+    GC_FRAME;
+    GC_ROOT(results);
+    // i 在 setjmp 之后还要用
+    for (volatile int i; (i = next_task(self)) >= 0; ) {
+        // 比已经出错的任务靠后的就不用做了
+        if (i > __atomic_load_n(&job.error_index, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        Handler h;
+        push_handler(&h);
+        if (setjmp(h.jb)) {
+            pthread_mutex_lock(&job_lock);
+            if (i < job.error_index) {
+                __atomic_store_n(&job.error_index, i, __ATOMIC_RELAXED);
+                strcpy(job.error, ctx->error_message);
+            }
+            pthread_mutex_unlock(&job_lock);
+            continue;
+        }
+        Obj *value = run_task(i);
+        results = acon(make_int(i), value, results);
+        pop_handler(&h);
+    }
+    // 只留下结果，它们就是堆里从头开始连续的一段
+    gc();
+    out_flush(&ctx->out);
+    self->results = results;
+}
+
+static void *worker_main(void *arg) {
+    Worker *self = arg;
+    ctx = self->ctx;
+    ctx->stack_limit = current_stack_limit();
+    unsigned seen = 0;
+    pthread_mutex_lock(&job_lock);
+    for (; ; ) {
+        while (job_generation == seen) {
+            pthread_cond_wait(&job_start, &job_lock);
+        }
+        seen = job_generation;
+        if (!job.parent) {
+            break;                      // stop_workers 要结束这组线程
+        }
+        pthread_mutex_unlock(&job_lock);
+        run_tasks(self);
+        pthread_mutex_lock(&job_lock);
+        if (--job_running == 0) {
+            pthread_cond_signal(&job_done);
+        }
+    }
+    pthread_mutex_unlock(&job_lock);
+    return NULL;
+}
+
+// 创建工作线程，它们的堆和栈按 pool_heap_size 和 pool_max_depth 分配。线程
+// 创建失败时只用已经创建好的那些
+static void start_workers(void) {
+    int n = nthreads > 0 ? nthreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        n = 1;
+    }
+    workers = calloc(n, sizeof(Worker));
+    if (!workers) {
+        error("Out of memory for pmap workers");
+    }
+    Context *saved = ctx;
+    for (nworkers = 0; nworkers < n; nworkers++) {
+        Worker *w = &workers[nworkers];
+        w->ctx = calloc(1, sizeof(Context));
+        if (!w->ctx) {
+            break;
+        }
+        w->ctx->heap_size = pool_heap_size;
+        w->ctx->max_depth = pool_max_depth;
+        ctx = w->ctx;
+        init_heap(NULL);
+        out_open(&ctx->out, STDOUT_FILENO);
+        ctx = saved;
+        pthread_mutex_init(&w->lock, NULL);
+        if (!spawn_thread(&w->thread, w->ctx->max_depth, worker_main, w, &w->stack)) {
+            break;
+        }
+    }
+    ctx = saved;
+    if (nworkers == 0) {
+        error("Cannot start pmap workers");
+    }
+}
+
+// 结束所有工作线程，释放它们的上下文和栈。堆里没有别人引用的对象：上一组
+// 任务的结果已经取走了，标志都在父解释器的符号表里
+static void stop_workers(void) {
+    pthread_mutex_lock(&job_lock);
+    job.parent = NULL;
+    job_generation++;
+    pthread_cond_broadcast(&job_start);
+    pthread_mutex_unlock(&job_lock);
+    for (int k = 0; k < nworkers; k++) {
+        Worker *w = &workers[k];
+        pthread_join(w->thread, NULL);
+        munmap(w->stack.base, w->stack.size);
+        pthread_mutex_destroy(&w->lock);
+        w->ctx->prim_names = NULL;      // 是父解释器的
+        minilisp_free(w->ctx);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
+
+// 工作线程会用到的函数先在这里刷新、编译好，它们不能修改父解释器的函数
+static void prepare_function(Obj *fn) {
+    if (!fn || type_of(fn) != TFUNCTION) {
+        return;
+    }
+    if (ctx->use_vm) {
+        function_code(fn);
+    } else {
+        refresh_function(fn);
+    }
+}
+
+static void prepare_functions(Obj *fn) {
+    GC_FRAME;
+    GC_ROOT(fn);
+    prepare_function(fn);
+    for (size_t i = 0; i < ctx->nglobals; i++) {
+        prepare_function(ctx->globals[i]->value);
+    }
+}
+
+// 把工作线程 w 的堆里从 obj 可达的对象复制到当前的堆里。调用者要保证
+// 放得下，这里不会触发 GC
+static Obj *import_object(Context *w, Obj *obj) {
+    ctx->from_start = w->heap_start;
+    ctx->from_end = w->heap_limit;
+    char *start = ctx->heap_ptr;
+    obj = forward(obj);
+    gc_scan(start);
+    ctx->from_start = ctx->from_end = NULL;
+    // 机器码在工作线程自己的内存里，下一组任务开始时就清空了
+    for (char *p = start; p < ctx->heap_ptr; p += ((Obj *)p)->size) {
+        if (((Obj *)p)->type == TCODE) {
+            ((Obj *)p)->native = NULL;
+            ((Obj *)p)->calls = 0;
+        }
+    }
+    return obj;
+}
+
+// 在当前线程里依次执行，用于已经在工作线程里的情况（嵌套的 pmap）
+static Obj *run_sequential(Obj *env, Obj *fn, Obj *list) {
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(fn);
+    GC_ROOT(list);
+    Obj *head = Nil;
+    Obj *tail = Nil;
+    GC_ROOT(head);
+    GC_ROOT(tail);
+    for (; list != Nil; list = cdr_of(list)) {
+        Obj *value = fn ? apply_value(ctx->env, fn, list->car) : eval(env, list->car);
+        value = cons(value, Nil);
+        if (head == Nil) {
+            head = tail = value;
+        } else {
+            tail->cdr = value;
+            tail = value;
+        }
+    }
+    return head;
+}
+
+// pmap 和 pcall 的共同部分：fn 不为 NULL 时把它应用到 list 的每个元素上，
+// 否则在 env 里求值 list 里的每个表达式
+static Obj *run_parallel(Obj *env, Obj *fn, Obj *list) {
+    int n = list_length(list);
+    if (ctx->parent) {
+        return run_sequential(env, fn, list);
+    }
+    if (n == 0) {
+        return Nil;
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(fn);
+    GC_ROOT(list);
+    prepare_functions(fn);
+    // 工作线程的输出在任务结束时写出，之前的输出要先写出去才不会乱序
+    out_flush(&ctx->out);
+    
+    pthread_mutex_lock(&pool_lock);
+    // 线程池是所有解释器共用的。第一次使用时按当前解释器的选项创建，之后
+    // 遇到堆更大或者嵌套更深的解释器时按两者中大的重新创建
+    if (!workers || pool_heap_size < ctx->heap_size || pool_max_depth < ctx->max_depth) {
+        if (workers) {
+            stop_workers();
+        }
+        pool_heap_size = pool_heap_size > ctx->heap_size ? pool_heap_size : ctx->heap_size;
+        pool_max_depth = pool_max_depth > ctx->max_depth ? pool_max_depth : ctx->max_depth;
+        Handler h;
+        push_handler(&h);
+        if (setjmp(h.jb)) {
+            pthread_mutex_unlock(&pool_lock);
+            error("%s", ctx->error_message);
+        }
+        start_workers();
+        pop_handler(&h);
+    }
+    Obj **items = malloc(sizeof(Obj *) * n);
+    if (!items) {
+        pthread_mutex_unlock(&pool_lock);
+        error("Out of memory for pmap");
+    }
+    int i = 0;
+    for (Obj *p = list; p != Nil; p = cdr_of(p)) {
+        items[i++] = p->car;
+    }
+    
+    // 从这里到取回结果之前当前的堆不会变化，工作线程可以放心读取
+    pthread_mutex_lock(&job_lock);
+    job.parent = ctx;
+    job.fn = fn;
+    job.env = env;
+    job.items = items;
+    job.n = n;
+    job.error_index = n;
+    for (int k = 0; k < nworkers; k++) {
+        workers[k].lo = (int)((int64_t)n * k / nworkers);
+        workers[k].hi = (int)((int64_t)n * (k + 1) / nworkers);
+        workers[k].results = Nil;
+    }
+    job_running = nworkers;
+    job_generation++;
+    pthread_cond_broadcast(&job_start);
+    while (job_running > 0) {
+        pthread_cond_wait(&job_done, &job_lock);
+    }
+    pthread_mutex_unlock(&job_lock);
+    free(items);
+    if (job.error_index < n) {
+        pthread_mutex_unlock(&pool_lock);
+        error("%s", job.error);
+    }
+    
+    // 工作线程的堆里只剩下结果，先腾出足够的空间，再一次全部搬过来
+    size_t need = 0;
+    for (int k = 0; k < nworkers; k++) {
+        Context *w = workers[k].ctx;
+        need += (w->heap_ptr - w->heap_start) + (w->heap_limit - w->alloc_limit);
+    }
+    if ((size_t)(ctx->alloc_limit - ctx->heap_ptr) < need) {
+        gc();
+        if ((size_t)(ctx->alloc_limit - ctx->heap_ptr) < need) {
+            pthread_mutex_unlock(&pool_lock);
+            error("Memory exhausted");
+        }
+    }
+    Obj **cells = malloc(sizeof(Obj *) * n);
+    if (!cells) {
+        pthread_mutex_unlock(&pool_lock);
+        error("Out of memory for pmap");
+    }
+    for (int k = 0; k < nworkers; k++) {
+        Obj *results = import_object(workers[k].ctx, workers[k].results);
+        for (Obj *p = results; p != Nil; p = cdr_of(p)) {
+            cells[int_value(p->car->car)] = p;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    
+    // 结果列表的单元直接重新串起来，换掉里面的 (下标 . 值)，不用再分配
+    for (i = 0; i < n; i++) {
+        cells[i]->car = cdr_of(cells[i]->car);
+        cells[i]->cdr = i + 1 < n ? cells[i + 1] : Nil;
+    }
+    Obj *r = cells[0];
+    free(cells);
+    return r;
+}
+
+// (pmap fn list)
+static Obj *prim_pmap(Obj *env, Obj *list) {
+    if (list_length(list) != 2) {
+        error("Malformed pmap");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    Obj *fn = eval(env, list->car);
+    GC_ROOT(fn);
+    Obj *args = eval(env, cdr_of(list)->car);
+    if (type_of(fn) != TPRIMITIVE && type_of(fn) != TFUNCTION) {
+        error("pmap: the first argument must be a function");
+    }
+    if (!is_list(args)) {
+        error("pmap: the second argument must be a list");
+    }
+    return run_parallel(env, fn, args);
+}
+
+// (pcall expr ...)
+static Obj *prim_pcall(Obj *env, Obj *list) {
+    if (!is_list(list)) {
+        error("Malformed pcall");
+    }
+    // 工作线程里创建的函数可能引用 env，它们没法搬动父解释器的帧栈
+    GC_FRAME;
+    GC_ROOT(list);
+    env = heap_env(env);
+    return run_parallel(env, NULL, list);
+}
+
+static bool batch;              // --batch：不打印顶层表达式的值，用于运行脚本
+
+// 依次读取并求值当前输入中的所有顶层表达式，echo 为 true 时打印每个结果
+// （--batch 时不打印）。
+// echo 为 true 的是顶层输入（命令行上的文件或者标准输入），出错时报告错误，
+// 然后接着处理下一个表达式；load 的文件里出错会一直跳到调用它的地方。
+// 每个顶层表达式求值结束后就变成了垃圾，所以长时间运行内存也不会增长。
+// 返回最后一个表达式的值，没有表达式时返回 ()
+static Obj *eval_input(Obj *env, bool echo) {
+    GC_FRAME;
+    GC_ROOT(env);
+    Obj *expr = NULL;
+    Obj *value = Nil;
+    GC_ROOT(expr);
+    GC_ROOT(value);
+    for (; ; ) {
+        Handler h;
+        if (echo) {
+            push_handler(&h);
+            if (setjmp(h.jb)) {
+                out_flush(&ctx->out);
+                fprintf(stderr, "%s\n", ctx->error_report);
+                ctx->had_error = true;
+                // 在表达式读到一半时出错（不一定是语法错误，比如读很长的
+                // 列表时内存不够），剩下的部分不能当作新的表达式求值，要一直
+                // 丢到它结束为止。语法错误所在的这一行剩下的内容也已经没法
+                // 解释了
+                if (ctx->reader->depth > 0) {
+                    skip_form();
+                } else if (ctx->reader->err_col) {
+                    skip_line();
+                }
+                ctx->reader->depth = 0;
+                continue;
+            }
+        }
+        ctx->reader->err_col = 0;
+        expr = read_expr();
+        if (!expr) {
+            if (echo) {
+                pop_handler(&h);
+            }
+            return value;
+        }
+        if (expr == Cparen) {
+            error("Stray close parenthesis");
+        }
+        if (expr == Dot) {
+            error("Stray Dot");
+        }
+        value = eval(env, expr);
+        if (echo) {
+            if (!batch) {
+                print(value);
+                out_char(&ctx->out, '\n');
+            }
+            pop_handler(&h);
+        }
+    }
+}
+
+// 读取并求值一个源文件
+static void load_file(Obj *env, const char *path, bool echo) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error("Cannot open %s: %s", path, strerror(errno));
+    }
+    Reader r;
+    reader_open(&r, fd, true, path);
+    ctx->reader = &r;
+    eval_input(env, echo);
+    ctx->reader = r.prev;
+    reader_close(&r);
+}
+
+// (load "path")
+static Obj *prim_load(Obj *env, Obj *list) {
+    if (list_length(list) != 1)
+        error("Malformed load");
+    GC_FRAME;
+    GC_ROOT(env);
+    Obj *path = eval(env, list->car);
+    if (type_of(path) != TSTRING)
+        error("load: path must be a string");
+    // 文件里的定义都放到全局环境中
+    while (env->up) {
+        env = env->up;
+    }
+    // 字符串在 GC 堆里可能被移动，先复制一份文件名。复制到栈上，
+    // 文件里出错跳出去的时候不会漏掉释放
+    char name[path->len + 1];
+    memcpy(name, path->str, path->len + 1);
+    load_file(env, name, false);
+    return True;
+}
+
+#ifdef MINILISP_STATS
+// 统计报告里使用的类型名。整数和特殊常量是立即数，不会出现在分配统计里
+static const char *type_names[TMOVED] = {
+    [TCELL] = "cell", [TSYMBOL] = "symbol", [TPRIMITIVE] = "primitive",
+    [TFUNCTION] = "function", [TMACRO] = "macro", [TENV] = "env",
+    [TSTRING] = "string", [TVECTOR] = "vector", [TTABLE] = "hash-table", [TLVAR] = "lvar", [TLAMBDA] = "lambda",
+    [TCALL] = "call", [TPREF] = "pref", [TCODE] = "code",
+};
+
+#ifndef MINILISP_NO_MAIN
+// --stats：退出时打印解释器线程的统计。第一行是所有的计数，后面每行是一种
+// 类型或者一个原始函数，每项都写成 名字=值，方便脚本解析。虚拟机把 if、+
+// 这样的原始函数编译成了指令，它们不会被算作原始函数调用
+static void print_stats(void) {
+    if (!ctx) {
+        return;
+    }
+    out_flush(&ctx->out);
+    fprintf(stderr, "stats: allocs=%" PRIu64 " alloc_bytes=%" PRIu64 " gcs=%" PRIu64
+            " evals=%" PRIu64 " applies=%" PRIu64 " finds=%" PRIu64 " find_steps=%" PRIu64
+            " expansions=%" PRIu64 " stack_frames=%" PRIu64 " evacuations=%" PRIu64
+            " jit_functions=%" PRIu64 "\n",
+            ctx->stat_allocs, ctx->stat_alloc_bytes, ctx->stat_gcs, ctx->stat_evals, ctx->stat_applies,
+            ctx->stat_finds, ctx->stat_find_steps, ctx->stat_expansions, ctx->stat_stack_frames,
+            ctx->stat_evacuations, ctx->stat_jit_functions);
+    for (int i = 0; i < TMOVED; i++) {
+        if (ctx->stat_type_allocs[i]) {
+            fprintf(stderr, "stats-type: %s allocs=%" PRIu64 " bytes=%" PRIu64 "\n",
+                    type_names[i], ctx->stat_type_allocs[i], ctx->stat_type_bytes[i]);
+        }
+    }
+    for (int i = 0; i < ctx->nprims; i++) {
+        if (ctx->stat_prim_calls[i]) {
+            fprintf(stderr, "stats-primitive: %s calls=%" PRIu64 "\n", ctx->prim_names[i], ctx->stat_prim_calls[i]);
+        }
+    }
+}
+#endif
+
+// 在关联列表 list 前面加上 (name . value)
+static Obj *stat_entry(Obj *list, const char *name, uint64_t value) {
+    return acon(intern((char *)name), make_int((int64_t)value), list);
+}
+#endif
+
+// (stats) 返回统计的关联列表，其中 types 是 ((类型 个数 字节数) ...)，
+// primitives 是 ((原始函数 . 调用次数) ...)。没有用 MINILISP_STATS 构建时返回 ()
+static Obj *prim_stats(Obj *env, Obj *list) {
+    (void)env;
+    (void)list;
+#ifdef MINILISP_STATS
+    GC_FRAME;
+    Obj *r = Nil;
+    Obj *sub = Nil;
+    Obj *item = Nil;
+    GC_ROOT(r);
+    GC_ROOT(sub);
+    GC_ROOT(item);
+    for (int i = ctx->nprims - 1; i >= 0; i--) {
+        if (ctx->stat_prim_calls[i]) {
+            sub = stat_entry(sub, ctx->prim_names[i], ctx->stat_prim_calls[i]);
+        }
+    }
+    r = acon(intern("primitives"), sub, r);
+    sub = Nil;
+    for (int i = TMOVED - 1; i >= 0; i--) {
+        if (ctx->stat_type_allocs[i]) {
+            item = cons(make_int((int64_t)ctx->stat_type_bytes[i]), Nil);
+            item = cons(make_int((int64_t)ctx->stat_type_allocs[i]), item);
+            item = cons(intern((char *)type_names[i]), item);
+            sub = cons(item, sub);
+        }
+    }
+    r = acon(intern("types"), sub, r);
+    r = stat_entry(r, "jit-functions", ctx->stat_jit_functions);
+    r = stat_entry(r, "evacuations", ctx->stat_evacuations);
+    r = stat_entry(r, "stack-frames", ctx->stat_stack_frames);
+    r = stat_entry(r, "expansions", ctx->stat_expansions);
+    r = stat_entry(r, "find-steps", ctx->stat_find_steps);
+    r = stat_entry(r, "finds", ctx->stat_finds);
+    r = stat_entry(r, "applies", ctx->stat_applies);
+    r = stat_entry(r, "evals", ctx->stat_evals);
+    r = stat_entry(r, "gcs", ctx->stat_gcs);
+    r = stat_entry(r, "alloc-bytes", ctx->stat_alloc_bytes);
+    r = stat_entry(r, "allocs", ctx->stat_allocs);
+    return r;
+#else
+    return Nil;
+#endif
+}
+
+// (exit)
+static Obj *prim_exit(Obj *env, Obj *list) {
+    (void)env;
+    (void)list;
+    if (ctx->parent) {
+        error("Cannot exit from a pmap worker");
+    }
+#ifdef MINILISP_NO_MAIN
+    // 嵌入时不能结束宿主进程，只结束这次 minilisp_eval，见 caught_exit
+    ctx->exiting = true;
+    error("exit");
+#else
+    out_flush(&ctx->out);
+    exit(ctx->had_error ? 1 : 0);
+#endif
+}
+
+static void add_primitive(Obj *env, const char *name, Primitive *fn) {
+    GC_FRAME;
+    GC_ROOT(env);
+    Obj *sym = intern((char *)name);
+    Obj *prim = make_primitive(fn, name);
+    add_variable(env, sym, prim);
+}
+
+static void define_constants(Obj *env) {
+    GC_FRAME;
+    GC_ROOT(env);
+    Obj *sym = intern("t");
+    add_variable(env, sym, True);
+}
+
+static Obj *prim_save_image(Obj *env, Obj *list);
+static Obj *prim_load_native(Obj *env, Obj *list);
+
+// 所有的原始函数，下标就是它们的编号。映像里的原始函数对象只记录编号，
+// 装载时按这个表找回函数的地址；表改变之后，以前保存的映像会被拒绝装载
+static const struct {
+    const char *name;
+    Primitive *fn;
+} primitive_table[] = {
+    { "quote", prim_quote },
+    { "list", prim_list },
+    { "setq", prim_setq },
+    { "+", prim_plus },
+    { "-", prim_minus },
+    { "*", prim_mul },
+    { "/", prim_div },
+    { "mod", prim_mod },
+    { "define", prim_define },
+    { "defun", prim_defun },
+    { "defmacro", prim_defmacro },
+    { "macroexpand", prim_macroexpand },
+    { "lambda", prim_lambda },
+    { "if", prim_if },
+    { "=", prim_num_eq },
+    { "<", prim_lt },
+    { ">", prim_gt },
+    { "<=", prim_le },
+    { ">=", prim_ge },
+    { "println", prim_println },
+    { "load", prim_load },
+    { "catch", prim_catch },
+    { "error", prim_error },
+    { "pmap", prim_pmap },
+    { "pcall", prim_pcall },
+    { "exit", prim_exit },
+    { "stats", prim_stats },
+    { "save-image", prim_save_image },
+    { "load-native", prim_load_native },
+    { "vector", prim_vector },
+    { "make-vector", prim_make_vector },
+    { "vector-length", prim_vector_length },
+    { "vector-ref", prim_vector_ref },
+    { "vector-set!", prim_vector_set },
+    { "vector->list", prim_vector_to_list },
+    { "list->vector", prim_list_to_vector },
+    { "vector-fill!", prim_vector_fill },
+    { "vector-copy", prim_vector_copy },
+    { "vector-copy!", prim_vector_copy_to },
+    { "make-hash-table", prim_make_hash_table },
+    { "gethash", prim_gethash },
+    { "puthash", prim_puthash },
+    { "remhash", prim_remhash },
+    { "hash-count", prim_hash_count },
+    { "maphash", prim_maphash },
+};
+
+#define NPRIMITIVES ((int)(sizeof(primitive_table) / sizeof(primitive_table[0])))
+
+// 分析时需要认出的几个特殊格式
+static void intern_specials(void) {
+    ctx->Sym_quote = intern("quote");
+    ctx->Sym_lambda = intern("lambda");
+    ctx->Sym_define = intern("define");
+    ctx->Sym_defun = intern("defun");
+    ctx->Sym_defmacro = intern("defmacro");
+    ctx->Sym_macroexpand = intern("macroexpand");
+}
+
+static void define_primitives(Obj *env) {
+    GC_FRAME;
+    GC_ROOT(env);
+    for (int i = 0; i < NPRIMITIVES; i++) {
+        add_primitive(env, primitive_table[i].name, primitive_table[i].fn);
+    }
+    intern_specials();
+}
+
+/**
+ 映像
+ (save-image "file") 把全局变量能到达的所有对象和全部标志写进一个文件，
+ 用 --image file 启动时直接装载它，不用再读取、分析和求值库文件里的定义。
+ 文件由按页对齐的三部分组成：头部（包括原始函数对象的位置）、堆和标志。
+ 堆和标志按保存时选定的地址存放，装载时用 mmap 把它们映射回这两个地址：
+ 映射成功时不需要修改任何指针，页面在第一次访问时才从文件读入；地址已经
+ 被占用时再把所有指针整体平移一次。堆这一段映射在当前半区的开头，之后和
+ 普通对象一样由 GC 管理；标志一直映射到上下文销毁。
+ 原始函数对象只保存编号，装载时按 primitive_table 找回函数的地址。字节码
+ 不保存，虚拟机用到时重新编译。
+ */
+
+#define IMAGE_MAGIC "MLIMAGE"
+#define IMAGE_VERSION 4
+#define IMAGE_ALIGN 4096
+
+typedef struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fingerprint;       // 原始函数表和对象布局的哈希，不同的构建保存的映像不能装载
+    uint64_t heap_offset;       // 堆在文件里的位置、长度和保存时选定的地址
+    uint64_t heap_len;
+    uint64_t heap_base;
+    uint64_t heap_reserve;      // 堆里的紧凑单元要预留的空间，见 alloc_limit
+    uint64_t sym_offset;        // 标志
+    uint64_t sym_len;
+    uint64_t sym_base;
+    uint64_t env;               // 全局环境的地址
+    uint32_t macro_epoch;
+    uint32_t nprims;
+    uint64_t prims[];           // 每个原始函数对象相对于堆开头的偏移
+} ImageHeader;
+
+static size_t image_align(size_t n) {
+    return (n + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+static uint32_t image_fingerprint(void) {
+    uint32_t h = hash_name(IMAGE_MAGIC, strlen(IMAGE_MAGIC)) ^ (uint32_t)(sizeof(Obj) << 8 | TMOVED);
+    for (int i = 0; i < NPRIMITIVES; i++) {
+        h = (h ^ hash_name(primitive_table[i].name, strlen(primitive_table[i].name))) * 16777619u;
+    }
+    return h;
+}
+
+// 保存映像时的状态
+typedef struct ImageWriter {
+    char *heap;             // 当前半区的开头
+    size_t *offsets;        // 按字编号：要保存的对象在映像里的偏移加一，0 表示不保存
+    Obj **stack;            // 标记时还没有扫描的对象
+    size_t sp;
+    size_t cap;
+    bool failed;            // 内存不够
+    size_t *sym_offsets;    // 按符号表的槽编号：标志在映像里的偏移
+    uintptr_t heap_base;
+    uintptr_t sym_base;
+} ImageWriter;
+
+static bool image_in_heap(ImageWriter *w, Obj *obj) {
+    return obj && is_pointer(obj) && w->heap <= (char *)obj && (char *)obj < ctx->heap_ptr;
+}
+
+static size_t *image_offset(ImageWriter *w, Obj *obj) {
+    return &w->offsets[((char *)obj - w->heap) / sizeof(void *)];
+}
+
+// 标记从全局环境和全局变量可以到达的对象。字节码不保存
+static Obj *image_mark(void *data, Obj *obj) {
+    ImageWriter *w = data;
+    if (!image_in_heap(w, obj) || *image_offset(w, obj) || obj->type == TCODE) {
+        return obj;
+    }
+    if (w->sp == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 1024;
+        Obj **stack = realloc(w->stack, sizeof(Obj *) * w->cap);
+        if (!stack) {
+            w->failed = true;
+            return obj;
+        }
+        w->stack = stack;
+    }
+    *image_offset(w, obj) = 1;
+    w->stack[w->sp++] = obj;
+    return obj;
+}
+
+// 把引用换成对象在映像里的地址，对字节码的引用换成 NULL
+static Obj *image_translate(void *data, Obj *obj) {
+    ImageWriter *w = data;
+    if (!obj || !is_pointer(obj)) {
+        return obj;
+    }
+    if (image_in_heap(w, obj)) {
+        size_t off = *image_offset(w, obj);
+        return off ? (Obj *)(w->heap_base + off - 1) : NULL;
+    }
+    return (Obj *)(w->sym_base + w->sym_offsets[symtab_slot(obj)]);
+}
+
+static bool write_all(int fd, const void *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+// 把映像写到 path。先写到一个临时文件再改名，正在使用旧映像的进程不受影响。
+// 这里不分配 GC 堆上的内存。成功时返回 NULL，否则返回错误信息
+static const char *write_image(const char *path) {
+    ImageWriter w = { .heap = ctx->heap_start };
+    char tmp[strlen(path) + 5];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    const char *err = "Out of memory for image";
+    char *heap = NULL;
+    ImageHeader *hdr = NULL;
+    char *syms = NULL;
+    size_t words = (ctx->heap_ptr - ctx->heap_start) / sizeof(void *);
+    w.offsets = calloc(words + 1, sizeof(size_t));
+    w.sym_offsets = malloc(sizeof(size_t) * (ctx->symtab_cap + 1));
+    if (!w.offsets || !w.sym_offsets) {
+        goto out;
+    }
+    
+    // 标记，然后按地址顺序给要保存的对象分配新的位置
+    image_mark(&w, ctx->env);
+    for (size_t i = 0; i < ctx->nglobals; i++) {
+        image_mark(&w, ctx->globals[i]->value);
+    }
+    while (w.sp > 0 && !w.failed) {
+        Obj *obj = w.stack[--w.sp];
+        scan_object(obj, image_mark, &w);
+        if ((obj->type == TCELL || obj->type == TCALL) && is_compact(obj)) {
+            // 紧凑单元的 cdr 是紧跟着的单元，要一起保存才能保持相邻
+            image_mark(&w, cdr_of(obj));
+        }
+    }
+    if (w.failed) {
+        goto out;
+    }
+    size_t heap_len = 0;
+    size_t heap_reserve = 0;
+    uint32_t nprims = 0;
+    for (char *p = ctx->heap_start; p < ctx->heap_ptr; p += ((Obj *)p)->size) {
+        if (*image_offset(&w, (Obj *)p)) {
+            *image_offset(&w, (Obj *)p) = heap_len + 1;
+            heap_len += ((Obj *)p)->size;
+            nprims += ((Obj *)p)->type == TPRIMITIVE;
+            if ((((Obj *)p)->type == TCELL || ((Obj *)p)->type == TCALL) && is_compact((Obj *)p)) {
+                heap_reserve += CELL_SIZE - COMPACT_CELL_SIZE;
+            }
+            // 编译成 C 的库里的函数在别的进程里找不回来
+            if (((Obj *)p)->type == TPRIMITIVE && ((Obj *)p)->prim_id >= NPRIMITIVES) {
+                err = "functions loaded with load-native cannot be saved";
+                goto out;
+            }
+        }
+    }
+    
+    // 标志按符号表的顺序排列
+    size_t sym_len = 0;
+    for (size_t i = 0; i < ctx->symtab_cap; i++) {
+        if (ctx->symtab[i]) {
+            w.sym_offsets[i] = sym_len;
+            sym_len += ctx->symtab[i]->size;
+        }
+    }
+    syms = malloc(sym_len + 1);
+    if (!syms) {
+        goto out;
+    }
+    
+    // 保存时选定的地址就是当前半区，标志紧跟在整个半区后面，装载时用相同
+    // 的 --heap 就很可能可以原样映射
+    w.heap_base = (uintptr_t)ctx->heap_start;
+    w.sym_base = w.heap_base + image_align(ctx->heap_size);
+    for (size_t i = 0; i < ctx->symtab_cap; i++) {
+        if (ctx->symtab[i]) {
+            Obj *sym = (Obj *)(syms + w.sym_offsets[i]);
+            memcpy(sym, ctx->symtab[i], ctx->symtab[i]->size);
+            sym->value = image_translate(&w, sym->value);
+        }
+    }
+    size_t hdr_len = image_align(sizeof(ImageHeader) + sizeof(uint64_t) * nprims);
+    hdr = calloc(1, hdr_len);
+    heap = malloc(heap_len + 1);
+    if (!hdr || !heap) {
+        goto out;
+    }
+    memcpy(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic));
+    hdr->version = IMAGE_VERSION;
+    hdr->fingerprint = image_fingerprint();
+    hdr->heap_offset = hdr_len;
+    hdr->heap_len = heap_len;
+    hdr->heap_base = w.heap_base;
+    hdr->heap_reserve = heap_reserve;
+    hdr->sym_offset = hdr_len + image_align(heap_len);
+    hdr->sym_len = sym_len;
+    hdr->sym_base = w.sym_base;
+    hdr->env = (uintptr_t)image_translate(&w, ctx->env);
+    hdr->macro_epoch = ctx->macro_epoch;
+    for (char *p = ctx->heap_start; p < ctx->heap_ptr; p += ((Obj *)p)->size) {
+        size_t off = *image_offset(&w, (Obj *)p);
+        if (!off) {
+            continue;
+        }
+        Obj *copy = (Obj *)(heap + off - 1);
+        memcpy(copy, p, ((Obj *)p)->size);
+        scan_object(copy, image_translate, &w);
+        if (copy->type == TPRIMITIVE) {
+            copy->fn = NULL;
+            hdr->prims[hdr->nprims++] = off - 1;
+        }
+    }
+    
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        err = strerror(errno);
+        goto out;
+    }
+    bool ok = write_all(fd, hdr, hdr_len, 0)
+        && write_all(fd, heap, heap_len, hdr->heap_offset)
+        && write_all(fd, syms, sym_len, hdr->sym_offset);
+    err = ok ? NULL : strerror(errno);
+    if (close(fd) < 0 && ok) {
+        err = strerror(errno);
+    }
+    if (!err && rename(tmp, path) < 0) {
+        err = strerror(errno);
+    }
+    if (err) {
+        unlink(tmp);
+    }
+    
+out:
+    free(w.offsets);
+    free(w.stack);
+    free(w.sym_offsets);
+    free(syms);
+    free(heap);
+    free(hdr);
+    return err;
+}
+
+// (save-image "path")
+static Obj *prim_save_image(Obj *env, Obj *list) {
+    if (list_length(list) != 1)
+        error("Malformed save-image");
+    Obj *path = eval(env, list->car);
+    if (type_of(path) != TSTRING)
+        error("save-image: path must be a string");
+    if (ctx->parent)
+        error("save-image: cannot save from a pmap worker");
+    const char *err = write_image(path->str);
+    if (err)
+        error("Cannot save image %s: %s", path->str, err);
+    return True;
+}
+
+// 装载映像时保存的地址和实际地址之间的差
+typedef struct ImageLoader {
+    uintptr_t heap_base;
+    size_t heap_len;
+    intptr_t heap_delta;
+    uintptr_t sym_base;
+    size_t sym_len;
+    intptr_t sym_delta;
+} ImageLoader;
+
+static Obj *image_relocate(void *data, Obj *obj) {
+    ImageLoader *m = data;
+    if (!obj || !is_pointer(obj)) {
+        return obj;
+    }
+    if ((uintptr_t)obj - m->heap_base < m->heap_len) {
+        return (Obj *)((uintptr_t)obj + m->heap_delta);
+    }
+    if ((uintptr_t)obj - m->sym_base < m->sym_len) {
+        return (Obj *)((uintptr_t)obj + m->sym_delta);
+    }
+    error("Corrupt image");
+}
+
+static void close_fd(int *fd) {
+    if (*fd >= 0) {
+        close(*fd);
+    }
+}
+
+// 用映像 path 初始化当前上下文的堆、符号表和全局环境
+static void load_image(const char *path) {
+    int fd __attribute((cleanup(close_fd))) = open(path, O_RDONLY);
+    if (fd < 0) {
+        error("Cannot open %s: %s", path, strerror(errno));
+    }
+    ImageHeader h;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, IMAGE_MAGIC, sizeof(h.magic))
+        || h.version != IMAGE_VERSION) {
+        error("%s: Not a MiniLisp image", path);
+    }
+    if (h.fingerprint != image_fingerprint()) {
+        error("%s: Image was saved by a different build", path);
+    }
+    if (h.heap_len + h.heap_reserve > ctx->heap_size) {
+        error("%s: Image needs a heap of at least %" PRIu64 " bytes", path, h.heap_len + h.heap_reserve);
+    }
+    // 文件被截断时映射仍然成功，访问超出文件末尾的页才会收到 SIGBUS
+    struct stat st;
+    if (fstat(fd, &st) < 0 || h.nprims > NPRIMITIVES
+        || h.heap_offset > (uint64_t)st.st_size || h.heap_len > (uint64_t)st.st_size - h.heap_offset
+        || h.sym_offset > (uint64_t)st.st_size || h.sym_len > (uint64_t)st.st_size - h.sym_offset) {
+        error("%s: Corrupt image", path);
+    }
+    uint64_t prims[NPRIMITIVES];
+    if (pread(fd, prims, sizeof(uint64_t) * h.nprims, sizeof(h)) != (ssize_t)(sizeof(uint64_t) * h.nprims)) {
+        error("%s: Corrupt image", path);
+    }
+    
+    // 先映射标志，再在保存时的地址上申请半区，两者都尽量放在原来的地址上。
+    // 全局变量的值存放在标志里，所以标志也要可写
+    char *syms = mmap((void *)(uintptr_t)h.sym_base, h.sym_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, h.sym_offset);
+    if (syms == MAP_FAILED) {
+        error("%s: Cannot map image: %s", path, strerror(errno));
+    }
+    ctx->image_symbols = syms;
+    ctx->image_symbols_len = h.sym_len;
+    init_heap((void *)(uintptr_t)h.heap_base);
+    if (h.heap_len > 0 && mmap(ctx->heap_start, h.heap_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                               fd, h.heap_offset) == MAP_FAILED) {
+        error("%s: Cannot map image: %s", path, strerror(errno));
+    }
+    ctx->heap_ptr = ctx->heap_start + h.heap_len;
+    ctx->alloc_limit = ctx->heap_limit - h.heap_reserve;
+    
+    ImageLoader m = {
+        .heap_base = h.heap_base, .heap_len = h.heap_len, .heap_delta = (uintptr_t)ctx->heap_start - h.heap_base,
+        .sym_base = h.sym_base, .sym_len = h.sym_len, .sym_delta = (uintptr_t)syms - h.sym_base,
+    };
+    Obj *env = image_relocate(&m, (Obj *)(uintptr_t)h.env);
+    if (m.heap_delta || m.sym_delta) {
+        for (char *p = ctx->heap_start; p < ctx->heap_ptr; p += ((Obj *)p)->size) {
+            scan_object((Obj *)p, image_relocate, &m);
+        }
+    }
+    for (uint32_t i = 0; i < h.nprims; i++) {
+        Obj *prim = (Obj *)(ctx->heap_start + prims[i]);
+        if (prims[i] >= h.heap_len || prim->type != TPRIMITIVE || prim->prim_id >= NPRIMITIVES) {
+            error("%s: Corrupt image", path);
+        }
+        prim->fn = primitive_table[prim->prim_id].fn;
+    }
+    for (int i = 0; i < NPRIMITIVES; i++) {
+        register_primitive(primitive_table[i].name);
+    }
+    for (char *p = syms; p < syms + h.sym_len; p += ((Obj *)p)->size) {
+        Obj *sym = (Obj *)p;
+        symtab_add(sym);
+        if (sym->value != Unbound) {
+            Obj *value = m.heap_delta || m.sym_delta ? image_relocate(&m, sym->value) : sym->value;
+            sym->value = Unbound;
+            set_global(sym, value);
+        }
+    }
+    ctx->env = env;
+    ctx->macro_epoch = h.macro_epoch;
+    intern_specials();
+}
+
+
+
+
+
+
+
+
+
+
+/**
+ 嵌入接口
+ 其他程序可以用 -DMINILISP_NO_MAIN 编译这个文件（make lib），通过 minilisp.h
+ 里的几个函数创建和使用解释器。每个上下文有自己的堆和全局环境，互不影响，
+ 不同的线程可以同时使用不同的上下文。
+ */
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// 整个进程共享的表，在创建第一个上下文时初始化
+static void init_globals(void) {
+    always_gc = getenv("MINILISP_DEBUG_GC") != NULL;
+    vm_exec(0);
+    init_char_class();
+}
+
+// 检查创建上下文的选项，有问题时返回原因
+static const char *check_options(const MiniLispOptions *opts) {
+    if (opts->heap_size && opts->heap_size < 4096) {
+        return "Heap size too small";
+    }
+    if (opts->max_depth < 0) {
+        return "Invalid depth";
+    }
+#ifndef __x86_64__
+    if (opts->jit) {
+        return "--jit is only supported on x86-64";
+    }
+#endif
+    return NULL;
+}
+
+// 按 opts 创建一个上下文，opts->image 不为 NULL 时从映像装载。失败时把原因
+// 写到 err 里
+static Context *new_context(const MiniLispOptions *opts, char *err, size_t size) {
+    pthread_once(&init_once, init_globals);
+    const char *invalid = check_options(opts);
+    if (invalid) {
+        if (err && size) {
+            snprintf(err, size, "%s", invalid);
+        }
+        return NULL;
+    }
+    Context *c = calloc(1, sizeof(Context));
+    if (!c) {
+        if (err && size) {
+            snprintf(err, size, "Out of memory");
+        }
+        return NULL;
+    }
+    c->heap_size = opts->heap_size ? opts->heap_size : DEFAULT_HEAP_SIZE;
+    c->max_depth = opts->max_depth ? opts->max_depth : DEFAULT_MAX_DEPTH;
+    c->use_vm = opts->vm || opts->jit;
+    c->use_jit = opts->jit;
+    Context *saved = ctx;
+    ctx = c;
+    c->stack_limit = current_stack_limit();
+    out_open(&c->out, STDOUT_FILENO);
+    Handler h;
+    push_handler(&h);
+    if (setjmp(h.jb)) {
+        // 堆或者符号表申请不到内存，或者映像不能装载
+        if (err && size) {
+            snprintf(err, size, "%s", c->error_message);
+        }
+        ctx = saved;
+        minilisp_free(c);
+        return NULL;
+    }
+    if (opts->image) {
+        load_image(opts->image);
+    } else {
+        init_heap(NULL);
+        c->env = make_env(Nil, NULL);
+        define_constants(c->env);
+        define_primitives(c->env);
+    }
+    pop_handler(&h);
+    ctx = saved;
+    return c;
+}
+
+MiniLisp *minilisp_new(void) {
+    return minilisp_new_with(NULL, NULL, 0);
+}
+
+MiniLisp *minilisp_open_image(const char *path, char *err, size_t size) {
+    MiniLispOptions opts = { .image = path };
+    return new_context(&opts, err, size);
+}
+
+MiniLisp *minilisp_new_with(const MiniLispOptions *opts, char *err, size_t size) {
+    MiniLispOptions defaults = { 0 };
+    return new_context(opts ? opts : &defaults, err, size);
+}
+
+// 嵌入接口的函数跳回来时调用：是 (exit) 的话不算出错，把值 () 写到 out
+static bool caught_exit(Context *c, char *out, size_t size) {
+    if (!c->exiting) {
+        return false;
+    }
+    c->exiting = false;
+    Out o;
+    out_open_buffer(&o, out, out ? size : 0);
+    print_to(&o, Nil);
+    return true;
+}
+
+bool minilisp_eval(MiniLisp *c, const char *src, char *out, size_t size) {
+    Context *saved = ctx;
+    ctx = c;
+    c->stack_limit = current_stack_limit();
+    Reader r;
+    reader_open_string(&r, src, strlen(src), "<string>");
+    c->reader = &r;
+    bool ok = true;
+    Handler h;
+    push_handler(&h);
+    if (!setjmp(h.jb)) {
+        Obj *value = eval_input(c->env, false);
+        pop_handler(&h);
+        Out o;
+        out_open_buffer(&o, out, out ? size : 0);
+        print_to(&o, value);
+    } else if (!caught_exit(c, out, size)) {
+        ok = false;
+        if (out && size) {
+            snprintf(out, size, "%s", c->error_report);
+        }
+    }
+    c->reader = r.prev;
+    reader_close(&r);
+    out_flush(&c->out);
+    ctx = saved;
+    return ok;
+}
+
+void minilisp_free(MiniLisp *c) {
+    if (!c) {
+        return;
+    }
+    if (c->heap_start) {
+        munmap(c->heap_start, c->heap_size);
+    }
+    if (c->heap_other) {
+        munmap(c->heap_other, c->heap_size);
+    }
+    if (c->jit_start) {
+        munmap(c->jit_start, JIT_BUFFER_SIZE);
+    }
+    if (c->frames_start) {
+        munmap(c->frames_start, c->heap_size);
+    }
+    for (char *arena = c->symbol_arena; arena; ) {
+        char *prev = *(char **)arena;
+        free(arena);
+        arena = prev;
+    }
+    out_close(&c->out);
+    if (c->image_symbols) {
+        munmap(c->image_symbols, c->image_symbols_len);
+    }
+    free(c->roots);
+    free(c->symtab);
+    free(c->globals);
+    free(c->prim_names);
+    free(c->vm_stack);
+    free(c->vm_frames);
+    STAT(free(c->stat_prim_calls));
+    free(c);
+}
+
+/**
+ 增量解析
+ 读取器按需从文件描述符里取字节，读不到时就阻塞，嵌套的列表用递归读取。
+ 增量解析器反过来由调用者把收到的字节一块一块地交给它，块的边界可以落在
+ 任何地方，包括标志或者字符串的中间。读到一半的 token 和还没有结束的列表
+ 都保存在解析器里，没有结束的列表放在一个显式的栈上，不会因为嵌套太深而
+ 递归。每读完一个顶层表达式就放进队列，由调用者取出求值。这样一个线程可以
+ 同时解析很多路输入。语法和 read_expr 相同。
+ */
+
+// 解析器在 token 之间和 token 之中的状态
+enum {
+    P_SPACE,        // 不在 token 里
+    P_COMMENT,      // 注释，或者出错之后跳过这一行剩下的部分
+    P_SYMBOL,
+    P_NUMBER,
+    P_MINUS,        // 读到 '-'，要看下一个字符才知道是负数还是标志
+    P_HASH,         // 读到 '#'，可能是向量、第一行的 #! 或者标志
+    P_STRING,
+    P_ESCAPE,       // 字符串里的 '\\' 之后
+    // 表达式读到一半时出错，丢掉它剩下的部分，直到 depth 回到 0。其中的
+    // 字符串和注释里的括号不算
+    P_DISCARD,
+    P_DISCARD_STRING,
+    P_DISCARD_ESCAPE,
+    P_DISCARD_COMMENT,
+};
+
+// 栈上没有结束的表达式是一个整数 kind | dot << 2 | 元素个数 << 4，
+// 元素按顺序放在解析器的 items 里，栈顶的表达式的元素在最后
+enum {
+    PF_LIST,
+    PF_VECTOR,
+    PF_QUOTE,       // ' 之后，等待下一个表达式
+};
+
+// dot 为 0 时还没有读到点，为 1 时读到了点、等待尾部，为 2 时尾部已经
+// 放在元素的后面，它不算在元素个数里
+#define PF_INFO(kind, dot, n) make_int((kind) | (dot) << 2 | (int64_t)(n) << 4)
+#define PF_KIND(f) (int_value(f) & 3)
+#define PF_DOT(f) ((int_value(f) >> 2) & 3)
+#define PF_COUNT(f) (int_value(f) >> 4)
+
+typedef struct Parser {
+    Context *ctx;
+    Reader r;               // 只用来报告错误的位置
+    char *name;
+    int state;
+    Obj *stack;             // 没有结束的表达式，栈顶在前
+    Obj **items;            // 没有结束的列表的元素，GC 时作为根
+    size_t nitems;
+    size_t items_cap;
+    Obj *forms;             // 读完还没有取走的顶层表达式：(行号 . 表达式) 的列表
+    Obj *forms_tail;        // forms 的最后一个单元
+    char *tok;              // 读到一半的标志或者字符串
+    size_t tok_len;
+    size_t tok_cap;
+    int64_t number;         // 读到一半的整数
+    int sign;
+    int depth;              // 还没有结束的 '(' 的个数，出错之后丢弃输入时用
+    bool counted;           // 当前字符是已经计入 depth 的括号
+    int line;               // 当前行号，从 1 开始
+    int col;                // 当前行已经读过的字节数
+    int form_line;          // 当前顶层表达式开始的行号
+    struct Parser *next;    // 同一个上下文里的解析器，GC 时作为根
+} Parser;
+
+static void parser_gc_roots(void) {
+    for (Parser *p = ctx->parsers; p; p = p->next) {
+        p->stack = forward(p->stack);
+        for (size_t i = 0; i < p->nitems; i++) {
+            p->items[i] = forward(p->items[i]);
+        }
+        p->forms = forward(p->forms);
+        p->forms_tail = forward(p->forms_tail);
+    }
+}
+
+// 语法错误，报告当前读到的行和列，和 read_error 一样
+static void parser_error(Parser *p, char *fmt, ...) __attribute((noreturn));
+
+static void parser_error(Parser *p, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    p->r.form_line = p->line;
+    p->r.err_col = p->col + 1;
+    verror(fmt, ap);
+    va_end(ap);
+}
+
+static void parser_tok_add(Parser *p, int c) {
+    if (p->tok_len == p->tok_cap) {
+        p->tok_cap = p->tok_cap ? p->tok_cap * 2 : 64;
+        p->tok = realloc(p->tok, p->tok_cap);
+        if (!p->tok) {
+            error("Out of memory for parser");
+        }
+    }
+    p->tok[p->tok_len++] = (char)c;
+}
+
+static void parser_add_item(Parser *p, Obj *obj) {
+    if (p->nitems == p->items_cap) {
+        size_t cap = p->items_cap ? p->items_cap * 2 : 64;
+        Obj **items = realloc(p->items, sizeof(Obj *) * cap);
+        if (!items) {
+            error("Out of memory for parser");
+        }
+        p->items = items;
+        p->items_cap = cap;
+    }
+    p->items[p->nitems++] = obj;
+}
+
+// 读完了一个表达式：放进栈顶的列表，栈是空的时候它就是一个顶层表达式。
+// 栈顶是 ' 时把它包成 (quote obj)，再交给下面一层
+static void parser_value(Parser *p, Obj *obj) {
+    GC_FRAME;
+    GC_ROOT(obj);
+    while (p->stack != Nil && PF_KIND(p->stack->car) == PF_QUOTE) {
+        p->stack = cdr_of(p->stack);
+        obj = cons(obj, Nil);
+        obj = cons(ctx->Sym_quote, obj);
+    }
+    if (p->stack == Nil) {
+        Obj *cell = cons(make_int(p->form_line), obj);
+        cell = cons(cell, Nil);
+        if (p->forms == Nil) {
+            p->forms = cell;
+        } else {
+            p->forms_tail->cdr = cell;
+        }
+        p->forms_tail = cell;
+        return;
+    }
+    if (PF_DOT(p->stack->car) == 2) {
+        parser_error(p, "Closed parenthesis excepted after dot");
+    }
+    parser_add_item(p, obj);
+    Obj *f = p->stack->car;
+    p->stack->car = PF_DOT(f) ? PF_INFO(PF_LIST, 2, PF_COUNT(f)) : PF_INFO(PF_KIND(f), 0, PF_COUNT(f) + 1);
+}
+
+static void parser_push(Parser *p, int kind) {
+    p->stack = cons(PF_INFO(kind, 0, 0), p->stack);
+}
+
+// 读到 ')'：和 read_list 一样一次分配好连续的骨架，再按顺序填写元素
+static void parser_close(Parser *p) {
+    if (p->stack == Nil) {
+        // 顶层多出来的 ')'，和 eval_input 一样只报告行号
+        p->r.form_line = p->line;
+        error("Stray close parenthesis");
+    }
+    if (PF_KIND(p->stack->car) == PF_QUOTE) {
+        parser_error(p, "Stray close parenthesis");
+    }
+    Obj *f = p->stack->car;
+    if (PF_DOT(f) == 1) {
+        parser_error(p, "Closed parenthesis excepted after dot");
+    }
+    GC_FRAME;
+    Obj *tail = Nil;
+    GC_ROOT(tail);
+    if (PF_DOT(f) == 2) {
+        tail = p->items[--p->nitems];
+    }
+    int kind = PF_KIND(f);
+    int64_t n = PF_COUNT(f);
+    if (kind == PF_VECTOR ? VECTOR_MAX < n : INT_MAX < n) {
+        parser_error(p, "List too long");
+    }
+    Obj *list = make_list((int)n);
+    Obj **items = p->items + p->nitems - n;
+    p->nitems -= n;
+    Obj *last = Nil;
+    for (Obj *cell = list; cell != Nil; cell = cdr_of(cell)) {
+        cell->car = *items++;
+        last = cell;
+    }
+    p->stack = cdr_of(p->stack);
+    if (kind == PF_VECTOR) {
+        list = list_to_vector(list, "read");
+    } else if (tail != Nil) {
+        last->cdr = tail;
+    }
+    parser_value(p, list);
+}
+
+// 标志或者整数读完了
+static void parser_token(Parser *p) {
+    int state = p->state;
+    p->state = P_SPACE;
+    if (state == P_NUMBER) {
+        parser_value(p, make_int(p->sign > 0 ? p->number : -p->number));
+    } else {
+        parser_value(p, intern_len(p->tok, p->tok_len));
+    }
+}
+
+// 处理一个字符。结束 token 的字符回到 P_SPACE 状态再处理一次
+static void parser_char(Parser *p, int c) {
+    for (;;) {
+        switch (p->state) {
+            case P_COMMENT:
+                if ('\n' == c || '\r' == c) {
+                    p->state = P_SPACE;
+                }
+                return;
+            case P_STRING:
+                if ('"' == c) {
+                    p->state = P_SPACE;
+                    parser_value(p, make_string(p->tok, p->tok_len));
+                } else if ('\\' == c) {
+                    p->state = P_ESCAPE;
+                } else {
+                    parser_tok_add(p, c);
+                }
+                return;
+            case P_ESCAPE:
+                parser_tok_add(p, 'n' == c ? '\n' : 't' == c ? '\t' : c);
+                p->state = P_STRING;
+                return;
+            case P_DISCARD:
+                if ('(' == c) {
+                    p->depth++;
+                } else if (')' == c && 0 == --p->depth) {
+                    p->state = P_SPACE;
+                } else if ('"' == c) {
+                    p->state = P_DISCARD_STRING;
+                } else if (';' == c) {
+                    p->state = P_DISCARD_COMMENT;
+                }
+                return;
+            case P_DISCARD_STRING:
+                p->state = '"' == c ? P_DISCARD : '\\' == c ? P_DISCARD_ESCAPE : P_DISCARD_STRING;
+                return;
+            case P_DISCARD_ESCAPE:
+                p->state = P_DISCARD_STRING;
+                return;
+            case P_DISCARD_COMMENT:
+                if ('\n' == c || '\r' == c) {
+                    p->state = P_DISCARD;
+                }
+                return;
+            case P_SYMBOL:
+                if (char_class[c] & CH_SYMBOL) {
+                    if (SYMBOL_MAX_LEN == p->tok_len) {
+                        parser_error(p, "Symbol name too long");
+                    }
+                    parser_tok_add(p, c);
+                    return;
+                }
+                parser_token(p);
+                continue;
+            case P_NUMBER:
+                if (isdigit(c)) {
+                    // 负数的范围比正数多一个
+                    int64_t limit = p->sign > 0 ? FIXNUM_MAX : -FIXNUM_MIN;
+                    int d = c - '0';
+                    if (p->number > (limit - d) / 10) {
+                        parser_error(p, "Number too large");
+                    }
+                    p->number = p->number * 10 + d;
+                    return;
+                }
+                parser_token(p);
+                continue;
+            case P_MINUS:
+                if (isdigit(c)) {
+                    p->state = P_NUMBER;
+                    p->number = 0;
+                    p->sign = -1;
+                } else {
+                    p->state = P_SYMBOL;
+                    p->tok_len = 0;
+                    parser_tok_add(p, '-');
+                }
+                continue;
+            case P_HASH:
+                if ('(' == c) {
+                    p->state = P_SPACE;
+                    p->depth++;
+                    p->counted = true;
+                    parser_push(p, PF_VECTOR);
+                    return;
+                }
+                // 第一行的 #! 是给系统看的
+                if ('!' == c && 1 == p->line) {
+                    p->state = P_COMMENT;
+                    return;
+                }
+                p->state = P_SYMBOL;
+                p->tok_len = 0;
+                parser_tok_add(p, '#');
+                continue;
+        }
+        if (' ' == c || '\n' == c || '\r' == c || '\t' == c) {
+            return;
+        }
+        if (';' == c) {
+            p->state = P_COMMENT;
+            return;
+        }
+        if (p->stack == Nil) {
+            p->form_line = p->line;
+        }
+        if ('(' == c) {
+            p->depth++;
+            p->counted = true;
+            parser_push(p, PF_LIST);
+        } else if (')' == c) {
+            p->depth -= p->depth > 0;
+            p->counted = true;
+            parser_close(p);
+        } else if ('\'' == c) {
+            parser_push(p, PF_QUOTE);
+        } else if ('"' == c) {
+            p->state = P_STRING;
+            p->tok_len = 0;
+        } else if ('#' == c) {
+            p->state = P_HASH;
+        } else if ('.' == c) {
+            // 点只能出现在列表里至少一个元素之后
+            if (p->stack == Nil) {
+                p->r.form_line = p->line;
+                error("Stray Dot");
+            }
+            Obj *f = p->stack->car;
+            if (PF_KIND(f) == PF_VECTOR) {
+                parser_error(p, "Malformed vector");
+            }
+            if (PF_KIND(f) == PF_QUOTE || PF_DOT(f) || 0 == PF_COUNT(f)) {
+                parser_error(p, "Stray Dot");
+            }
+            p->stack->car = PF_INFO(PF_LIST, 1, PF_COUNT(f));
+        } else if (isdigit(c)) {
+            p->state = P_NUMBER;
+            p->number = c - '0';
+            p->sign = 1;
+        } else if ('-' == c) {
+            p->state = P_MINUS;
+        } else if (char_class[c] & CH_SYMBOL_START) {
+            p->state = P_SYMBOL;
+            p->tok_len = 0;
+            parser_tok_add(p, c);
+        } else {
+            parser_error(p, "Don't know how to handle %c", c);
+        }
+        return;
+    }
+}
+
+// 进入和离开解析器所在的上下文。出错时的位置按解析器的输入报告
+static Context *parser_enter(Parser *p) {
+    Context *saved = ctx;
+    ctx = p->ctx;
+    ctx->stack_limit = current_stack_limit();
+    p->r.prev = ctx->reader;
+    p->r.form_line = p->form_line;
+    p->r.err_col = 0;
+    ctx->reader = &p->r;
+    return saved;
+}
+
+static void parser_leave(Parser *p, Context *saved) {
+    ctx->reader = p->r.prev;
+    out_flush(&ctx->out);
+    ctx = saved;
+}
+
+MiniLispParser *minilisp_parser_new(MiniLisp *c, const char *name) {
+    Parser *p = calloc(1, sizeof(Parser));
+    if (!p || !(p->name = strdup(name ? name : "<parser>"))) {
+        free(p);
+        return NULL;
+    }
+    p->ctx = c;
+    p->r.fd = -1;
+    p->r.name = p->name;
+    p->state = P_SPACE;
+    p->stack = p->forms = p->forms_tail = Nil;
+    p->line = p->form_line = 1;
+    p->next = c->parsers;
+    c->parsers = p;
+    return p;
+}
+
+bool minilisp_parser_feed(MiniLispParser *p, const char *buf, size_t len, char *err, size_t size) {
+    Context *saved = parser_enter(p);
+    bool ok = true;
+    volatile size_t i = 0;
+    while (i < len) {
+        Handler h;
+        push_handler(&h);
+        if (setjmp(h.jb)) {
+            // 和 eval_input 一样：表达式读到一半时出错（不一定是语法错误，
+            // 比如内存不够），要把它剩下的部分整个丢掉，不能当作新的表达式；
+            // 语法错误所在的这一行剩下的内容也跳过
+            if (ok && err && size) {
+                snprintf(err, size, "%s", ctx->error_report);
+            }
+            ok = false;
+            int c = (unsigned char)buf[i];
+            bool open = p->depth > 0;
+            // 出错的字符是结束 token 的括号，出错时还没来得及处理它
+            if (!p->counted && P_SPACE == p->state) {
+                p->depth += '(' == c ? 1 : ')' == c && p->depth > 0 ? -1 : 0;
+            }
+            p->stack = Nil;
+            p->nitems = 0;
+            if (p->depth > 0) {
+                p->state = P_DISCARD;
+            } else if (p->r.err_col && !open && '\n' != c && '\r' != c) {
+                p->state = P_COMMENT;
+            } else {
+                p->state = P_SPACE;
+            }
+            p->r.err_col = 0;
+            p->col++;
+            if ('\n' == buf[i++]) {
+                p->line++;
+                p->col = 0;
+            }
+            continue;
+        }
+        for (; i < len; i++) {
+            int c = (unsigned char)buf[i];
+            p->counted = false;
+            parser_char(p, c);
+            p->col++;
+            if ('\n' == c) {
+                p->line++;
+                p->col = 0;
+            }
+        }
+        pop_handler(&h);
+    }
+    parser_leave(p, saved);
+    return ok;
+}
+
+bool minilisp_parser_finish(MiniLispParser *p, char *err, size_t size) {
+    Context *saved = parser_enter(p);
+    bool ok = true;
+    Handler h;
+    push_handler(&h);
+    if (!setjmp(h.jb)) {
+        if (P_STRING == p->state || P_ESCAPE == p->state) {
+            parser_error(p, "Unclosed string");
+        }
+        // 最后一个 token 后面没有别的字符了
+        if (P_SYMBOL == p->state || P_NUMBER == p->state || P_MINUS == p->state || P_HASH == p->state) {
+            parser_char(p, ' ');
+        }
+        if (p->stack != Nil || p->depth > 0) {
+            parser_error(p, "Unclosed parenthesis");
+        }
+        pop_handler(&h);
+    } else {
+        ok = false;
+        if (err && size) {
+            snprintf(err, size, "%s", ctx->error_report);
+        }
+    }
+    p->stack = Nil;
+    p->nitems = 0;
+    p->state = P_SPACE;
+    p->depth = 0;
+    parser_leave(p, saved);
+    return ok;
+}
+
+int minilisp_parser_eval(MiniLispParser *p, char *out, size_t size) {
+    if (p->forms == Nil) {
+        return 0;
+    }
+    Context *saved = parser_enter(p);
+    // GC_FRAME 离开时才恢复，那时 ctx 已经换回去了，所以这里自己恢复
+    size_t nroots = ctx->nroots;
+    Obj *form = cdr_of(p->forms->car);
+    gc_push_root(&form);
+    p->r.form_line = (int)int_value(p->forms->car->car);
+    p->forms = cdr_of(p->forms);
+    if (p->forms == Nil) {
+        p->forms_tail = Nil;
+    }
+    int r = 1;
+    Handler h;
+    push_handler(&h);
+    if (!setjmp(h.jb)) {
+        Obj *value = eval(ctx->env, form);
+        pop_handler(&h);
+        Out o;
+        out_open_buffer(&o, out, out ? size : 0);
+        print_to(&o, value);
+    } else if (!caught_exit(ctx, out, size)) {
+        r = -1;
+        if (out && size) {
+            snprintf(out, size, "%s", ctx->error_report);
+        }
+    }
+    ctx->nroots = nroots;
+    parser_leave(p, saved);
+    return r;
+}
+
+void minilisp_parser_free(MiniLispParser *p) {
+    if (!p) {
+        return;
+    }
+    Parser **q = &p->ctx->parsers;
+    while (*q != p) {
+        q = &(*q)->next;
+    }
+    *q = p->next;
+    free(p->tok);
+    free(p->items);
+    free(p->name);
+    free(p);
+}
+
+/**
+ 编译成 C 的库
+ minilisp --compile-to-c 生成的 C 代码只通过 native_runtime 里的函数使用解释器，
+ 接口见 minilisp.h。库里的每个函数是一个原始函数，编号排在 primitive_table
+ 之后，所以装载了库之后不能再保存映像。
+ */
+
+_Static_assert(((TNIL << 3) | TAG_SPECIAL) == 10 && ((TTRUE << 3) | TAG_SPECIAL) == 34 && TAG_FIXNUM == 1,
+               "minilisp.h: MINILISP_NIL, MINILISP_T and MINILISP_INT do not match");
+_Static_assert(OP_GE - OP_ADD == MINILISP_GE && OP_MOD - OP_ADD == MINILISP_MOD,
+               "minilisp.h: arithmetic operations do not match");
+
+static Context *native_current(void) {
+    return ctx;
+}
+
+static Obj *native_intern(const char *name) {
+    return intern((char *)name);
+}
+
+// 常量保存在名字里带空格的全局变量里，读取器读不出这样的标志，
+// Lisp 代码碰不到它们
+static Obj *native_constant(const char *src) {
+    static unsigned long counter;
+    Reader r;
+    reader_open_string(&r, src, strlen(src), "<native>");
+    ctx->reader = &r;
+    Obj *value = read_expr();
+    ctx->reader = r.prev;
+    reader_close(&r);
+    if (!value || value == Cparen || value == Dot) {
+        error("Malformed constant: %s", src);
+    }
+    GC_FRAME;
+    GC_ROOT(value);
+    char name[48];
+    snprintf(name, sizeof(name), " native-constant-%lu", __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+    Obj *sym = intern(name);
+    add_variable(ctx->env, sym, value);
+    return sym;
+}
+
+static Obj *native_global(Obj *sym) {
+    if (sym->value == Unbound) {
+        error("Undefined symbol: %s", sym->name);
+    }
+    return sym->value;
+}
+
+static void native_setq(Obj *sym, Obj *value) {
+    if (sym->value == Unbound) {
+        error("Unbound variable %s", sym->name);
+    }
+    check_store(&sym->value);
+    note_overwrite(sym->value, value);
+    sym->value = value;
+}
+
+// 拼成 (fn (quote arg) ...) 交给 eval，和 maphash 一样
+static Obj *native_call(Obj *fn, int n, Obj **args) {
+    if (type_of(fn) == TMACRO) {
+        error("Cannot call a macro from compiled code");
+    }
+    GC_FRAME;
+    GC_ROOT(fn);
+    for (int i = 0; i < n; i++) {
+        gc_push_root(&args[i]);
+    }
+    Obj *form = Nil;
+    GC_ROOT(form);
+    for (int i = n - 1; i >= 0; i--) {
+        Obj *arg = cons(args[i], Nil);
+        arg = cons(ctx->Sym_quote, arg);
+        form = cons(arg, form);
+    }
+    form = cons(fn, form);
+    return eval(ctx->env, form);
+}
+
+static Obj *native_arith(int op, Obj *x, Obj *y) {
+    return int_op(OP_ADD + op, x, y);
+}
+
+static void native_args(Obj *env, Obj *list, int n, Obj **out) {
+    if (list_length(list) != n) {
+        error("Cannot apply function: number of argument doesn't match");
+    }
+    GC_FRAME;
+    GC_ROOT(env);
+    GC_ROOT(list);
+    for (int i = 0; i < n; i++) {
+        out[i] = Nil;
+        gc_push_root(&out[i]);
+    }
+    for (int i = 0; i < n; i++, list = cdr_of(list)) {
+        out[i] = eval(env, list->car);
+    }
+}
+
+static size_t native_enter(Obj **vars, int n) {
+    enter_eval();
+    size_t saved = ctx->nroots;
+    for (int i = 0; i < n; i++) {
+        gc_push_root(&vars[i]);
+    }
+    return saved;
+}
+
+static void native_leave(size_t saved) {
+    ctx->nroots = saved;
+    ctx->eval_depth--;
+}
+
+static void native_defun(const char *name, MiniLispPrimitive *fn) {
+    Obj *sym = intern((char *)name);
+    add_primitive(ctx->env, sym->name, fn);
+}
+
+static int native_is_primitive(Obj *sym, MiniLispPrimitive *fn) {
+    return type_of(sym->value) == TPRIMITIVE && sym->value->fn == fn;
+}
+
+static void native_eval(const char *file, int line, const char *src) {
+    Reader r;
+    reader_open_string(&r, src, strlen(src), file);
+    r.line = r.form_line = line;
+    ctx->reader = &r;
+    eval_input(ctx->env, false);
+    ctx->reader = r.prev;
+    reader_close(&r);
+}
+
+static void native_error(const char *msg) __attribute((noreturn));
+
+static void native_error(const char *msg) {
+    error("%s", msg);
+}
+
+static const MiniLispRuntime native_runtime = {
+    .version = MINILISP_NATIVE_VERSION,
+    .current = native_current,
+    .intern = native_intern,
+    .constant = native_constant,
+    .global = native_global,
+    .setq = native_setq,
+    .call = native_call,
+    .arith = native_arith,
+    .args = native_args,
+    .enter = native_enter,
+    .leave = native_leave,
+    .defun = native_defun,
+    .is_primitive = native_is_primitive,
+    .eval = native_eval,
+    .error = native_error,
+};
+
+// (load-native "path")：装载编译成动态库的 C 文件
+static Obj *prim_load_native(Obj *env, Obj *list) {
+    if (list_length(list) != 1)
+        error("Malformed load-native");
+    Obj *path = eval(env, list->car);
+    if (type_of(path) != TSTRING)
+        error("load-native: path must be a string");
+    if (ctx->parent)
+        error("load-native: cannot load from a pmap worker");
+    // 和 load 一样，不带目录的名字是相对于当前目录的，而不是在系统的库目录里找
+    char name[path->len + 3];
+    snprintf(name, sizeof(name), "%s%s", strchr(path->str, '/') ? "" : "./", path->str);
+    void *lib = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+        error("Cannot load %s", dlerror());
+    MiniLispNativeInit *init = (MiniLispNativeInit *)dlsym(lib, "minilisp_native_init");
+    if (!init)
+        error("%s: Not a MiniLisp native library", name);
+    init(&native_runtime);
+    return True;
+}
+
+bool minilisp_load_native(MiniLisp *c, MiniLispNativeInit *init, char *out, size_t size) {
+    Context *saved = ctx;
+    ctx = c;
+    c->stack_limit = current_stack_limit();
+    bool ok = true;
+    Handler h;
+    push_handler(&h);
+    if (!setjmp(h.jb)) {
+        init(&native_runtime);
+        pop_handler(&h);
+        Out o;
+        out_open_buffer(&o, out, out ? size : 0);
+        print_to(&o, True);
+    } else if (!caught_exit(c, out, size)) {
+        ok = false;
+        if (out && size) {
+            snprintf(out, size, "%s", c->error_report);
+        }
+    }
+    out_flush(&c->out);
+    ctx = saved;
+    return ok;
+}
+
+#ifndef MINILISP_NO_MAIN
+
+/**
+ 编译成 C
+ minilisp --compile-to-c in.lisp out.c 把一个源文件编译成 C，生成的文件的用法
+ 见 minilisp.h。顶层表达式按顺序处理：函数体只用到下面这些格式的 defun 编译成
+ C 函数，其他的 defun 和顶层表达式按源代码嵌进生成的文件，装载时按原来的顺序
+ 求值，所以装载的效果和 load 这个文件相同。
+    整数、字符串、向量和 quote 的常量，参数和全局变量的读取、setq 和 if
+    宏：编译时展开，只认得文件里前面定义的宏和命令行上先装载的文件里的宏
+    + - * / mod = < > <= >=：加减和比较的参数都是 fixnum 时直接在 C 里计算
+    调用这个文件里编译成 C 的函数是直接的 C 函数调用，尾部调用自己变成循环，
+    其他的函数调用通过 rt->call 交给解释器
+ 函数体用到 lambda、define、catch 这样的格式时这个 defun 不编译，在标准错误上
+ 给出提示。为了展开宏，编译时会求值文件里的 defun 和 defmacro。
+ 生成的 C 函数把参数和中间结果都放在数组 v 里，整个数组登记为 GC 的根。
+ */
+
+#define CC_CONSTANT_MAX (64 * 1024)
+#define CC_WHY_SIZE 128
+
+typedef char COperand[64];
+
+// 编译一个文件的状态
+typedef struct CModule {
+    const char *path;       // 源文件
+    Reader *reader;
+    Obj *items;             // 顶层表达式，编译的 defun 是 (名字 参数 被 setq 的参数 . 展开的函数体)，
+                            // 其他的是源代码的 (开始位置 结束位置 行号)
+    Obj *defuns;            // 文件里所有 defun 的名字，包括没有编译的
+    Obj *macros;            // 当前位置和后面的 defmacro 定义的宏的名字，按文件里的顺序
+    Obj *funcs;             // 可以直接调用的函数：(名字 序号 参数个数) 的列表
+    Obj *syms;              // C 代码里的 syms[i]，倒序
+    int nsyms;
+    Obj *consts;            // C 代码里的 consts[i]，倒序
+    int nconsts;
+    char why[CC_WHY_SIZE];  // 不能编译的原因
+} CModule;
+
+// 编译一个函数的状态
+typedef struct CFunc {
+    CModule *m;
+    FILE *out;              // 函数体的代码
+    Obj *name;
+    Obj *params;            // 参数 i 是 v[i]
+    Obj *assigned;          // 被 setq 修改过的参数，读取时要先复制一份
+    int index;              // 生成的 C 函数是 f<index>
+    int nparams;
+    int nvars;              // v 的大小：参数后面是临时变量
+    int indent;
+    bool loops;             // 尾部调用了自己，函数开头需要标签 top
+} CFunc;
+
+static char cc_buf[CC_CONSTANT_MAX];
+
+// 原地反转列表
+static Obj *cc_reverse(Obj *list) {
+    Obj *r = Nil;
+    while (list != Nil) {
+        Obj *next = cdr_of(list);
+        list->cdr = r;
+        r = list;
+        list = next;
+    }
+    return r;
+}
+
+static bool cc_proper(Obj *list) {
+    for (; type_of(list) == TCELL; list = cdr_of(list))
+        ;
+    return list == Nil;
+}
+
+// sym 在列表里的位置，不在时返回 -1
+static int cc_position(Obj *sym, Obj *list) {
+    for (int i = 0; list != Nil; list = cdr_of(list), i++) {
+        if (list->car == sym) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 编译时 sym 的全局值是原始函数时返回它的 C 函数。参数会遮住全局变量
+static Primitive *cc_primitive(Obj *sym, Obj *params) {
+    if (type_of(sym) != TSYMBOL || cc_position(sym, params) >= 0 || type_of(sym->value) != TPRIMITIVE) {
+        return NULL;
+    }
+    return sym->value->fn;
+}
+
+// 常量要打印成源代码，装载时再读回来，所以只能由读取器读得出来的对象组成
+static bool cc_readable(Obj *obj) {
+    for (;;) {
+        switch (type_of(obj)) {
+            case TINT:
+            case TSYMBOL:
+                return true;
+            case TSTRING:
+                return !memchr(obj->str, '\0', obj->len);
+            case TVECTOR:
+                for (int i = 0; i < obj->nelems; i++) {
+                    if (!cc_readable(obj->elems[i])) {
+                        return false;
+                    }
+                }
+                return true;
+            case TCELL:
+                if (!cc_readable(obj->car)) {
+                    return false;
+                }
+                obj = cdr_of(obj);
+                continue;
+            default:
+                return obj == Nil;
+        }
+    }
+}
+
+// 把常量打印到 cc_buf，太长时返回 false
+static bool cc_print(Obj *obj) {
+    Out o;
+    out_open_buffer(&o, cc_buf, sizeof(cc_buf));
+    print_to(&o, obj);
+    return !o.full && o.len < sizeof(cc_buf) - 1;
+}
+
+static Obj *cc_fail(CModule *m, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(m->why, sizeof(m->why), fmt, ap);
+    va_end(ap);
+    return NULL;
+}
+
+/**
+ 第一遍：检查和展开
+ 读到一个 defun 时检查它的函数体能不能编译，同时展开其中的宏。结果是一份新的
+ 表达式，不和源代码共用列表：编译时求值 defun 会就地修改源代码的列表。
+ */
+
+// 检查表达式 expr，返回展开了宏的副本，不能编译时返回 NULL，原因写在 m->why。
+// 参数被 setq 修改时加到 *assigned 里
+static Obj *cc_expand(CModule *m, Obj *params, Obj **assigned, Obj *expr) {
+    int type = type_of(expr);
+    if (type == TSTRING || type == TVECTOR) {
+        if (!cc_readable(expr) || !cc_print(expr)) {
+            return cc_fail(m, "unsupported constant");
+        }
+        return expr;
+    }
+    if (type != TCELL) {
+        if (type != TINT && type != TSYMBOL && expr != Nil && expr != True) {
+            return cc_fail(m, "unsupported constant");
+        }
+        return expr;
+    }
+    if (!cc_proper(expr)) {
+        return cc_fail(m, "malformed expression");
+    }
+    GC_FRAME;
+    GC_ROOT(params);
+    GC_ROOT(expr);
+    int nargs = list_length(cdr_of(expr));
+    Primitive *fn = cc_primitive(expr->car, params);
+    if (fn == prim_quote) {
+        Obj *datum = nargs == 1 ? cdr_of(expr)->car : NULL;
+        if (!datum || !cc_readable(datum) || !cc_print(datum)) {
+            return cc_fail(m, "unsupported quote");
+        }
+        return expr;
     }
-    if (fn->type == TPRIMITIVE) {
-        return fn->fn(env, args);
+    if (fn == prim_if && nargs < 2) {
+        return cc_fail(m, "malformed if");
     }
-    if (fn->type == TFUNCTION) {
-        Obj *body = fn->body;
-        Obj *params = fn->params;
-        Obj *eargs = eval_list(env, args);
-        Obj *newenv = push_env(fn->env, params, eargs);
-        return progn(newenv, body);
+    if (fn == prim_setq) {
+        if (nargs != 2 || type_of(cdr_of(expr)->car) != TSYMBOL) {
+            return cc_fail(m, "malformed setq");
+        }
+        Obj *var = cdr_of(expr)->car;
+        if (cc_position(var, params) >= 0 && cc_position(var, *assigned) < 0) {
+            *assigned = cons(var, *assigned);
+        }
     }
-    error("not supported");
-}
-
-// 通过符号找到变量，如果未找到就返回 NULL
-static Obj *find(Obj *env, Obj *sym) {
-    for (Obj *p = env; p; p = p->up) {
-        for (Obj *cell = p->vars; cell != Nil; cell = cell->cdr) {
-            Obj *bind = cell->car;
-            if (sym == bind->car) {
-                return bind;
-            }
+    if (fn == prim_lambda || fn == prim_define || fn == prim_defun || fn == prim_defmacro
+        || fn == prim_macroexpand || fn == prim_catch || fn == prim_pmap || fn == prim_pcall) {
+        return cc_fail(m, "%s is not supported", expr->car->name);
+    }
+    // 装载之后才定义或者重新定义的宏，解释器在那之后调用函数时会按新的定义
+    // 展开，编译时没法照办
+    if (type_of(expr->car) == TSYMBOL && cc_position(expr->car, params) < 0
+        && cc_position(expr->car, m->macros) >= 0) {
+        return cc_fail(m, "macro %s is defined later", expr->car->name);
+    }
+    if (type_of(expr->car) == TSYMBOL && cc_position(expr->car, params) < 0
+        && type_of(expr->car->value) == TMACRO) {
+        Obj *expansion = expand_macro(ctx->env, expr->car->value, cdr_of(expr));
+        return cc_expand(m, params, assigned, expansion);
+    }
+    // 函数调用、if 和 setq 逐个展开子表达式，setq 的第一个参数是标志，不受影响
+    Obj *r = Nil;
+    GC_ROOT(r);
+    for (; expr != Nil; expr = cdr_of(expr)) {
+        Obj *x = cc_expand(m, params, assigned, expr->car);
+        if (!x) {
+            return NULL;
         }
+        r = cons(x, r);
     }
-    return NULL;
+    return cc_reverse(r);
 }
 
-// 拓展给定的巨集应用格式
-static Obj *macroexpand(Obj *env, Obj *obj) {
-    if (obj->type != TCELL || obj->car->type != TSYMBOL) {
-        return obj;
+// 检查 (defun name (params) body...)，可以编译时返回 (name params assigned . body)
+static Obj *cc_defun(CModule *m, Obj *expr) {
+    if (list_length(expr) < 3 || type_of(cdr_of(expr)->car) != TSYMBOL || !cc_proper(cdr_of(cdr_of(expr))->car)) {
+        return cc_fail(m, "malformed defun");
     }
-    Obj *bind = find(env, obj->car);
-    if (!bind || bind->cdr->type != TMACRO) {
-        return obj;
+    GC_FRAME;
+    Obj *name = cdr_of(expr)->car;
+    Obj *params = cdr_of(cdr_of(expr))->car;
+    Obj *body = cdr_of(cdr_of(cdr_of(expr)));
+    Obj *assigned = Nil;
+    Obj *r = Nil;
+    GC_ROOT(params);
+    GC_ROOT(body);
+    GC_ROOT(assigned);
+    GC_ROOT(r);
+    for (Obj *p = params; p != Nil; p = cdr_of(p)) {
+        if (type_of(p->car) != TSYMBOL || cc_position(p->car, cdr_of(p)) >= 0) {
+            return cc_fail(m, "malformed parameter list");
+        }
+    }
+    for (; body != Nil; body = cdr_of(body)) {
+        Obj *x = cc_expand(m, params, &assigned, body->car);
+        if (!x) {
+            return NULL;
+        }
+        r = cons(x, r);
     }
-    Obj *args = obj->cdr;
-    Obj *body = bind->cdr->body;
-    Obj *params = bind->cdr->params;
-    Obj *newenv = push_env(env, params, args);
-    return progn(newenv, body);
+    r = cc_reverse(r);
+    r = cons(assigned, r);
+    r = cons(params, r);
+    return cons(name, r);
 }
 
-// 求取 S 表达式的值
-static Obj *eval(Obj *env, Obj *obj) {
-    switch (obj->type) {
-        case TINT:
-        case TPRIMITIVE:
-        case TFUNCTION:
-        case TSPECIAL:
-            return obj;
-        case TSYMBOL: {
-            Obj *bind = find(env, obj);
-            if (!bind) {
-                error("Undefined symbol: %s", obj->name);
-            }
-            return bind->cdr;
+static bool cc_is_defmacro(Obj *expr) {
+    return type_of(expr) == TCELL && expr->car == ctx->Sym_defmacro && type_of(cdr_of(expr)) == TCELL;
+}
+
+// 处理一个顶层表达式，加到 m->items 里。它的源代码是 m->reader 里从 start 到 end
+// 的部分，从第 line 行开始，表达式本身在第 form_line 行
+static void cc_toplevel(CModule *m, Obj *expr, size_t start, size_t end, int line, int form_line) {
+    GC_FRAME;
+    GC_ROOT(expr);
+    Obj *item = NULL;
+    GC_ROOT(item);
+    if (type_of(expr) == TCELL && expr->car == ctx->Sym_defun) {
+        Obj *name = type_of(cdr_of(expr)) == TCELL ? cdr_of(expr)->car : Nil;
+        item = cc_defun(m, expr);
+        if (item && cc_position(name, m->defuns) >= 0) {
+            item = cc_fail(m, "defined more than once");
         }
-        case TCELL: {
-            // 函数应用格式
-            Obj *expanded = macroexpand(env, obj);
-            if (expanded != obj) {
-                return eval(env, expanded);
-            }
-            Obj *fn = eval(env, obj->car);
-            Obj *args = obj->cdr;
-            if (fn->type != TPRIMITIVE && fn->type != TFUNCTION) {
-                error("The head of a list must be a function");
-            }
-            return apply(env, fn, args);
+        if (!item) {
+            fprintf(stderr, "%s:%d: %s is not compiled to C: %s\n", m->path, form_line,
+                    type_of(name) == TSYMBOL ? name->name : "defun", m->why);
         }
-        default:
-            error("Bug: eval: Unknown tag type %d", obj->type);
-            break;
+        m->defuns = cons(name, m->defuns);
+    }
+    if (!item) {
+        // 连续的几段源代码合成一段
+        Obj *prev = m->items != Nil ? m->items->car : Nil;
+        if (prev != Nil && type_of(prev->car) == TINT && (size_t)int_value(cdr_of(prev)->car) == start) {
+            cdr_of(prev)->car = make_int(end);
+            return;
+        }
+        item = cons(make_int(line), Nil);
+        item = cons(make_int(end), item);
+        item = cons(make_int(start), item);
     }
+    m->items = cons(item, m->items);
 }
 
 /**
- 函数和一些其他特殊的格式。
- 
- @author Charry Lee
- @date 2022-01-14
+ 第二遍：生成 C 代码
+ 表达式的值是一个 C 表达式（COperand），只可能是常量、syms[i] 或者 v[i]。
+ 需要计算的子表达式按求值顺序写成语句，结果放在新的临时变量里。
  */
 
-// ‘expr
-static Obj *prim_quote(Obj *env, Obj *list) {
-    if (list_length(list) != 1) {
-        error("Malformed quote");
-    }
-    return list->car;
+static void cc_line(CFunc *f, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(f->out, "%*s", f->indent, "");
+    vfprintf(f->out, fmt, ap);
+    fputc('\n', f->out);
+    va_end(ap);
 }
 
-// (list expr ...)
-static Obj *prim_list(Obj *env, Obj *list) {
-    return eval_list(env, list);
+static int cc_temp(CFunc *f) {
+    return f->nvars++;
 }
 
-// (setq <symbol> expr)
-static Obj *prim_setq(Obj *env, Obj *list) {
-    if (list_length(list) != 2 || list->car->type != TSYMBOL) {
-        error("Malformed setq");
+static void cc_int(COperand op, int64_t n) {
+    if (INT32_MIN <= n && n <= INT32_MAX) {
+        snprintf(op, sizeof(COperand), "MINILISP_INT(%" PRId64 ")", n);
+    } else {
+        snprintf(op, sizeof(COperand), "MINILISP_INT(INT64_C(%" PRId64 "))", n);
     }
-    Obj *bind = find(env, list->car);
-    if (!bind) {
-        error("Unbound variable %s", list->car->name);
+}
+
+// 标志在 syms 里的下标
+static int cc_symbol(CModule *m, Obj *sym) {
+    int i = cc_position(sym, m->syms);
+    if (i >= 0) {
+        return m->nsyms - 1 - i;
     }
-    Obj *value = eval(env, list->cdr->car);
-    bind->cdr = value;
-    return value;
+    m->syms = cons(sym, m->syms);
+    return m->nsyms++;
 }
 
-// (+ <integer> ...)
-static Obj *prim_plus(Obj *env, Obj *list) {
-    int sum = 0;
-    for (Obj *args = eval_list(env, list); args != Nil; args = args->cdr) {
-        if (args->car->type != TINT) {
-            error("+ takes only num");
-        }
-        sum += args->car->value;
+// 常量放在 consts[i] 标志的全局值里，每次用到时重新读取：GC 会移动它
+static void cc_constant(CFunc *f, Obj *datum, COperand op) {
+    f->m->consts = cons(datum, f->m->consts);
+    int t = cc_temp(f);
+    cc_line(f, "v[%d] = rt->global(consts[%d]);", t, f->m->nconsts++);
+    snprintf(op, sizeof(COperand), "v[%d]", t);
+}
+
+static void cc_quote(CFunc *f, Obj *datum, COperand op) {
+    if (type_of(datum) == TINT) {
+        cc_int(op, int_value(datum));
+    } else if (datum == Nil) {
+        snprintf(op, sizeof(COperand), "MINILISP_NIL");
+    } else if (type_of(datum) == TSYMBOL) {
+        snprintf(op, sizeof(COperand), "syms[%d]", cc_symbol(f->m, datum));
+    } else {
+        cc_constant(f, datum, op);
     }
-    return make_int(sum);
 }
 
-static Obj *handle_function(Obj *env, Obj *list, int type) {
-    if (list->type != TCELL || !is_list(list->car) || list->cdr->type != TCELL) {
-        error("Malformed lambda");
+// 文件里编译成 C 的函数：返回 (名字 序号 参数个数)，不是时返回 NULL
+static Obj *cc_function(CFunc *f, Obj *sym) {
+    if (type_of(sym) != TSYMBOL || cc_position(sym, f->params) >= 0) {
+        return NULL;
     }
-    for (Obj *p = list->car; p != Nil; p = p->cdr) {
-        if (p->cdr->type != TSYMBOL) {
-            error("Param must be a symbol");
-        }
-        if (!is_list(p->cdr)) {
-            error("Param is not a flat list");
+    for (Obj *p = f->m->funcs; p != Nil; p = cdr_of(p)) {
+        if (p->car->car == sym) {
+            return p->car;
         }
     }
-    Obj *car = list->car;
-    Obj *cdr = list->cdr;
-    return make_function(type, car, cdr, env);
+    return NULL;
 }
 
-// (lambda (<symbol> ...) expr ...)
-static Obj *prim_lambda(Obj *env, Obj *list) {
-    return handle_function(env, list, TFUNCTION);
-}
+static void cc_expr(CFunc *f, Obj *expr, COperand op);
+static void cc_tail(CFunc *f, Obj *expr);
 
-static Obj *handle_defun(Obj *env, Obj *list, int type) {
-    if (list->car->type != TSYMBOL || list->cdr->type != TCELL)
-        error("Malformed defun");
-    Obj *sym = list->car;
-    Obj *rest = list->cdr;
-    Obj *fn = handle_function(env, rest, type);
-    add_variable(env, sym, fn);
-    return fn;
+// 依次求值 body，最后一个表达式的值写到 op
+static void cc_body(CFunc *f, Obj *body, COperand op) {
+    GC_FRAME;
+    GC_ROOT(body);
+    snprintf(op, sizeof(COperand), "MINILISP_NIL");
+    for (; body != Nil; body = cdr_of(body)) {
+        cc_expr(f, body->car, op);
+    }
 }
 
-// (defun <symbol> (<symbol> ...) expr ...)
-static Obj *prim_defun(Obj *env, Obj *list) {
-    return handle_defun(env, list, TFUNCTION);
+// 尾部位置的 body
+static void cc_tail_body(CFunc *f, Obj *body) {
+    GC_FRAME;
+    GC_ROOT(body);
+    if (body == Nil) {
+        cc_line(f, "return MINILISP_NIL;");
+        return;
+    }
+    COperand op;
+    for (; cdr_of(body) != Nil; body = cdr_of(body)) {
+        cc_expr(f, body->car, op);
+    }
+    cc_tail(f, body->car);
 }
 
-// (define <symbol> expr)
-static Obj *prim_define(Obj *env, Obj *list) {
-    if (list_length(list) != 2 || list->car->type != TSYMBOL)
-        error("Malformed define");
-    Obj *sym = list->car;
-    Obj *value = eval(env, list->cdr->car);
-    add_variable(env, sym, value);
-    return value;
+// 依次求值参数，结果写到 ops
+static void cc_args(CFunc *f, Obj *args, COperand *ops) {
+    GC_FRAME;
+    GC_ROOT(args);
+    for (int i = 0; args != Nil; args = cdr_of(args), i++) {
+        cc_expr(f, args->car, ops[i]);
+    }
 }
 
-// (defmacro <symbol> (<symbol> ...) expr ...)
-static Obj *prim_defmacro(Obj *env, Obj *list) {
-    return handle_defun(env, list, TMACRO);
+// 用逗号连接 n 个参数
+static void cc_join(char *buf, size_t size, COperand *ops, int n) {
+    buf[0] = '\0';
+    for (int i = 0, len = 0; i < n && (size_t)len < size; i++) {
+        len += snprintf(buf + len, size - len, "%s%s", i ? ", " : "", ops[i]);
+    }
 }
 
-// (macroexpand expr)
-static Obj *prim_macroexpand(Obj *env, Obj *list) {
-    if (list_length(list) != 1)
-        error("Malformed macroexpand");
-    Obj *body = list->car;
-    return macroexpand(env, body);
+// 整数运算，和虚拟机的 compile_int_op 一样用 int_ops 表。成功时返回 true
+static bool cc_int_op(CFunc *f, Primitive *fn, Obj *args, int nargs, COperand op) {
+    static const char *calls[OP_COUNT] = {
+        [OP_ADD] = "ml_add(%s, %s)", [OP_SUB] = "ml_sub(%s, %s)",
+        [OP_MUL] = "rt->arith(MINILISP_MUL, %s, %s)", [OP_DIV] = "rt->arith(MINILISP_DIV, %s, %s)",
+        [OP_MOD] = "rt->arith(MINILISP_MOD, %s, %s)", [OP_NUMEQ] = "ml_numeq(%s, %s)",
+        [OP_LT] = "ml_lt(%s, %s)", [OP_GT] = "ml_gt(%s, %s)", [OP_LE] = "ml_le(%s, %s)",
+        [OP_GE] = "ml_ge(%s, %s)",
+    };
+    for (size_t i = 0; i < sizeof(int_ops) / sizeof(int_ops[0]); i++) {
+        if (int_ops[i].fn != fn) {
+            continue;
+        }
+        if (nargs < int_ops[i].min || (int_ops[i].max >= 0 && nargs > int_ops[i].max)) {
+            return false;
+        }
+        GC_FRAME;
+        GC_ROOT(args);
+        COperand acc, x;
+        if (nargs < 2) {
+            cc_int(acc, int_ops[i].unit);
+        } else {
+            cc_expr(f, args->car, acc);
+            args = cdr_of(args);
+        }
+        for (; args != Nil; args = cdr_of(args)) {
+            cc_expr(f, args->car, x);
+            int t = cc_temp(f);
+            char call[sizeof(COperand) * 3];
+            snprintf(call, sizeof(call), calls[int_ops[i].op], acc, x);
+            cc_line(f, "v[%d] = %s;", t, call);
+            snprintf(acc, sizeof(COperand), "v[%d]", t);
+        }
+        memcpy(op, acc, sizeof(COperand));
+        return true;
+    }
+    return false;
 }
 
-// (println expr)
-static Obj *prim_println(Obj *env, Obj *list) {
-    print(eval(env, list->car));
-    printf("\n");
-    return Nil;
+// 通过 rt->call 调用 head，调用的表达式写到 call
+static void cc_call_expr(char *call, size_t size, COperand head, COperand *ops, int nargs) {
+    if (nargs == 0) {
+        snprintf(call, size, "rt->call(%s, 0, NULL)", head);
+        return;
+    }
+    char args[sizeof(COperand) * (nargs + 1) + 2];
+    cc_join(args, sizeof(args), ops, nargs);
+    snprintf(call, size, "rt->call(%s, %d, (Obj *[]){ %s })", head, nargs, args);
 }
 
-// (if expr expr expr ...)
-static Obj *prim_if(Obj *env, Obj *list) {
-    if (list_length(list) < 2)
-        error("Malformed if");
-    Obj *cond = eval(env, list->car);
-    if (cond != Nil) {
-        Obj *then = list->cdr->car;
-        return eval(env, then);
+// 函数调用。tail 为 true 时直接返回调用的结果，只用于直接调用的函数
+static void cc_call(CFunc *f, Obj *expr, int nargs, COperand op, bool tail) {
+    GC_FRAME;
+    GC_ROOT(expr);
+    COperand head;
+    COperand ops[nargs + 1];
+    char args[sizeof(COperand) * (nargs + 1) + 2];
+    char call[sizeof(args) + 64];
+    Obj *callee = cc_function(f, expr->car);
+    if (callee && int_value(cdr_of(cdr_of(callee))->car) == nargs) {
+        int index = int_value(cdr_of(callee)->car);
+        int sym = cc_symbol(f->m, expr->car);
+        cc_args(f, cdr_of(expr), ops);
+        // 和 TPREF 一样，先确认这个名字的值还是库里的函数，装载之后被重新
+        // 定义了的话按名字调用新的定义
+        snprintf(head, sizeof(head), "rt->global(syms[%d])", sym);
+        cc_call_expr(call, sizeof(call), head, ops, nargs);
+        int t = tail ? -1 : cc_temp(f);
+        cc_line(f, "if (rt->is_primitive(syms[%d], p%d)) {", sym, index);
+        f->indent += 4;
+        if (tail && index == f->index) {
+            // 尾部调用自己：参数先放进临时变量，再改写参数，然后回到开头
+            for (int i = 0; i < nargs; i++) {
+                int j;
+                if (sscanf(ops[i], "v[%d]", &j) == 1 && j < f->nparams && j != i) {
+                    int t = cc_temp(f);
+                    cc_line(f, "v[%d] = %s;", t, ops[i]);
+                    snprintf(ops[i], sizeof(COperand), "v[%d]", t);
+                }
+            }
+            for (int i = 0; i < nargs; i++) {
+                char var[16];
+                snprintf(var, sizeof(var), "v[%d]", i);
+                if (strcmp(var, ops[i])) {
+                    cc_line(f, "%s = %s;", var, ops[i]);
+                }
+            }
+            cc_line(f, "goto top;");
+            f->loops = true;
+        } else if (tail) {
+            // 尾部调用别的函数：返回 ML_TAIL，由调用者接着调用，相互递归的
+            // 函数也不会让 C 的栈越来越深
+            for (int i = 0; i < nargs; i++) {
+                cc_line(f, "ml_next_args[%d] = %s;", i, ops[i]);
+            }
+            cc_line(f, "ml_next = t%d;", index);
+            cc_line(f, "return ML_TAIL;");
+        } else {
+            cc_join(args, sizeof(args), ops, nargs);
+            cc_line(f, "v[%d] = ml_result(f%d(%s));", t, index, args);
+        }
+        f->indent -= 4;
+        if (tail) {
+            cc_line(f, "}");
+            cc_line(f, "return %s;", call);
+            return;
+        }
+        cc_line(f, "} else {");
+        cc_line(f, "    v[%d] = %s;", t, call);
+        cc_line(f, "}");
+        snprintf(op, sizeof(COperand), "v[%d]", t);
+        return;
+    }
+    if (type_of(expr->car) == TSYMBOL && cc_position(expr->car, f->params) < 0) {
+        int t = cc_temp(f);
+        cc_line(f, "v[%d] = rt->global(syms[%d]);", t, cc_symbol(f->m, expr->car));
+        snprintf(head, sizeof(head), "v[%d]", t);
+    } else {
+        cc_expr(f, expr->car, head);
     }
-    Obj *els = list->cdr->cdr;
-    return els == Nil ? Nil : progn(env, els);
+    cc_args(f, cdr_of(expr), ops);
+    cc_call_expr(call, sizeof(call), head, ops, nargs);
+    int t = cc_temp(f);
+    cc_line(f, "v[%d] = %s;", t, call);
+    snprintf(op, sizeof(COperand), "v[%d]", t);
 }
 
-// (= <integer> <integer>)
-static Obj *prim_num_eq(Obj *env, Obj *list) {
-    if (list_length(list) != 2)
-        error("Malformed =");
-    Obj *values = eval_list(env, list);
-    Obj *x = values->car;
-    Obj *y = values->cdr->car;
-    if (x->type != TINT || y->type != TINT)
-        error("= only takes numbers");
-    return x->value == y->value ? True : Nil;
+// (if test then else...)，tail 为 true 时两个分支都直接返回
+static void cc_if(CFunc *f, Obj *args, COperand op, bool tail) {
+    GC_FRAME;
+    GC_ROOT(args);
+    COperand test, x;
+    cc_expr(f, args->car, test);
+    int t = tail ? -1 : cc_temp(f);
+    cc_line(f, "if (%s != MINILISP_NIL) {", test);
+    f->indent += 4;
+    if (tail) {
+        cc_tail(f, cdr_of(args)->car);
+    } else {
+        cc_expr(f, cdr_of(args)->car, x);
+        cc_line(f, "v[%d] = %s;", t, x);
+    }
+    f->indent -= 4;
+    if (tail) {
+        // then 分支总是返回，else 分支不需要再套一层
+        cc_line(f, "}");
+        cc_tail_body(f, cdr_of(cdr_of(args)));
+        return;
+    }
+    cc_line(f, "} else {");
+    f->indent += 4;
+    cc_body(f, cdr_of(cdr_of(args)), x);
+    cc_line(f, "v[%d] = %s;", t, x);
+    f->indent -= 4;
+    cc_line(f, "}");
+    snprintf(op, sizeof(COperand), "v[%d]", t);
 }
 
-// (exit)
-static Obj *prim_exit(Obj *env, Obj *list) {
-    exit(0);
+static void cc_expr(CFunc *f, Obj *expr, COperand op) {
+    int type = type_of(expr);
+    if (type == TINT) {
+        cc_int(op, int_value(expr));
+        return;
+    }
+    if (expr == Nil || expr == True) {
+        snprintf(op, sizeof(COperand), expr == Nil ? "MINILISP_NIL" : "MINILISP_T");
+        return;
+    }
+    if (type == TSYMBOL) {
+        int i = cc_position(expr, f->params);
+        if (i < 0) {
+            int t = cc_temp(f);
+            cc_line(f, "v[%d] = rt->global(syms[%d]);", t, cc_symbol(f->m, expr));
+            i = t;
+        } else if (cc_position(expr, f->assigned) >= 0) {
+            // 后面的参数可能修改这个变量，先把现在的值复制下来
+            int t = cc_temp(f);
+            cc_line(f, "v[%d] = v[%d];", t, i);
+            i = t;
+        }
+        snprintf(op, sizeof(COperand), "v[%d]", i);
+        return;
+    }
+    if (type != TCELL) {
+        cc_constant(f, expr, op);
+        return;
+    }
+    GC_FRAME;
+    GC_ROOT(expr);
+    int nargs = list_length(cdr_of(expr));
+    Primitive *fn = cc_primitive(expr->car, f->params);
+    if (fn == prim_quote) {
+        cc_quote(f, cdr_of(expr)->car, op);
+    } else if (fn == prim_if) {
+        cc_if(f, cdr_of(expr), op, false);
+    } else if (fn == prim_setq) {
+        Obj *var = cdr_of(expr)->car;
+        GC_ROOT(var);
+        cc_expr(f, cdr_of(cdr_of(expr))->car, op);
+        int i = cc_position(var, f->params);
+        if (i >= 0) {
+            cc_line(f, "v[%d] = %s;", i, op);
+        } else {
+            cc_line(f, "rt->setq(syms[%d], %s);", cc_symbol(f->m, var), op);
+        }
+    } else if (!cc_int_op(f, fn, cdr_of(expr), nargs, op)) {
+        cc_call(f, expr, nargs, op, false);
+    }
 }
 
-static void add_primitive(Obj *env, char *name, Primitive *fn) {
-    Obj *sym = intern(name);
-    Obj *prim = make_primitive(fn);
-    add_variable(env, sym, prim);
+// 尾部位置的表达式：生成返回它的值的语句
+static void cc_tail(CFunc *f, Obj *expr) {
+    GC_FRAME;
+    GC_ROOT(expr);
+    COperand op;
+    if (type_of(expr) == TCELL) {
+        Primitive *fn = cc_primitive(expr->car, f->params);
+        if (fn == prim_if) {
+            cc_if(f, cdr_of(expr), op, true);
+            return;
+        }
+        Obj *callee = cc_function(f, expr->car);
+        if (callee && int_value(cdr_of(cdr_of(callee))->car) == list_length(cdr_of(expr))) {
+            cc_call(f, expr, list_length(cdr_of(expr)), op, true);
+            return;
+        }
+    }
+    cc_expr(f, expr, op);
+    cc_line(f, "return %s;", op);
 }
 
-static void define_constants(Obj *env) {
-    Obj *sym = intern("t");
-    add_variable(env, sym, True);
+// 把 len 个字节写成 C 的字符串常量，每行一段
+static void cc_string(FILE *out, const char *s, size_t len, int indent) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '\n') {
+            fputs("\\n", out);
+            if (i + 1 < len) {
+                fprintf(out, "\"\n%*s\"", indent, "");
+            }
+        } else if (c == '"' || c == '\\' || c == '?') {
+            fprintf(out, "\\%c", c);
+        } else if (c < ' ' || c >= 0x7f) {
+            // 八进制转义最多三位，不会吞掉后面的数字
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
 }
 
-static void define_primitives(Obj *env) {
-    add_primitive(env, "quote", prim_quote);
-    add_primitive(env, "list", prim_list);
-    add_primitive(env, "setq", prim_setq);
-    add_primitive(env, "+", prim_plus);
-    add_primitive(env, "define", prim_define);
-    add_primitive(env, "defun", prim_defun);
-    add_primitive(env, "defmacro", prim_defmacro);
-    add_primitive(env, "macroexpand", prim_macroexpand);
-    add_primitive(env, "lambda", prim_lambda);
-    add_primitive(env, "if", prim_if);
-    add_primitive(env, "=", prim_num_eq);
-    add_primitive(env, "println", prim_println);
-    add_primitive(env, "exit", prim_exit);
+// 生成一个编译的 defun：C 函数 f<index> 和包装它的原始函数 p<index>
+static void cc_emit_function(CModule *m, FILE *out, Obj *item, int index) {
+    GC_FRAME;
+    GC_ROOT(item);
+    CFunc f = {
+        .m = m, .name = item->car, .params = cdr_of(item)->car, .assigned = cdr_of(cdr_of(item))->car,
+        .index = index, .indent = 4,
+    };
+    GC_ROOT(f.params);
+    GC_ROOT(f.assigned);
+    f.nparams = f.nvars = list_length(f.params);
+    char *body;
+    size_t len;
+    f.out = open_memstream(&body, &len);
+    if (!f.out) {
+        error("Out of memory for C code");
+    }
+    cc_tail_body(&f, cdr_of(cdr_of(cdr_of(item))));
+    fclose(f.out);
+    
+    fprintf(out, "\n// %s\nstatic Obj *f%d(", f.name->name, index);
+    for (int i = 0; i < f.nparams; i++) {
+        fprintf(out, "%sObj *a%d", i ? ", " : "", i);
+    }
+    fprintf(out, "%s) {\n    Obj *v[%d] = {", f.nparams ? "" : "void", f.nvars > 0 ? f.nvars : 1);
+    for (int i = 0; i < f.nparams; i++) {
+        fprintf(out, "%s a%d", i ? "," : "", i);
+    }
+    fprintf(out, " };\n");
+    if (f.nvars > f.nparams) {
+        fprintf(out, "    for (int i = %d; i < %d; i++) {\n        v[i] = MINILISP_NIL;\n    }\n", f.nparams, f.nvars);
+    } else if (f.nvars == 0) {
+        fprintf(out, "    v[0] = MINILISP_NIL;\n");
+    }
+    fprintf(out, "    ML_ENTER(v);\n%s%s}\n", f.loops ? "top:\n" : "", body);
+    free(body);
+    
+    fprintf(out, "\nstatic Obj *p%d(Obj *env, Obj *args) {\n", index);
+    if (f.nparams) {
+        fprintf(out, "    Obj *a[%d];\n    rt->args(env, args, %d, a);\n    return ml_result(f%d(", f.nparams, f.nparams, index);
+        for (int i = 0; i < f.nparams; i++) {
+            fprintf(out, "%sa[%d]", i ? ", " : "", i);
+        }
+        fprintf(out, "));\n}\n");
+    } else {
+        fprintf(out, "    rt->args(env, args, 0, NULL);\n    return ml_result(f%d());\n}\n", index);
+    }
 }
 
+// 生成的文件开头的定义
+static const char cc_prelude[] =
+    "#include \"minilisp.h\"\n"
+    "\n"
+    "#ifndef MINILISP_NATIVE_INIT\n"
+    "#define MINILISP_NATIVE_INIT minilisp_native_init\n"
+    "#endif\n"
+    "\n"
+    "typedef MiniLispObj Obj;\n"
+    "\n"
+    "static const MiniLispRuntime *rt;\n"
+    "\n"
+    "static inline void ml_leave(size_t *token) {\n"
+    "    rt->leave(*token);\n"
+    "}\n"
+    "\n"
+    "// 检查嵌套深度，把 v 登记为 GC 的根，函数返回时自动撤销\n"
+    "#define ML_ENTER(v) size_t ml_token __attribute((cleanup(ml_leave))) = rt->enter(v, sizeof(v) / sizeof(v[0]))\n"
+    "\n"
+    "// 两个参数都是 fixnum 时直接计算：带着标签相加减，只需要调整最低位\n"
+    "static inline Obj *ml_add(Obj *x, Obj *y) {\n"
+    "    intptr_t r;\n"
+    "    if (MINILISP_IS_INT(x) && MINILISP_IS_INT(y) && !__builtin_add_overflow((intptr_t)x - 1, (intptr_t)y, &r)) {\n"
+    "        return (Obj *)r;\n"
+    "    }\n"
+    "    return rt->arith(MINILISP_ADD, x, y);\n"
+    "}\n"
+    "\n"
+    "static inline Obj *ml_sub(Obj *x, Obj *y) {\n"
+    "    intptr_t r;\n"
+    "    if (MINILISP_IS_INT(x) && MINILISP_IS_INT(y) && !__builtin_sub_overflow((intptr_t)x, (intptr_t)y - 1, &r)) {\n"
+    "        return (Obj *)r;\n"
+    "    }\n"
+    "    return rt->arith(MINILISP_SUB, x, y);\n"
+    "}\n"
+    "\n"
+    "// 带着标签比较和比较整数本身的结果相同\n"
+    "#define ML_COMPARE(name, op, k) \\\n"
+    "    static inline Obj *name(Obj *x, Obj *y) { \\\n"
+    "        if (MINILISP_IS_INT(x) && MINILISP_IS_INT(y)) { \\\n"
+    "            return (intptr_t)x op (intptr_t)y ? MINILISP_T : MINILISP_NIL; \\\n"
+    "        } \\\n"
+    "        return rt->arith(k, x, y); \\\n"
+    "    }\n"
+    "\n"
+    "ML_COMPARE(ml_numeq, ==, MINILISP_NUMEQ)\n"
+    "ML_COMPARE(ml_lt, <, MINILISP_LT)\n"
+    "ML_COMPARE(ml_gt, >, MINILISP_GT)\n"
+    "ML_COMPARE(ml_le, <=, MINILISP_LE)\n"
+    "ML_COMPARE(ml_ge, >=, MINILISP_GE)\n";
 
+// minilisp --compile-to-c in out：编译 in，写到 out
+static void compile_to_c(const char *in, const char *out) {
+    int fd = open(in, O_RDONLY);
+    if (fd < 0) {
+        error("Cannot open %s: %s", in, strerror(errno));
+    }
+    Reader r;
+    reader_open(&r, fd, true, in);
+    if (r.fd >= 0) {
+        reader_close(&r);
+        error("%s: Not a regular file", in);
+    }
+    ctx->reader = &r;
+    CModule m = { .path = in, .reader = &r, .items = Nil, .defuns = Nil, .macros = Nil, .funcs = Nil, .syms = Nil, .consts = Nil };
+    GC_FRAME;
+    GC_ROOT(m.items);
+    GC_ROOT(m.defuns);
+    GC_ROOT(m.funcs);
+    GC_ROOT(m.syms);
+    GC_ROOT(m.consts);
+    GC_ROOT(m.macros);
+    Obj *expr = NULL;
+    GC_ROOT(expr);
+    // 先扫描一遍，记下 defmacro 定义的宏：处理 defun 时要知道后面会定义哪些宏
+    Reader scan;
+    reader_open_string(&scan, r.buf, r.len, in);
+    ctx->reader = &scan;
+    while ((expr = read_expr())) {
+        if (cc_is_defmacro(expr)) {
+            m.macros = cons(cdr_of(expr)->car, m.macros);
+        }
+    }
+    ctx->reader = &r;
+    m.macros = cc_reverse(m.macros);
+    for (;;) {
+        size_t start = r.pos;
+        int line = r.line;
+        expr = read_expr();
+        if (!expr) {
+            break;
+        }
+        if (expr == Cparen) {
+            error("Stray close parenthesis");
+        }
+        if (expr == Dot) {
+            error("Stray Dot");
+        }
+        if (cc_is_defmacro(expr)) {
+            m.macros = cdr_of(m.macros);
+        }
+        cc_toplevel(&m, expr, start, r.pos, line, r.form_line);
+        // 后面的 defun 可能用到这里定义的宏
+        if (type_of(expr) == TCELL && (expr->car == ctx->Sym_defun || expr->car == ctx->Sym_defmacro)) {
+            eval(ctx->env, expr);
+        }
+    }
+    m.items = cc_reverse(m.items);
+    
+    // 给编译的函数编号。名字被不止一个 defun 定义过的函数装载之后可能被
+    // 替换掉，只能通过全局变量调用
+    int nfuncs = 0, maxparams = 1;
+    char *code;
+    size_t len;
+    FILE *funcs = open_memstream(&code, &len);
+    if (!funcs) {
+        error("Out of memory for C code");
+    }
+    for (Obj *p = m.items; p != Nil; p = cdr_of(p)) {
+        Obj *item = p->car;
+        if (type_of(item->car) != TSYMBOL) {
+            continue;
+        }
+        int nparams = list_length(cdr_of(item)->car);
+        fprintf(funcs, "static Obj *f%d(", nfuncs);
+        for (int i = 0; i < nparams; i++) {
+            fprintf(funcs, "%sObj *a%d", i ? ", " : "", i);
+        }
+        fprintf(funcs, "%s);\nstatic Obj *p%d(Obj *env, Obj *args);\n", nparams ? "" : "void", nfuncs);
+        maxparams = nparams > maxparams ? nparams : maxparams;
+        int defined = 0;
+        for (Obj *q = m.defuns; q != Nil; q = cdr_of(q)) {
+            defined += q->car == item->car;
+        }
+        if (defined == 1) {
+            Obj *f = cons(make_int(nparams), Nil);
+            f = cons(make_int(nfuncs), f);
+            f = cons(item->car, f);
+            m.funcs = cons(f, m.funcs);
+        }
+        nfuncs++;
+    }
+    if (nfuncs) {
+        fprintf(funcs, "\n// 尾部调用文件里的其他函数时把被调用的函数和参数放在这里，返回 ML_TAIL\n"
+                "#define ML_TAIL ((Obj *)(uintptr_t)2)\n"
+                "\n"
+                "static __thread Obj *(*ml_next)(Obj **args);\n"
+                "static __thread Obj *ml_next_args[%d];\n"
+                "\n"
+                "// 接着执行尾部调用，直到得到结果\n"
+                "static Obj *ml_bounce(void) {\n"
+                "    Obj *r;\n"
+                "    do {\n"
+                "        r = ml_next(ml_next_args);\n"
+                "    } while (r == ML_TAIL);\n"
+                "    return r;\n"
+                "}\n"
+                "\n"
+                "static inline Obj *ml_result(Obj *r) {\n"
+                "    return r == ML_TAIL ? ml_bounce() : r;\n"
+                "}\n"
+                "\n", maxparams);
+    }
+    // t<i> 用参数数组调用 f<i>，供 ml_bounce 使用
+    int index = 0;
+    for (Obj *p = m.items; p != Nil; p = cdr_of(p)) {
+        Obj *item = p->car;
+        if (type_of(item->car) == TSYMBOL) {
+            int nparams = list_length(cdr_of(item)->car);
+            fprintf(funcs, "static inline Obj *t%d(Obj **a) {\n%s    return f%d(", index, nparams ? "" : "    (void)a;\n", index);
+            for (int i = 0; i < nparams; i++) {
+                fprintf(funcs, "%sa[%d]", i ? ", " : "", i);
+            }
+            fprintf(funcs, ");\n}\n");
+            index++;
+        }
+    }
+    index = 0;
+    for (Obj *p = m.items; p != Nil; p = cdr_of(p)) {
+        if (type_of(p->car->car) == TSYMBOL) {
+            cc_emit_function(&m, funcs, p->car, index++);
+        }
+    }
+    fclose(funcs);
+    
+    FILE *f = fopen(out, "w");
+    if (!f) {
+        free(code);
+        error("Cannot open %s: %s", out, strerror(errno));
+    }
+    fprintf(f, "// 由 minilisp --compile-to-c 从 %s 生成\n%s", in, cc_prelude);
+    if (m.nsyms) {
+        fprintf(f, "\nstatic Obj *syms[%d];\n", m.nsyms);
+    }
+    if (m.nconsts) {
+        fprintf(f, "%sstatic Obj *consts[%d];\n", m.nsyms ? "" : "\n", m.nconsts);
+    }
+    // 开头是所有函数的声明，互相调用时不用管定义的先后
+    fprintf(f, "%s%s", nfuncs ? "\n" : "", code);
+    free(code);
+    
+    fprintf(f, "\nvoid MINILISP_NATIVE_INIT(const MiniLispRuntime *r) {\n"
+            "    static MiniLisp *owner;\n"
+            "    if (r->version != MINILISP_NATIVE_VERSION) {\n"
+            "        r->error(");
+    char msg[256];
+    snprintf(msg, sizeof(msg), "%s: compiled for a different version of MiniLisp", in);
+    cc_string(f, msg, strlen(msg), 0);
+    fprintf(f, ");\n    }\n"
+            "    // 标志和常量属于装载它的解释器\n"
+            "    if (owner && owner != r->current()) {\n"
+            "        r->error(");
+    snprintf(msg, sizeof(msg), "%s: already loaded into another interpreter", in);
+    cc_string(f, msg, strlen(msg), 0);
+    fprintf(f, ");\n    }\n    owner = r->current();\n    rt = r;\n");
+    int i = m.nsyms;
+    for (Obj *p = m.syms; p != Nil; p = cdr_of(p)) {
+        fprintf(f, "    syms[%d] = rt->intern(", --i);
+        cc_string(f, p->car->name, strlen(p->car->name), 8);
+        fprintf(f, ");\n");
+    }
+    i = m.nconsts;
+    for (Obj *p = m.consts; p != Nil; p = cdr_of(p)) {
+        cc_print(p->car);
+        fprintf(f, "    consts[%d] = rt->constant(", --i);
+        cc_string(f, cc_buf, strlen(cc_buf), 8);
+        fprintf(f, ");\n");
+    }
+    index = 0;
+    for (Obj *p = m.items; p != Nil; p = cdr_of(p)) {
+        Obj *item = p->car;
+        if (type_of(item->car) == TSYMBOL) {
+            fprintf(f, "    rt->defun(");
+            cc_string(f, item->car->name, strlen(item->car->name), 8);
+            fprintf(f, ", p%d);\n", index++);
+            continue;
+        }
+        size_t start = int_value(item->car), end = int_value(cdr_of(item)->car);
+        fprintf(f, "    rt->eval(");
+        cc_string(f, in, strlen(in), 8);
+        fprintf(f, ", %d,\n             ", (int)int_value(cdr_of(cdr_of(item))->car));
+        cc_string(f, r.buf + start, end - start, 13);
+        fprintf(f, ");\n");
+    }
+    fprintf(f, "}\n");
+    ctx->reader = r.prev;
+    reader_close(&r);
+    if (fclose(f) == EOF) {
+        error("Cannot write %s: %s", out, strerror(errno));
+    }
+}
 
+static MiniLispOptions options; // --heap、--max-depth、--vm、--jit 和 --image
+static const char *compile_in;  // --compile-to-c 的源文件
+static const char *compile_out; // 和生成的 C 文件
 
-
-
-
-
+// 解释器线程：创建上下文，然后依次执行 files 里的文件（以 NULL 结尾），
+// 没有文件时从标准输入读取。返回使用的上下文
+static void *run_interpreter(void *arg) {
+    char **files = arg;
+    char err[512];
+    ctx = new_context(&options, err, sizeof(err));
+    if (!ctx) {
+        fprintf(stderr, "%s\n", err);
+        exit(1);
+    }
+    
+    if (compile_in) {
+        // 命令行上的文件先装载，里面的宏可以在编译时展开
+        for (int i = 0; files[i]; i++) {
+            load_file(ctx->env, files[i], false);
+        }
+        compile_to_c(compile_in, compile_out);
+        out_flush(&ctx->out);
+        return ctx;
+    }
+    if (!files[0]) {
+        Reader r;
+        reader_open(&r, STDIN_FILENO, false, "<stdin>");
+        ctx->reader = &r;
+        eval_input(ctx->env, true);
+        ctx->reader = NULL;
+        reader_close(&r);
+    }
+    for (int i = 0; files[i]; i++) {
+        load_file(ctx->env, files[i], true);
+    }
+    out_flush(&ctx->out);
+    return ctx;
+}
 
 /**
  入口点
@@ -744,31 +8258,100 @@ static void define_primitives(Obj *env) {
  */
 int main(int argc, char **argv) {
     // 在这里最后插入解释器业务逻辑，现在用于测试
-    Nil = make_special(NULL);
-    Dot = make_special(TDOT);
-    Cparen = make_special(TCPAREN);
-    True = make_special(TTRUE);
-    Symbols = Nil;
-    
-    Obj *env = make_env(Nil, NULL);
-    
-    define_constants(env);
-    define_primitives(env);
-    
-    // 主循环
-    for (; ; ) {
-        Obj *expr = read();
-        if (!expr) {
-            return 0;
+    // 不以 '-' 开头的参数是要执行的源文件
+    char **files = malloc(sizeof(char *) * argc);
+    int nfiles = 0;
+    for (int i = 1; i < argc; i++) {
+        if ('-' != argv[i][0]) {
+            files[nfiles++] = argv[i];
+            continue;
         }
-        if (expr == Cparen) {
-            error("Stray close parenthesis");
+        // --heap <大小>：每个半区的字节数，可以带 k/m/g 后缀
+        if (!strcmp(argv[i], "--heap") && i + 1 < argc) {
+            char *end;
+            options.heap_size = strtoul(argv[++i], &end, 10);
+            switch (tolower(*end)) {
+                case 'g': options.heap_size *= 1024;    // fallthrough
+                case 'm': options.heap_size *= 1024;    // fallthrough
+                case 'k': options.heap_size *= 1024;
+            }
+            if (options.heap_size < 4096) {
+                error("Heap size too small: %s", argv[i]);
+            }
+            continue;
         }
-        if (expr == Dot) {
-            error("Stray Dot");
+        // --image <文件>：从 save-image 保存的映像启动
+        if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+            options.image = argv[++i];
+            continue;
+        }
+        // --compile-to-c <源文件> <C 文件>：把源文件编译成 C，见“编译成 C”
+        if (!strcmp(argv[i], "--compile-to-c") && i + 2 < argc) {
+            compile_in = argv[++i];
+            compile_out = argv[++i];
+            continue;
+        }
+        // --batch：运行脚本，不打印每个顶层表达式的值
+        if (!strcmp(argv[i], "--batch")) {
+            batch = true;
+            continue;
+        }
+        // --vm：用字节码虚拟机执行函数
+        if (!strcmp(argv[i], "--vm")) {
+            options.vm = true;
+            continue;
+        }
+        // --jit：在虚拟机里执行，经常调用的函数编译成机器码
+        if (!strcmp(argv[i], "--jit")) {
+#ifdef __x86_64__
+            options.vm = options.jit = true;
+#else
+            error("--jit is only supported on x86-64");
+#endif
+            continue;
+        }
+        // --stats：退出时打印统计
+        if (!strcmp(argv[i], "--stats")) {
+#ifdef MINILISP_STATS
+            atexit(print_stats);
+#else
+            error("--stats requires a build with -DMINILISP_STATS");
+#endif
+            continue;
+        }
+        // --threads <个数>：pmap 和 pcall 使用的工作线程数
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+            if (nthreads <= 0) {
+                error("Invalid thread count: %s", argv[i]);
+            }
+            continue;
+        }
+        // --max-depth <层数>：求值和函数调用允许嵌套的最大深度
+        if (!strcmp(argv[i], "--max-depth") && i + 1 < argc) {
+            options.max_depth = atoi(argv[++i]);
+            if (options.max_depth <= 0) {
+                error("Invalid depth: %s", argv[i]);
+            }
+            continue;
         }
-        print(eval(env, expr));
-        printf("\n");
+        error("Unknown option: %s", argv[i]);
+    }
+    files[nfiles] = NULL;
+    
+    // 递归求值需要的 C 栈和 --max-depth 成正比，主线程的栈大小由系统决定，
+    // 所以解释器运行在一个自己分配栈的线程里
+    pthread_t thread;
+    int depth = options.max_depth ? options.max_depth : DEFAULT_MAX_DEPTH;
+    if (!spawn_thread(&thread, depth, run_interpreter, files, NULL)) {
+        error("Cannot start interpreter thread");
     }
-    return 0;
+    // 上下文留到进程退出，--stats 的报告还要用它
+    void *result;
+    pthread_join(thread, &result);
+    ctx = result;
+    free(files);
+    return ctx->had_error ? 1 : 0;
 }
+
+#endif
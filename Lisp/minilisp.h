@@ -0,0 +1,141 @@
+/**
+ MiniLisp 的嵌入接口
+ 用 -DMINILISP_NO_MAIN 编译 main.c（make lib 生成 build/libminilisp.a），
+ 链接时加上 -lpthread -ldl。每个 MiniLisp 是一个独立的解释器，有自己的堆和全局
+ 环境；不同的线程可以同时使用不同的解释器，同一个解释器同一时间只能由
+ 一个线程使用。
+ */
+#ifndef MINILISP_H
+#define MINILISP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Context MiniLisp;
+
+// 创建一个解释器，内存不够时返回 NULL
+MiniLisp *minilisp_new(void);
+
+// 从 (save-image "path") 保存的映像创建一个解释器，全局环境和保存时相同。
+// 失败时返回 NULL，并把原因写到 err 里（最多 size 个字节，可以为 NULL）。
+// 映像只能由同一个构建的解释器装载
+MiniLisp *minilisp_open_image(const char *path, char *err, size_t size);
+
+// 创建解释器的选项，对应命令行上的同名选项。为 0 的成员使用默认值
+typedef struct MiniLispOptions {
+    size_t heap_size;       // --heap：每个半区的字节数，默认 16MB，至少 4096
+    int max_depth;          // --max-depth：求值允许嵌套的最大深度，默认 100000
+    bool vm;                // --vm：函数体编译成字节码在虚拟机里执行
+    bool jit;               // --jit：同时把经常调用的函数编译成机器码，只支持 x86-64
+    const char *image;      // --image：从这个映像创建，为 NULL 时创建新的解释器
+} MiniLispOptions;
+
+// 按 options 创建一个解释器，options 为 NULL 时和 minilisp_new 相同。
+// 失败时返回 NULL，err 的含义同 minilisp_open_image
+MiniLisp *minilisp_new_with(const MiniLispOptions *options, char *err, size_t size);
+
+// 依次求值 src 里的所有表达式。成功时返回 true，把最后一个值打印到 out；
+// 出错时返回 false，out 里是错误报告。out 最多写 size 个字节（包括结尾的
+// '\0'），可以为 NULL。出错之前完成的定义仍然有效。(exit) 不会结束进程，
+// 只是不再求值剩下的表达式，这时返回 true，值是 ()
+bool minilisp_eval(MiniLisp *lisp, const char *src, char *out, size_t size);
+
+// 销毁解释器，释放它的全部内存
+void minilisp_free(MiniLisp *lisp);
+
+/**
+ 增量解析
+ 输入一块一块地到达时（比如一个线程同时处理很多个非阻塞的连接），每路输入
+ 用一个解析器。收到的字节交给 minilisp_parser_feed，块的边界可以落在任何
+ 地方；读完的顶层表达式排成队，用 minilisp_parser_eval 依次取出求值。解析器
+ 不递归，嵌套多深都不会耗尽栈。解析器属于创建它的解释器，要在
+ minilisp_free 之前释放。
+ */
+
+typedef struct Parser MiniLispParser;
+
+// 创建一个解析器，name 是报错时使用的输入名字。内存不够时返回 NULL
+MiniLispParser *minilisp_parser_new(MiniLisp *lisp, const char *name);
+
+// 解析 buf 里的 len 个字节。出错时（语法错误，或者内存不够）和交互式输入
+// 一样丢掉没有读完的整个表达式，包括之后的块里属于它的部分；出错的地方不在
+// 列表里的语法错误还会跳过这一行剩下的内容。然后继续解析后面的字节，最后
+// 返回 false，第一个错误的报告写到 err 里
+bool minilisp_parser_feed(MiniLispParser *parser, const char *buf, size_t len, char *err, size_t size);
+
+// 输入结束了：结束最后一个标志或者整数。还有没读完的表达式时返回 false
+bool minilisp_parser_finish(MiniLispParser *parser, char *err, size_t size);
+
+// 求值队列里的下一个表达式。没有读完的表达式时返回 0；成功时返回 1，
+// 出错时返回 -1，out 的含义同 minilisp_eval
+int minilisp_parser_eval(MiniLispParser *parser, char *out, size_t size);
+
+void minilisp_parser_free(MiniLispParser *parser);
+
+/**
+ 编译成 C 的库
+ minilisp --compile-to-c lib.lisp lib.c 把一个源文件编译成 C。生成的代码只通过
+ 下面的 MiniLispRuntime 使用解释器，编译时用 -I 指向这个目录即可。编译成动态库
+ 之后可以用 (load-native "lib.so") 装载；也可以直接链接进嵌入解释器的程序，
+ 用 minilisp_load_native 装载（这时用 -DMINILISP_NATIVE_INIT=名字 给初始化函数
+ 改名，一个程序就可以链接多个库）。装载的效果和 (load "lib.lisp") 相同。
+ */
+
+#define MINILISP_NATIVE_VERSION 2
+
+typedef struct Obj MiniLispObj;
+
+// 值的表示：整数 n 是 (n << 1) | 1，() 和 t 是两个固定的常量，
+// 其他的值都是指向对象的指针
+#define MINILISP_INT(n)     ((MiniLispObj *)(((uintptr_t)(n) << 1) | 1))
+#define MINILISP_IS_INT(x)  ((uintptr_t)(x) & 1)
+#define MINILISP_NIL        ((MiniLispObj *)(uintptr_t)10)
+#define MINILISP_T          ((MiniLispObj *)(uintptr_t)34)
+
+// MiniLispRuntime.arith 的运算
+enum {
+    MINILISP_ADD, MINILISP_SUB, MINILISP_MUL, MINILISP_DIV, MINILISP_MOD,
+    MINILISP_NUMEQ, MINILISP_LT, MINILISP_GT, MINILISP_LE, MINILISP_GE,
+};
+
+// 原始函数：args 是没有求值的参数，在 env 里求值
+typedef MiniLispObj *MiniLispPrimitive(MiniLispObj *env, MiniLispObj *args);
+
+// 解释器提供给库的函数，都作用于正在装载或者调用这个库的解释器。
+// 出错时它们不返回，而是跳回解释器里最近的错误处理点
+typedef struct MiniLispRuntime {
+    int version;                        // MINILISP_NATIVE_VERSION
+    MiniLisp *(*current)(void);         // 当前的解释器
+    MiniLispObj *(*intern)(const char *name);
+    // 读取 src 里的一个表达式（不求值），保存在一个隐藏的全局变量里，
+    // 返回这个变量的标志
+    MiniLispObj *(*constant)(const char *src);
+    MiniLispObj *(*global)(MiniLispObj *sym);                   // 全局变量的值
+    void (*setq)(MiniLispObj *sym, MiniLispObj *value);         // 修改全局变量
+    // 调用函数 fn，args 是已经求值的 n 个参数
+    MiniLispObj *(*call)(MiniLispObj *fn, int n, MiniLispObj **args);
+    // 整数运算，参数不是整数或者结果溢出时报错
+    MiniLispObj *(*arith)(int op, MiniLispObj *x, MiniLispObj *y);
+    // 原始函数求值自己的参数：参数必须正好 n 个，结果写到 out
+    void (*args)(MiniLispObj *env, MiniLispObj *list, int n, MiniLispObj **out);
+    // 进入一个函数：检查嵌套深度，把 vars 的 n 个变量登记为 GC 的根。
+    // 返回值交给对应的 leave
+    size_t (*enter)(MiniLispObj **vars, int n);
+    void (*leave)(size_t token);
+    // 把 fn 定义成全局的原始函数 name
+    void (*defun)(const char *name, MiniLispPrimitive *fn);
+    // 全局变量 sym 的值是不是原始函数 fn：库里的函数直接调用别的函数之前
+    // 用它确认那个函数没有被重新定义
+    int (*is_primitive)(MiniLispObj *sym, MiniLispPrimitive *fn);
+    // 在全局环境里求值 src，出错时按 file 的第 line 行报告
+    void (*eval)(const char *file, int line, const char *src);
+    void (*error)(const char *msg) __attribute((noreturn));
+} MiniLispRuntime;
+
+typedef void MiniLispNativeInit(const MiniLispRuntime *rt);
+
+// 装载静态链接进程序的库，init 是它的初始化函数。返回值和 out 同 minilisp_eval
+bool minilisp_load_native(MiniLisp *lisp, MiniLispNativeInit *init, char *out, size_t size);
+
+#endif
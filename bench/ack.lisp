@@ -0,0 +1,10 @@
+;; Ackermann 函数：调用很深，而且大部分是尾调用
+(defun ack (m n)
+  (if (= m 0)
+      (+ n 1)
+      (if (= n 0)
+          (ack (- m 1) 1)
+          (ack (- m 1) (ack m (- n 1))))))
+
+(ack 2 9)
+(ack 3 7)
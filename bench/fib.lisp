@@ -0,0 +1,7 @@
+;; 递归调用和整数运算
+(defun fib (n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(fib 27)
@@ -0,0 +1,15 @@
+;; 散列表：去重计数，键是 0 到 39999 之间的伪随机整数
+(define seen (make-hash-table))
+
+(defun next (x) (mod (+ (* x 1103515245) 12345) 2147483648))
+
+(defun dedup (i x dups)
+  (if (= i 200000)
+      dups
+      (if (gethash (mod x 40000) seen)
+          (dedup (+ i 1) (next x) (+ dups 1))
+          (puthash (mod x 40000) i seen)
+          (dedup (+ i 1) (next x) dups))))
+
+(dedup 0 42 0)
+(hash-count seen)
@@ -0,0 +1,15 @@
+;; 构造列表：分配大量的 cell，大部分很快变成垃圾，一部分一直存活
+(defun build (n acc)
+  (if (= n 0)
+      acc
+      (build (- n 1) (list n acc (list n n)))))
+
+(defun discard (x k) (repeat (- k 1)))
+
+(defun repeat (k)
+  (if (= k 0)
+      'done
+      (discard (build 20000 ()) k)))
+
+(discard (define keep (build 50000 ())) 1)
+(repeat 30)
@@ -0,0 +1,22 @@
+;; 宏：函数体里的宏在定义时展开，重新定义宏之后要重新分析
+(defmacro unless (c e) (list 'if c () e))
+(defmacro inc (x) (list '+ x 1))
+(defmacro dec (x) (list '- x 1))
+(defmacro swap-args (f a b) (list f b a))
+
+(defun count-down (n acc)
+  (if (= n 0)
+      acc
+      (count-down (dec n) (if (= (mod n 3) 0) (inc acc) acc))))
+
+(defun loop (n)
+  (unless (= n 0)
+    (swap-args loop-step n 0)))
+
+(defun loop-step (a n)
+  (loop (dec n)))
+
+(count-down 200000 0)
+(loop 200000)
+(defmacro inc (x) (list '+ 2 x))
+(count-down 200000 0)
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""运行 bench/ 下的基准测试，每个测试输出一行 JSON。
+
+每个测试用优化的解释器运行 --repeat 次，报告最短的墙钟时间和最大的常驻内存
+（KB）；如果给了 --stats-bin，再用带统计的解释器运行一次，报告分配的对象个数、
+字节数和 GC 次数。symbols 测试的输入由这个脚本生成，放在 --work 目录里。
+给了 --check 时，还要求带 --flags 运行的输出和不带选项运行的完全相同，用来
+检查 --vm、--jit 这样的执行方式和解释器的结果一致。
+
+    python3 bench/run.py --bin build/minilisp --stats-bin build/minilisp-stats
+    python3 bench/run.py --bin build/minilisp --flags=--vm fib tak
+    python3 bench/run.py --bin build/minilisp --flags=--jit --check
+"""
+
+import argparse
+import json
+import os
+import re
+import shlex
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def gen_symbols(path, nforms=5000, per_form=100):
+    """生成读取大量不同标志的输入：每个顶层表达式引用 per_form 个新标志。"""
+    with open(path, "w") as f:
+        f.write(";; 由 bench/run.py 生成\n(defun ignore (x) 'ok)\n")
+        n = 0
+        for _ in range(nforms):
+            names = []
+            for _ in range(per_form):
+                names.append("sym-%d-%x" % (n, (n * 2654435761) & 0xffffff))
+                n += 1
+            f.write("(ignore '(%s))\n" % " ".join(names))
+
+
+def run_once(cmd, path):
+    """运行一次，返回 (墙钟秒数, 最大常驻内存 KB, 退出码, 标准错误)。"""
+    with open(os.devnull, "w") as out:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd + [path], stdout=out, stderr=subprocess.PIPE)
+        err = proc.stderr.read()
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    return wall, usage.ru_maxrss, proc.returncode, err.decode(errors="replace")
+
+
+def output(cmd, path):
+    """运行一次，返回标准输出和标准错误。"""
+    proc = subprocess.run(cmd + [path], stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    return proc.stdout
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--bin", default="build/minilisp", help="优化的解释器")
+    ap.add_argument("--stats-bin", help="用 -DMINILISP_STATS 构建的解释器，用来统计分配")
+    ap.add_argument("--flags", default="", help="传给解释器的选项，比如 --vm")
+    ap.add_argument("--repeat", type=int, default=3, help="每个测试运行的次数")
+    ap.add_argument("--check", action="store_true", help="和不带 --flags 运行的输出比较")
+    ap.add_argument("--work", default="build/bench", help="存放生成的输入的目录")
+    ap.add_argument("names", nargs="*", help="只运行这些测试")
+    args = ap.parse_args()
+
+    os.makedirs(args.work, exist_ok=True)
+    benches = {}
+    for name in sorted(os.listdir(BENCH_DIR)):
+        if name.endswith(".lisp"):
+            benches[name[:-5]] = os.path.join(BENCH_DIR, name)
+    benches["symbols"] = os.path.join(args.work, "symbols.lisp")
+    if not args.names or "symbols" in args.names:
+        gen_symbols(benches["symbols"])
+
+    flags = shlex.split(args.flags)
+    failed = False
+    for name, path in sorted(benches.items()):
+        if args.names and name not in args.names:
+            continue
+        result = {"bench": name, "flags": args.flags}
+        walls = []
+        rss = 0
+        status = 0
+        for _ in range(args.repeat):
+            wall, maxrss, status, err = run_once([args.bin] + flags, path)
+            if status != 0:
+                result["error"] = err.strip()
+                break
+            walls.append(wall)
+            rss = max(rss, maxrss)
+        if status == 0:
+            result["wall_s"] = round(min(walls), 4)
+            result["max_rss_kb"] = rss
+            if args.stats_bin:
+                _, _, status, err = run_once([args.stats_bin, "--stats"] + flags, path)
+                m = re.search(r"^stats: (.*)$", err, re.M)
+                if status == 0 and m:
+                    for item in m.group(1).split():
+                        key, value = item.split("=")
+                        result[key] = int(value)
+                else:
+                    result["error"] = err.strip()
+            if args.check and output([args.bin] + flags, path) != output([args.bin], path):
+                result["error"] = "output differs from a run without flags"
+        failed = failed or "error" in result
+        print(json.dumps(result), flush=True)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
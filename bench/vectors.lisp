@@ -0,0 +1,34 @@
+;; 向量：矩阵乘法，大量按下标读取和少量写入
+(defun make-row (n i j row)
+  (if (= j n)
+      row
+      (vector-set! row j (+ i j))
+      (make-row n i (+ j 1) row)))
+
+(defun make-matrix (n i m)
+  (if (= i n)
+      m
+      (vector-set! m i (make-row n i 0 (make-vector n 0)))
+      (make-matrix n (+ i 1) m)))
+
+;; a 的一行和 b 的第 k 列的内积
+(defun dot (a b j k n acc)
+  (if (= j n)
+      acc
+      (dot a b (+ j 1) k n (+ acc (* (vector-ref a j) (vector-ref (vector-ref b j) k))))))
+
+(defun mul-row (a b k n out)
+  (if (= k n)
+      out
+      (vector-set! out k (dot a b 0 k n 0))
+      (mul-row a b (+ k 1) n out)))
+
+(defun mul (a b i n c)
+  (if (= i n)
+      c
+      (vector-set! c i (mul-row (vector-ref a i) b 0 n (make-vector n 0)))
+      (mul a b (+ i 1) n c)))
+
+(define n 60)
+(define a (make-matrix n 0 (make-vector n 0)))
+(vector-ref (vector-ref (mul a a 0 n (make-vector n 0)) (- n 1)) (- n 1))
@@ -0,0 +1,160 @@
+/**
+ 嵌入接口的回归测试，由 make test 构建并运行。每个检查失败时打印出来，
+ 有失败时退出码为 1
+ */
+#include <stdio.h>
+#include <string.h>
+#include "minilisp.h"
+
+static int failed;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+// 求值 src，检查是否成功以及结果（或者错误报告的开头）
+static void expect(MiniLisp *lisp, const char *src, bool ok, const char *want) {
+    char out[1024];
+    bool r = minilisp_eval(lisp, src, out, sizeof(out));
+    if (r != ok || strncmp(out, want, strlen(want))) {
+        fprintf(stderr, "%s: got %s \"%s\", expected %s \"%s\"\n",
+                src, r ? "ok" : "error", out, ok ? "ok" : "error", want);
+        failed = 1;
+    }
+}
+
+// 建一个 20000 层的嵌套列表，64KB 的堆放不下
+#define BIG_LIST "(defun build (n acc) (if (= n 0) acc (build (- n 1) (list n acc))))" \
+                 "(define x (build 20000 ()))"
+
+// minilisp_new_with 的选项
+static void test_options(void) {
+    char err[256];
+    MiniLispOptions small = { .heap_size = 64 * 1024 };
+    MiniLisp *lisp = minilisp_new_with(&small, err, sizeof(err));
+    CHECK(lisp);
+    expect(lisp, BIG_LIST, false, "<string>:1: Memory exhausted");
+    minilisp_free(lisp);
+
+    MiniLispOptions big = { .heap_size = 64 * 1024 * 1024 };
+    lisp = minilisp_new_with(&big, err, sizeof(err));
+    CHECK(lisp);
+    expect(lisp, BIG_LIST "'done", true, "done");
+    minilisp_free(lisp);
+
+    MiniLispOptions shallow = { .max_depth = 50, .vm = true };
+    lisp = minilisp_new_with(&shallow, err, sizeof(err));
+    CHECK(lisp);
+    expect(lisp, "(defun f (n) (if (= n 0) 0 (+ 1 (f (- n 1))))) (f 40)", true, "40");
+    expect(lisp, "(f 100)", false, "<string>:1: Stack overflow: nesting deeper than 50");
+    minilisp_free(lisp);
+
+    MiniLispOptions bad = { .heap_size = 100 };
+    CHECK(!minilisp_new_with(&bad, err, sizeof(err)));
+    CHECK(!strcmp(err, "Heap size too small"));
+
+    lisp = minilisp_new_with(NULL, err, sizeof(err));
+    CHECK(lisp);
+    expect(lisp, "(+ 1 2)", true, "3");
+    minilisp_free(lisp);
+}
+
+// 依次求值解析器队列里的表达式，检查结果都是 want，然后队列是空的
+static void expect_forms(MiniLispParser *parser, int n, const char *want) {
+    char out[1024];
+    for (int i = 0; i < n; i++) {
+        int r = minilisp_parser_eval(parser, out, sizeof(out));
+        if (r != 1 || strcmp(out, want)) {
+            fprintf(stderr, "form %d: got %d \"%s\", expected \"%s\"\n", i, r, r ? out : "", want);
+            failed = 1;
+        }
+    }
+    int r = minilisp_parser_eval(parser, out, sizeof(out));
+    if (r != 0) {
+        fprintf(stderr, "unexpected form: %d \"%s\"\n", r, out);
+        failed = 1;
+    }
+}
+
+// 出错之后增量解析器要丢掉整个没有读完的表达式，即使剩下的部分在之后的块里
+static void test_parser_recovery(void) {
+    char err[1024];
+    MiniLispOptions small = { .heap_size = 64 * 1024 };
+    MiniLisp *lisp = minilisp_new_with(&small, err, sizeof(err));
+    CHECK(lisp);
+    MiniLispParser *parser = minilisp_parser_new(lisp, "test");
+    CHECK(parser);
+
+    // 嵌套很深的引用在读到一半时耗尽内存，剩下的部分不能当作新的表达式
+    enum { DEPTH = 20000 };
+    static char buf[DEPTH * 2 + 64];
+    size_t n = 0;
+    buf[n++] = '\'';
+    for (int i = 0; i < DEPTH; i++) {
+        buf[n++] = '(';
+    }
+    n += sprintf(buf + n, "(error \"(data\") ; )\n");
+    for (int i = 0; i < DEPTH; i++) {
+        buf[n++] = ')';
+    }
+    n += sprintf(buf + n, " (+ 1 2)");
+    // 分成几块交给解析器，出错之后的块里还有这个表达式的一部分
+    CHECK(!minilisp_parser_feed(parser, buf, DEPTH, err, sizeof(err)));
+    CHECK(!strcmp(err, "test:1: Memory exhausted"));
+    CHECK(minilisp_parser_feed(parser, buf + DEPTH, n - DEPTH - 4, err, sizeof(err)));
+    CHECK(minilisp_parser_feed(parser, buf + n - 4, 4, err, sizeof(err)));
+    CHECK(minilisp_parser_finish(parser, err, sizeof(err)));
+    expect_forms(parser, 1, "3");
+
+    minilisp_parser_free(parser);
+
+    // 列表里的语法错误也丢掉整个列表，之后同一行的表达式照常读取
+    parser = minilisp_parser_new(lisp, "test");
+    CHECK(parser);
+    const char *src = "(a . b c \")\" (error 'x)) (+ 1 2)\n(a . ) (error 'y)\n(+ 1 2)";
+    CHECK(!minilisp_parser_feed(parser, src, strlen(src), err, sizeof(err)));
+    CHECK(!strcmp(err, "test:1:9: Closed parenthesis excepted after dot"));
+    CHECK(minilisp_parser_finish(parser, err, sizeof(err)));
+    expect_forms(parser, 2, "3");
+
+    minilisp_parser_free(parser);
+    minilisp_free(lisp);
+}
+
+// pmap 的线程池是共用的，先用它的解释器的选项不能限制之后堆更大、嵌套更深的解释器
+static void test_shared_pool(void) {
+    char err[256];
+    MiniLispOptions small = { .heap_size = 64 * 1024, .max_depth = 100 };
+    MiniLisp *a = minilisp_new_with(&small, err, sizeof(err));
+    CHECK(a);
+    expect(a, "(pmap (lambda (x) x) (list 1 2))", true, "(1 2)");
+
+    MiniLispOptions big = { .heap_size = 64 * 1024 * 1024, .max_depth = 20000 };
+    MiniLisp *b = minilisp_new_with(&big, err, sizeof(err));
+    CHECK(b);
+    // 每层递归都留着一个向量，一共要几 MB 的堆和 5000 层嵌套
+    expect(b, "(defun r (n) (if (= n 0) 0 ((lambda (v) (+ (r (- n 1)) (vector-length v))) (make-vector 100 0))))",
+           true, "");
+    expect(b, "(r 5000)", true, "500000");
+    expect(b, "(pmap r (list 5000 5000 5000 5000))", true, "(500000 500000 500000 500000)");
+
+    // 线程池按 b 的选项重新创建之后，a 的嵌套深度仍然按它自己的限制
+    expect(a, "(defun f (n) (if (= n 0) 0 (+ 1 (f (- n 1)))))", true, "");
+    expect(a, "(pmap f (list 10 200))", false, "<string>:1: Stack overflow: nesting deeper than 100");
+    expect(a, "(pmap f (list 10 20))", true, "(10 20)");
+    minilisp_free(a);
+    minilisp_free(b);
+}
+
+int main(void) {
+    test_options();
+    test_parser_recovery();
+    test_shared_pool();
+    if (!failed) {
+        printf("ok   embed\n");
+    }
+    return failed;
+}
@@ -0,0 +1,32 @@
+;; 整数运算和比较在所有执行方式下按同样的顺序求值参数、检查类型：
+;; 先求出下一个参数，再检查参与这一步运算的两个值
+(defun show (msg) (println msg))
+(defun f (x) (+ x (println 'side-effect)))
+(catch (f 'a) show)
+(catch (+ 'a (println 'side-effect)) show)
+(defun g (x) (< x (println 'side-effect)))
+(catch (g 'a) show)
+(catch (< 'a (println 'side-effect)) show)
+(defun h (x y) (- x y (println 'third)))
+(catch (h 'a 1) show)
+(catch (h 1 'b) show)
+(catch (- 'a 1 (println 'third)) show)
+(defun k (x) (* (println 'left) x))
+(catch (k 2) show)
+(defun m (x) (/ x 0 (println 'after-zero)))
+(catch (m 4) show)
+(catch (/ 4 0 (println 'after-zero)) show)
+(defun neg (x) (- x))
+(catch (neg 'a) show)
+
+;; 调用足够多次，--jit 时这些函数会被编译成机器码
+(define n 0)
+(defun bump () (setq n (+ n 1)) ())
+(defun p (x) (+ x (bump)))
+(defun q (x) (= x (bump)))
+(defun ignore (msg) ())
+(defun repeat (i)
+  (catch (p 'a) ignore)
+  (catch (q 'a) ignore)
+  (if (= i 0) n (repeat (- i 1))))
+(println (repeat 1500))
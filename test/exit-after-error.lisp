@@ -0,0 +1,6 @@
+;; status: 1
+;; 报告过错误之后 (exit) 也要返回 1
+(undefined-function)
+(println 'before-exit)
+(exit)
+(println 'not-reached)
@@ -0,0 +1,44 @@
+;; 散列表：扩容时旧的桶分批搬走，搬到一半时插入、删除和查找都要正确
+(define h (make-hash-table))
+(defun fill (i n) (if (= i n) h (fill-step i n)))
+(defun fill-step (i n) (puthash i (* i i) h) (fill (+ i 1) n))
+;; 第 513 个键让桶数从 512 翻倍，每次修改搬 4 个旧的桶，到 600 时还没搬完
+(fill 0 600)
+(println (hash-count h))
+
+;; 桶搬到一半时删除：要删的键有的在旧的桶里，有的已经搬走了
+(defun drop (i n) (if (< i n) (drop-step i n) h))
+(defun drop-step (i n) (remhash i h) (drop (+ i 2) n))
+(drop 0 400)
+(println (hash-count h))
+(fill 600 1000)
+(println (hash-count h))
+(println (list (gethash 0 h 'gone) (gethash 398 h 'gone) (gethash 399 h) (gethash 400 h) (gethash 999 h)))
+
+;; 检查每个键：偶数的前 200 个删掉了，其余的都在
+(defun expected (i) (if (< i 400) (if (= (mod i 2) 0) -1 (* i i)) (* i i)))
+(defun check (i n bad) (if (= i n) bad (check (+ i 1) n (if (= (gethash i h -1) (expected i)) bad (+ bad 1)))))
+(println (check 0 1000 0))
+
+;; 标志作为键，同名的是同一个键
+(define s (make-hash-table 1))
+(puthash 'a 1 s)
+(puthash 'b 2 s)
+(puthash 'c 3 s)
+(puthash 'a 10 s)
+(println (list (hash-count s) (gethash 'a s) (gethash 'b s) (gethash 'c s) (gethash 'd s)))
+(println (remhash 'b s))
+(println (remhash 'b s))
+(println (catch (gethash "str" s) (lambda (msg) msg)))
+
+;; maphash 的函数修改正在遍历的表：删掉看到的键，再加入新的键。遍历的是开始
+;; 时的条目，新加入的不会再被看到，删掉的条目仍然会遍历到
+(define m (make-hash-table))
+(puthash 1 'one m)
+(puthash 2 'two m)
+(puthash 3 'three m)
+(define seen 0)
+(maphash (lambda (k v) (setq seen (+ seen k)) (remhash k m) (remhash (- 5 k) m) (puthash (+ k 100) v m)) m)
+(println seen)
+(println (hash-count m))
+(println (list (gethash 101 m) (gethash 102 m) (gethash 103 m) (gethash 1 m) (gethash 2 m)))
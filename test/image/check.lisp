@@ -0,0 +1,18 @@
+(defun show-all ()
+  (println (fact 10))
+  (println (twice 21))
+  (println vec)
+  (println (gethash 'apple table))
+  (println (gethash 'pear table))
+  (println (gethash 42 table))
+  (println (hash-count table))
+  (println lst)
+  (println built))
+(show-all)
+;; 分配足够多的内存触发 GC，映像里的对象被复制走之后还要一样
+(defun churn (n) (make-vector 100000 0) (if (= n 0) 0 (churn (- n 1))))
+(churn 200)
+(show-all)
+(puthash 'banana 3 table)
+(println (gethash 'banana table))
+(println (hash-count table))
@@ -0,0 +1,12 @@
+;; 保存进映像的定义。run.py 在后面加上 (save-image ...)，用 --image 装载之后
+;; 由 check.lisp 检查它们
+(defun fact (n) (if (= n 0) 1 (* n (fact (- n 1)))))
+(defmacro twice (x) (list '+ x x))
+(define vec (vector 1 "two" '(3 4) #(5)))
+(define table (make-hash-table))
+(puthash 'apple 1 table)
+(puthash 'pear 2 table)
+(puthash 42 '(x y) table)
+;; 读取器和 list 都分配 CDR 编码的连续单元
+(define lst '(a b c (d e) f))
+(define built (list 1 2 3 4 5))
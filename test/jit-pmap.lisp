@@ -0,0 +1,7 @@
+;; pmap 的工作线程编译的函数复制回父解释器之后仍然可以调用
+(defun loop (f i) (if (= i 0) (f 3) (loop f (- i 1))))
+(defun mk (n) (lambda (x) (if (= x 0) n (+ x n))))
+(define fs (pmap (lambda (n) ((lambda (f) (loop f 3000) f) (mk n))) '(1 2 3 4 5 6 7 8)))
+(println (pmap (lambda (f) (loop f 3000)) fs))
+(println (pmap (lambda (n) (loop (mk n) 3000)) '(10 20 30)))
+(println (loop (vector-ref (list->vector fs) 0) 5000))
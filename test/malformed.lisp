@@ -0,0 +1,8 @@
+;; status: 1
+;; 格式不对的特殊格式报告错误，不能让进程崩溃
+(defun)
+(defmacro)
+(println)
+(println 1 2)
+(defun f)
+(println 'done)
@@ -0,0 +1,41 @@
+;; --compile-to-c 的测试库：run.py 把它编译成 C、构建成共享库，用 load-native
+;; 装载的输出要和直接 load 这个文件相同。装载之后 run.py 还会重新定义 square，
+;; 编译好的 sum-squares 要调用新的定义
+
+(defmacro unless (c x) (list 'if c () x))
+(defmacro inc (v) (list 'setq v (list '+ v 1)))
+
+;; 尾部调用自己，参数用 setq 修改
+(defun count-up (i n acc)
+  (inc acc)
+  (setq i (+ i 1))
+  (if (= i n) acc (count-up i n acc)))
+
+;; 互相尾部调用
+(defun my-even (n) (if (= n 0) t (my-odd (- n 1))))
+(defun my-odd (n) (if (= n 0) () (my-even (- n 1))))
+
+;; 直接调用另一个编译好的函数，不是尾部调用
+(defun square (x) (* x x))
+(defun sum-squares (a b) (+ (square a) (square b)))
+
+;; 常量：引用的列表、向量和字符串
+(defun consts () (list '(a (b . c)) #(1 "two" (3)) "str\"ing"))
+
+;; fixnum 溢出时交给 rt->arith 报错
+(defun big (x) (* x 1000000000000))
+
+;; 用到 lambda，这个函数不编译，按源代码嵌进生成的文件
+(defun adder (n) (lambda (x) (+ x n)))
+
+(defun negate-all (x) (unless (= x 0) (- 0 x)))
+
+(println (count-up 0 1000000 0))
+(println (my-even 100001))
+(println (sum-squares 3 4))
+(println (consts))
+(println ((adder 10) 5))
+(println (negate-all 7))
+(println (negate-all 0))
+(println (big 1000))
+(println (catch (big 1000000000) (lambda (msg) msg)))
@@ -0,0 +1,8 @@
+;; status: 1
+;; 读到一半出错的表达式要整个丢掉，剩下的部分不能当作新的表达式求值
+(a . )
+(println 1)
+(a . b c) (println 2)
+'(1 "x)" (2 . ) ; )
+  (println 'not-evaluated))
+(println 3)
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""运行 test/ 下的回归测试。
+
+每个测试 NAME.lisp 用 --batch 从标准输入交给解释器，标准输出和标准错误合在
+一起，要和 NAME.out 完全相同。同一个测试依次用解释器、--vm 和 --jit（只在 x86-64 上）
+运行，几种执行方式的结果都要符合预期。测试开头的注释可以指定：
+
+    ;; args: --heap 1m      额外的命令行选项
+    ;; status: 1           预期的退出码，默认是 0
+
+太大不适合放进仓库的输入由这个脚本生成（见 GENERATED），放在 --work 目录里，
+预期的输出仍然是 test/NAME.out。
+
+测试 native 用 --compile-to-c 把 test/native/lib.lisp 编译成 C，用 --cc 指定的
+编译器构建成共享库（打开 -Wall -Wextra -Werror），用 load-native 装载的输出要和
+直接 load 这个文件相同。
+
+测试 image 求值 test/image/lib.lisp 之后用 save-image 保存映像，再用 --image
+装载它运行 test/image/check.lisp，输出要和 check.out 相同。装载时用默认的堆和
+更大的堆各运行一次，后者放不回保存时的地址，要走平移指针的路径。损坏和截断的
+映像要被拒绝。
+
+    python3 test/run.py --bin build/minilisp
+    python3 test/run.py --bin build/minilisp reader-oom
+    python3 test/run.py --bin build/minilisp --cc clang native
+"""
+
+import argparse
+import difflib
+import os
+import platform
+import shlex
+import subprocess
+import sys
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def gen_reader_oom():
+    """一个读到一半就耗尽内存的长列表，里面藏着一个不能被求值的表达式。"""
+    items = " ".join(str(i) for i in range(300000))
+    return (";; args: --heap 1m\n;; status: 1\n"
+            "(define x '(%s (println (quote EXECUTED-FROM-DATA))))\n"
+            "(println 'after)\n" % items)
+
+
+GENERATED = {
+    "reader-oom": gen_reader_oom,
+}
+
+
+# 装载之后重新定义库里编译好的函数，调用它的编译好的函数要改用新的定义
+NATIVE_AFTER = "(defun square (x) (+ x x))\n(println (sum-squares 3 4))\n"
+
+
+def run(cmd, stdin=None):
+    """运行 cmd，返回 (退出码, 合在一起的标准输出和标准错误)。"""
+    proc = subprocess.run(cmd, input=stdin, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    return proc.returncode, proc.stdout
+
+
+def test_native(args, modes):
+    """编译 test/native/lib.lisp，比较 load-native 和 load 的输出。返回失败的个数。"""
+    src = os.path.join(TEST_DIR, "native", "lib.lisp")
+    c_file = os.path.join(args.work, "native.c")
+    lib = os.path.abspath(os.path.join(args.work, "native.so"))
+    include = os.path.join(TEST_DIR, os.pardir, "Lisp")
+    steps = [
+        [args.bin, "--compile-to-c", src, c_file],
+        shlex.split(args.cc) + ["-std=gnu11", "-shared", "-fPIC", "-Wall", "-Wextra", "-Werror",
+                                "-I", include, "-o", lib, c_file],
+    ]
+    for cmd in steps:
+        status, out = run(cmd)
+        if status != 0:
+            print("FAIL native: %s" % " ".join(cmd))
+            sys.stdout.write(out.decode(errors="replace"))
+            return 1
+    failed = 0
+    for mode in modes:
+        outputs = []
+        for load in ('(load "%s")' % src, '(load-native "%s")' % lib):
+            cmd = [args.bin, "--batch"] + ([mode] if mode else [])
+            outputs.append(run(cmd, (load + "\n" + NATIVE_AFTER).encode()))
+        if outputs[0] != outputs[1] or outputs[0][0] != 0:
+            failed += 1
+            print("FAIL native %s: load exited %d, load-native exited %d" % (mode or "(eval)", outputs[0][0], outputs[1][0]))
+            sys.stdout.writelines(difflib.unified_diff(
+                outputs[0][1].decode(errors="replace").splitlines(True),
+                outputs[1][1].decode(errors="replace").splitlines(True), "load", "load-native"))
+        else:
+            print("ok   native %s" % (mode or "(eval)"))
+    return failed
+
+
+def check(name, cmd, stdin, expected, status):
+    """运行 cmd，检查输出和退出码。失败时返回 1。"""
+    got_status, out = run(cmd, stdin)
+    if out != expected or got_status != status:
+        print("FAIL %s: exit %d, expected %d" % (name, got_status, status))
+        sys.stdout.write(out.decode(errors="replace"))
+        return 1
+    print("ok   %s" % name)
+    return 0
+
+
+def test_image(args, modes):
+    """保存 test/image/lib.lisp 的映像，用几种方式装载检查。返回失败的个数。"""
+    image_dir = os.path.join(TEST_DIR, "image")
+    image = os.path.join(args.work, "image.img")
+    with open(os.path.join(image_dir, "lib.lisp"), "rb") as f:
+        src = f.read() + b'(save-image "%s")\n' % image.encode()
+    if check("image save", [args.bin, "--batch"], src, b"", 0):
+        return 1
+    with open(os.path.join(image_dir, "check.lisp"), "rb") as f:
+        src = f.read()
+    with open(os.path.join(image_dir, "check.out"), "rb") as f:
+        expected = f.read()
+    failed = 0
+    for heap in ([], ["--heap", "64m"]):
+        for mode in modes:
+            cmd = [args.bin, "--batch"] + ([mode] if mode else []) + heap + ["--image", image]
+            failed += check("image %s" % " ".join(cmd[2:-2] or ["(eval)"]), cmd, src, expected, 0)
+
+    with open(image, "rb") as f:
+        data = f.read()
+    broken = [
+        ("magic", b"XXXX" + data[4:], "Not a MiniLisp image"),
+        ("truncated", data[:-1], "Corrupt image"),
+    ]
+    for name, content, message in broken:
+        path = os.path.join(args.work, "image-%s.img" % name)
+        with open(path, "wb") as f:
+            f.write(content)
+        failed += check("image %s" % name, [args.bin, "--batch", "--image", path], src,
+                        ("%s: %s\n" % (path, message)).encode(), 1)
+    return failed
+
+
+def directives(src):
+    """读取开头注释里的选项，返回 (额外的选项, 预期的退出码)。"""
+    args, status = [], 0
+    for line in src.splitlines():
+        if not line.startswith(";;"):
+            break
+        key, _, value = line[2:].strip().partition(":")
+        if key == "args":
+            args = shlex.split(value)
+        elif key == "status":
+            status = int(value)
+    return args, status
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--bin", default="build/minilisp", help="要测试的解释器")
+    ap.add_argument("--work", default="build/test", help="存放生成的输入的目录")
+    ap.add_argument("--cc", default=os.environ.get("CC", "cc"), help="构建 native 测试的共享库用的编译器")
+    ap.add_argument("names", nargs="*", help="只运行这些测试")
+    args = ap.parse_args()
+
+    os.makedirs(args.work, exist_ok=True)
+    tests = {}
+    for name in sorted(os.listdir(TEST_DIR)):
+        if name.endswith(".lisp"):
+            tests[name[:-5]] = os.path.join(TEST_DIR, name)
+    for name, gen in GENERATED.items():
+        if not args.names or name in args.names:
+            tests[name] = os.path.join(args.work, name + ".lisp")
+            with open(tests[name], "w") as f:
+                f.write(gen())
+
+    modes = ["", "--vm"]
+    if platform.machine() in ("x86_64", "AMD64"):
+        modes.append("--jit")
+    failed = 0
+    for name, path in sorted(tests.items()):
+        if args.names and name not in args.names:
+            continue
+        with open(path) as f:
+            extra, status = directives(f.read())
+        with open(os.path.join(TEST_DIR, name + ".out"), "rb") as f:
+            expected = f.read()
+        for mode in modes:
+            cmd = [args.bin, "--batch"] + ([mode] if mode else []) + extra
+            with open(path, "rb") as f:
+                proc = subprocess.run(cmd, stdin=f, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+            if proc.stdout != expected or proc.returncode != status:
+                failed += 1
+                print("FAIL %s %s: exit %d, expected %d" % (name, mode or "(eval)", proc.returncode, status))
+                sys.stdout.write(proc.stdout.decode(errors="replace"))
+            else:
+                print("ok   %s %s" % (name, mode or "(eval)"))
+    if not args.names or "image" in args.names:
+        failed += test_image(args, modes)
+    if not args.names or "native" in args.names:
+        failed += test_native(args, modes)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,18 @@
+;; 尾部调用不会让栈变深，深度递归超过 --max-depth 时报错，能被 catch 接住
+(defun loop (n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1))))
+(println (loop 1000000 0))
+
+;; 互相尾部调用，以及经过 if 和 lambda 的尾部调用
+(defun ping (n) (if (= n 0) 'ping (pong (- n 1))))
+(defun pong (n) (if (= n 0) 'pong (ping (- n 1))))
+(println (ping 1000001))
+(defun count-down (n) (if (= n 0) 'done ((lambda (m) (count-down m)) (- n 1))))
+(println (count-down 1000000))
+
+;; 不是尾部调用的递归，超过默认的 100000 层
+(defun depth (n) (if (= n 0) 0 (+ 1 (depth (- n 1)))))
+(println (depth 50000))
+(println (catch (depth 1000000) (lambda (msg) msg)))
+;; 出错之后嵌套深度恢复了，同样的递归还能继续用
+(println (depth 50000))
+(println (catch (loop 1000000 (depth 200000)) (lambda (msg) msg)))
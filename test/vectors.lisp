@@ -0,0 +1,26 @@
+;; 向量：创建、下标访问和越界检查
+(define v (make-vector 5 0))
+(defun fill-squares (i) (if (= i 5) v (set-square i)))
+(defun set-square (i) (vector-set! v i (* i i)) (fill-squares (+ i 1)))
+(println (fill-squares 0))
+(println (vector-length v))
+(println (vector-ref v 4))
+(println (vector 1 'a "s" '(x) #(y)))
+(println (vector->list v))
+(println (list->vector '(1 2 3)))
+(println (vector-length (make-vector 0 0)))
+(vector-fill! v 7)
+(println v)
+(define w (make-vector 3 0))
+(vector-copy! w 0 (vector-copy v 1 4))
+(println w)
+
+;; 越界的下标、不是整数的下标都是错误，能被 catch 接住
+(defun try (thunk) (catch (thunk) (lambda (msg) msg)))
+(println (try (lambda () (vector-ref v 5))))
+(println (try (lambda () (vector-ref v -1))))
+(println (try (lambda () (vector-set! v 5 0))))
+(println (try (lambda () (vector-ref v 'a))))
+(println (try (lambda () (vector-ref '(1 2) 0))))
+(println (try (lambda () (make-vector -1 0))))
+(println v)